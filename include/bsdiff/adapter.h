@@ -55,11 +55,13 @@ typedef size_t (*fs_read_func_t)(const bsdiff_stream_t *fs, void *buffer,
                                  size_t size);
 typedef size_t (*fs_write_func_t)(bsdiff_stream_t *fs, void *buffer,
                                   size_t size);
+typedef int (*fs_rewind_func_t)(const bsdiff_stream_t *fs);
 
 struct bsdiff_stream {
   void *opaque;
   fs_read_func_t read;
   fs_write_func_t write;
+  fs_rewind_func_t rewind; // back to where the patch begins, may be NULL
 };
 
 #ifdef __cplusplus
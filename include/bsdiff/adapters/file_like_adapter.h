@@ -0,0 +1,659 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __BSDIFF_FILE_LIKE_ADAPTER_H__
+#define __BSDIFF_FILE_LIKE_ADAPTER_H__
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../adapter.h"
+
+/**
+ * An array-like adapter over a file descriptor (a regular file or a block
+ * device). bspatch reads and writes a byte at a time, so the adapter keeps a
+ * small cache of large blocks: misses read ahead in the direction of travel,
+ * and dirty blocks are written back when they are evicted without waiting for
+ * the write to finish.
+ *
+ * On Linux the block I/O goes through io_uring with the cache buffers
+ * registered as fixed buffers. Define BSDIFF_NO_IO_URING, or run on a kernel
+ * without io_uring, to fall back to synchronous pread/pwrite.
+ *
+ * The buffers and block offsets are aligned, so fd may be opened with
+ * O_DIRECT. Call file_like_set_direct with the logical sector size then, and
+ * truncate regular files to the real size afterwards, the last block is
+ * written rounded up to a whole sector.
+ *
+ * With file_like_set_sparse, blocks that are all zeros are not written out:
+ * past the old end of the file they are skipped, before it they are punched
+ * out. Only for regular files, the caller truncates them to size at the end.
+ */
+#if defined(__linux__) && !defined(BSDIFF_NO_IO_URING) &&                      \
+    __has_include(<linux/io_uring.h>)
+#define FILE_LIKE_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef FILE_LIKE_BLOCK_SIZE
+#define FILE_LIKE_BLOCK_SIZE (64 * 1024)
+#endif
+#define FILE_LIKE_BLOCKS 16
+#define FILE_LIKE_READAHEAD 4
+#define FILE_LIKE_BUFFER_ALIGN 4096
+
+#define FILE_LIKE_IDLE 0
+#define FILE_LIKE_READING 1
+#define FILE_LIKE_WRITING 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct file_like_block {
+  uint8_t *data;
+  int64_t index; // block number in the file, -1 if unused
+  uint64_t used; // lru stamp
+  uint8_t dirty;
+  uint8_t state; // FILE_LIKE_*
+} file_like_block_t;
+
+#ifdef FILE_LIKE_HAVE_IO_URING
+typedef struct file_like_ring {
+  int fd;
+  uint8_t fixed; // cache buffers are registered
+
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr, *cq_ptr;
+  size_t sq_sz, cq_sz, sqes_sz;
+} file_like_ring_t;
+#endif
+
+typedef struct file_like {
+  int fd;
+  size_t sz;       // size seen by bspatch
+  size_t end;      // bytes that may be written back, grows with writes
+  size_t disk_end; // bytes worth reading from fd, the rest reads as 0
+  size_t align;    // writes are rounded up to this, for O_DIRECT
+  uint8_t sparse;  // zero blocks become holes
+  int err;
+
+  uint8_t *arena;
+  file_like_block_t blocks[FILE_LIKE_BLOCKS];
+  uint64_t clock;
+  int64_t last_index; // for the readahead direction
+
+#ifdef FILE_LIKE_HAVE_IO_URING
+  file_like_ring_t ring;
+  uint8_t use_ring;
+#endif
+} file_like_t;
+
+// length of the write back of block `index`
+__attribute__((weak)) size_t file_like_io_len(const file_like_t *fl,
+                                              int64_t index) {
+  size_t off, len;
+
+  off = (size_t)index * FILE_LIKE_BLOCK_SIZE;
+  if (off >= fl->end) {
+    return 0;
+  }
+
+  len = fl->end - off;
+  if (len >= FILE_LIKE_BLOCK_SIZE) {
+    return FILE_LIKE_BLOCK_SIZE;
+  }
+
+  return (len + fl->align - 1) / fl->align * fl->align;
+}
+
+// account a finished io on block `slot`, res is the result of pread/pwrite
+__attribute__((weak)) void file_like_complete(file_like_t *fl, int slot,
+                                              ssize_t res) {
+  file_like_block_t *blk;
+
+  blk = &fl->blocks[slot];
+  if (blk->state == FILE_LIKE_READING) {
+    if (res < 0) {
+      fl->err = (int)-res;
+      res = 0;
+    }
+    // anything past the end of the file reads as 0
+    memset(blk->data + res, 0, FILE_LIKE_BLOCK_SIZE - res);
+  } else if (blk->state == FILE_LIKE_WRITING) {
+    if (res < 0 || (size_t)res != file_like_io_len(fl, blk->index)) {
+      fl->err = res < 0 ? (int)-res : EIO;
+    }
+  }
+
+  blk->state = FILE_LIKE_IDLE;
+}
+
+#ifdef FILE_LIKE_HAVE_IO_URING
+__attribute__((weak)) int file_like_ring_init(file_like_t *fl) {
+  file_like_ring_t *ring;
+  struct io_uring_params p;
+  struct iovec iov[FILE_LIKE_BLOCKS];
+  int i;
+
+  ring = &fl->ring;
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, FILE_LIKE_BLOCKS * 2, &p);
+  if (ring->fd < 0) {
+    return -1;
+  }
+
+  ring->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_sz > ring->sq_sz) {
+      ring->sq_sz = ring->cq_sz;
+    }
+    ring->cq_sz = ring->sq_sz;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->cq_ptr = ring->sq_ptr;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    ring->cq_ptr =
+        mmap(NULL, ring->cq_sz, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      munmap(ring->sq_ptr, ring->sq_sz);
+      close(ring->fd);
+      return -1;
+    }
+  }
+
+  ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cq_ptr != ring->sq_ptr) {
+      munmap(ring->cq_ptr, ring->cq_sz);
+    }
+    munmap(ring->sq_ptr, ring->sq_sz);
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->sq_head = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((uint8_t *)ring->sq_ptr + p.sq_off.array);
+  ring->cq_head = (unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)((uint8_t *)ring->cq_ptr + p.cq_off.ring_mask);
+  ring->cqes =
+      (struct io_uring_cqe *)((uint8_t *)ring->cq_ptr + p.cq_off.cqes);
+
+  // the cache buffers never move, register them once
+  for (i = 0; i < FILE_LIKE_BLOCKS; i++) {
+    iov[i].iov_base = fl->blocks[i].data;
+    iov[i].iov_len = FILE_LIKE_BLOCK_SIZE;
+  }
+  ring->fixed = syscall(__NR_io_uring_register, ring->fd,
+                        IORING_REGISTER_BUFFERS, iov, FILE_LIKE_BLOCKS) == 0;
+
+  return 0;
+}
+
+__attribute__((weak)) void file_like_ring_destroy(file_like_t *fl) {
+  file_like_ring_t *ring;
+
+  ring = &fl->ring;
+  munmap(ring->sqes, ring->sqes_sz);
+  if (ring->cq_ptr != ring->sq_ptr) {
+    munmap(ring->cq_ptr, ring->cq_sz);
+  }
+  munmap(ring->sq_ptr, ring->sq_sz);
+  close(ring->fd);
+}
+
+// drain the completion queue, block for at least one completion if `wait`
+__attribute__((weak)) int file_like_ring_reap(file_like_t *fl, int wait) {
+  file_like_ring_t *ring;
+  struct io_uring_cqe *cqe;
+  unsigned head;
+
+  ring = &fl->ring;
+  if (wait && syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+    if (errno != EINTR) {
+      fl->err = errno;
+      return -1;
+    }
+  }
+
+  head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    file_like_complete(fl, (int)cqe->user_data, cqe->res);
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return 0;
+}
+#endif
+
+__attribute__((weak)) int file_like_is_zero(const uint8_t *data, size_t len) {
+  return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+// turns [off, off + len) into a hole, returns 0 on success
+__attribute__((weak)) int file_like_punch(file_like_t *fl, off_t off,
+                                          size_t len) {
+  // nothing was ever written there, it is a hole already
+  if ((size_t)off >= fl->disk_end) {
+    return 0;
+  }
+
+#if defined(SYS_fallocate) && defined(FALLOC_FL_PUNCH_HOLE)
+  return syscall(SYS_fallocate, fl->fd,
+                 FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+                 (off_t)len) == 0
+             ? 0
+             : -1;
+#else
+  return -1;
+#endif
+}
+
+// start reading or writing back the block in `slot`
+__attribute__((weak)) void file_like_submit(file_like_t *fl, int slot,
+                                            uint8_t state) {
+  file_like_block_t *blk;
+  size_t len;
+  off_t off;
+  ssize_t res;
+
+  blk = &fl->blocks[slot];
+  blk->state = state;
+  off = (off_t)blk->index * FILE_LIKE_BLOCK_SIZE;
+  len = state == FILE_LIKE_READING ? FILE_LIKE_BLOCK_SIZE
+                                   : file_like_io_len(fl, blk->index);
+
+  // a block that was never on disk needs no read
+  if (state == FILE_LIKE_READING && (size_t)off >= fl->disk_end) {
+    file_like_complete(fl, slot, 0);
+    return;
+  }
+  // where punching fails the zeros are written as usual
+  if (state == FILE_LIKE_WRITING && fl->sparse &&
+      file_like_is_zero(blk->data, len) && file_like_punch(fl, off, len) == 0) {
+    file_like_complete(fl, slot, len);
+    return;
+  }
+  if (state == FILE_LIKE_WRITING && off + len > fl->disk_end) {
+    fl->disk_end = off + len;
+  }
+
+#ifdef FILE_LIKE_HAVE_IO_URING
+  if (fl->use_ring) {
+    file_like_ring_t *ring;
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    ring = &fl->ring;
+    tail = *ring->sq_tail;
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    if (ring->fixed) {
+      sqe->opcode = state == FILE_LIKE_READING ? IORING_OP_READ_FIXED
+                                               : IORING_OP_WRITE_FIXED;
+      sqe->buf_index = slot;
+    } else {
+      sqe->opcode =
+          state == FILE_LIKE_READING ? IORING_OP_READ : IORING_OP_WRITE;
+    }
+    sqe->fd = fl->fd;
+    sqe->addr = (uint64_t)(uintptr_t)blk->data;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = slot;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) == 1) {
+      return;
+    }
+    // the kernel did not take it, complete it synchronously below
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  }
+#endif
+
+  if (state == FILE_LIKE_READING) {
+    res = pread(fl->fd, blk->data, len, off);
+  } else {
+    res = pwrite(fl->fd, blk->data, len, off);
+  }
+  file_like_complete(fl, slot, res < 0 ? -errno : res);
+}
+
+__attribute__((weak)) void file_like_wait(file_like_t *fl, int slot) {
+  while (fl->blocks[slot].state != FILE_LIKE_IDLE) {
+#ifdef FILE_LIKE_HAVE_IO_URING
+    if (file_like_ring_reap(fl, 1) != 0) {
+      return;
+    }
+#endif
+  }
+}
+
+// find a slot to reuse, dirty victims are written back on the way
+__attribute__((weak)) int file_like_evict(file_like_t *fl) {
+  file_like_block_t *blk;
+  int i, victim;
+
+  for (;;) {
+    victim = -1;
+    for (i = 0; i < FILE_LIKE_BLOCKS; i++) {
+      blk = &fl->blocks[i];
+      if (blk->state != FILE_LIKE_IDLE) {
+        continue;
+      }
+      if (blk->index < 0) {
+        return i;
+      }
+      if (victim < 0 || blk->used < fl->blocks[victim].used) {
+        victim = i;
+      }
+    }
+
+    if (victim >= 0 && !fl->blocks[victim].dirty) {
+      return victim;
+    }
+
+    if (victim >= 0) {
+      fl->blocks[victim].dirty = 0;
+      file_like_submit(fl, victim, FILE_LIKE_WRITING);
+      continue;
+    }
+
+    // every buffer is in flight, wait for one of them
+#ifdef FILE_LIKE_HAVE_IO_URING
+    if (file_like_ring_reap(fl, 1) != 0) {
+      return -1;
+    }
+#else
+    return -1;
+#endif
+  }
+}
+
+__attribute__((weak)) int file_like_find(const file_like_t *fl,
+                                         int64_t index) {
+  int i;
+
+  for (i = 0; i < FILE_LIKE_BLOCKS; i++) {
+    if (fl->blocks[i].index == index) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// returns the slot holding block `index`, reading it (and ahead) on a miss
+__attribute__((weak)) int file_like_get(file_like_t *fl, int64_t index) {
+  int64_t dir, ra;
+  int slot, ra_slot, i;
+
+  slot = file_like_find(fl, index);
+  if (slot < 0) {
+    slot = file_like_evict(fl);
+    if (slot < 0) {
+      return -1;
+    }
+    fl->blocks[slot].index = index;
+    fl->blocks[slot].dirty = 0;
+    fl->blocks[slot].used = ++fl->clock;
+    file_like_submit(fl, slot, FILE_LIKE_READING);
+
+    // queue the next blocks in the direction of travel
+    dir = index < fl->last_index ? -1 : 1;
+    for (i = 1; i <= FILE_LIKE_READAHEAD; i++) {
+      ra = index + dir * i;
+      if (ra < 0 || (size_t)ra * FILE_LIKE_BLOCK_SIZE >= fl->disk_end ||
+          file_like_find(fl, ra) >= 0) {
+        continue;
+      }
+      // with the rest in flight, the block itself may be the one left idle
+      ra_slot = file_like_evict(fl);
+      if (ra_slot < 0 || ra_slot == slot) {
+        break;
+      }
+      fl->blocks[ra_slot].index = ra;
+      fl->blocks[ra_slot].dirty = 0;
+      fl->blocks[ra_slot].used = fl->clock - i;
+      file_like_submit(fl, ra_slot, FILE_LIKE_READING);
+    }
+  }
+
+  fl->last_index = index;
+  fl->blocks[slot].used = ++fl->clock;
+  file_like_wait(fl, slot);
+
+  return fl->err ? -1 : slot;
+}
+
+__attribute__((weak)) size_t file_like_read(const bsdiff_array_like_t *arr,
+                                            size_t offset, void *buffer,
+                                            size_t size) {
+  file_like_t *fl;
+  size_t done, n, off;
+  int slot;
+
+  fl = (file_like_t *)arr->opaque;
+
+  for (done = 0; done < size; done += n) {
+    off = (offset + done) % FILE_LIKE_BLOCK_SIZE;
+    n = FILE_LIKE_BLOCK_SIZE - off;
+    if (n > size - done) {
+      n = size - done;
+    }
+
+    slot = file_like_get(fl, (offset + done) / FILE_LIKE_BLOCK_SIZE);
+    if (slot < 0) {
+      break;
+    }
+    memcpy((uint8_t *)buffer + done, fl->blocks[slot].data + off, n);
+  }
+
+  return done;
+}
+
+__attribute__((weak)) size_t file_like_write(bsdiff_array_like_t *arr,
+                                             size_t offset, void *buffer,
+                                             size_t size) {
+  file_like_t *fl;
+  size_t done, n, off;
+  int slot;
+
+  fl = (file_like_t *)arr->opaque;
+
+  if (offset + size > fl->end) {
+    fl->end = offset + size;
+  }
+
+  for (done = 0; done < size; done += n) {
+    off = (offset + done) % FILE_LIKE_BLOCK_SIZE;
+    n = FILE_LIKE_BLOCK_SIZE - off;
+    if (n > size - done) {
+      n = size - done;
+    }
+
+    slot = file_like_get(fl, (offset + done) / FILE_LIKE_BLOCK_SIZE);
+    if (slot < 0) {
+      break;
+    }
+    memcpy(fl->blocks[slot].data + off, (uint8_t *)buffer + done, n);
+    fl->blocks[slot].dirty = 1;
+  }
+
+  return done;
+}
+
+__attribute__((weak)) size_t file_like_len(bsdiff_array_like_t *arr) {
+  const file_like_t *fl;
+
+  fl = (const file_like_t *)arr->opaque;
+
+  return fl->sz;
+}
+
+/* Writes every dirty block back and waits for all the I/O in flight. Returns
+ * 0 or the errno of the first failed I/O.
+ */
+__attribute__((weak)) int file_like_flush(file_like_t *fl) {
+  int i;
+
+  for (i = 0; i < FILE_LIKE_BLOCKS; i++) {
+    if (fl->blocks[i].dirty && fl->blocks[i].state == FILE_LIKE_IDLE) {
+      fl->blocks[i].dirty = 0;
+      file_like_submit(fl, i, FILE_LIKE_WRITING);
+    }
+  }
+
+  for (i = 0; i < FILE_LIKE_BLOCKS; i++) {
+    file_like_wait(fl, i);
+  }
+
+  return fl->err;
+}
+
+/* The caller owns fd, sz is the size of the data behind it. A write-only
+ * target may pass 0, its blocks are then never read back from fd. Returns 0
+ * or an errno.
+ */
+__attribute__((weak)) int make_file_like(file_like_t *fl, int fd, size_t sz) {
+  void *arena;
+  int i;
+
+  fl->fd = fd;
+  fl->sz = sz;
+  fl->end = sz;
+  fl->disk_end = sz;
+  fl->align = 1;
+  fl->sparse = 0;
+  fl->err = 0;
+  fl->clock = 0;
+  fl->last_index = 0;
+
+  // page aligned, so the same buffers also work for O_DIRECT
+  if (posix_memalign(&arena, FILE_LIKE_BUFFER_ALIGN,
+                     (size_t)FILE_LIKE_BLOCK_SIZE * FILE_LIKE_BLOCKS) != 0) {
+    return ENOMEM;
+  }
+  fl->arena = arena;
+
+  for (i = 0; i < FILE_LIKE_BLOCKS; i++) {
+    fl->blocks[i].data = fl->arena + (size_t)i * FILE_LIKE_BLOCK_SIZE;
+    fl->blocks[i].index = -1;
+    fl->blocks[i].used = 0;
+    fl->blocks[i].dirty = 0;
+    fl->blocks[i].state = FILE_LIKE_IDLE;
+  }
+
+#ifdef FILE_LIKE_HAVE_IO_URING
+  fl->use_ring = file_like_ring_init(fl) == 0;
+#endif
+
+  return 0;
+}
+
+/* For fds opened with O_DIRECT, sector is the logical sector size of the
+ * device (a power of two, at most FILE_LIKE_BUFFER_ALIGN).
+ */
+__attribute__((weak)) void file_like_set_direct(file_like_t *fl,
+                                                size_t sector) {
+  fl->align = sector;
+}
+
+// fd must be a regular file
+__attribute__((weak)) void file_like_set_sparse(file_like_t *fl) {
+  fl->sparse = 1;
+}
+
+/* Flushes and releases the cache, fd is left open. Returns like
+ * file_like_flush.
+ */
+__attribute__((weak)) int destroy_file_like(file_like_t *fl) {
+  int ret;
+
+  ret = file_like_flush(fl);
+
+#ifdef FILE_LIKE_HAVE_IO_URING
+  if (fl->use_ring) {
+    file_like_ring_destroy(fl);
+  }
+#endif
+
+  free(fl->arena);
+
+  return ret;
+}
+
+__attribute__((weak)) void make_file_like_adapter(bsdiff_array_like_t *arr,
+                                                  file_like_t *file_like) {
+  arr->opaque = file_like;
+  arr->len = file_like_len;
+  arr->write = file_like_write;
+  arr->read = file_like_read;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __BSDIFF_FILE_LIKE_ADAPTER_H__
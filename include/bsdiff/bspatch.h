@@ -39,14 +39,31 @@
 #define BSPATCH_SIGNATURE_INCONSISTENCY_ERR 4
 #define BSPATCH_SANITY_CHECK_ERR 5
 #define BSPATCH_DECOMPRESS_ERR 6
+#define BSPATCH_WRITE_NEW_ERR 7
+#define BSPATCH_IN_PLACE_ERR 8
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Applies the patch in place: new is built over old. A patch whose diff
+ * strings read old that is gone by then cannot be applied this way, and is
+ * refused with BSPATCH_IN_PLACE_ERR; bspatch_to can still apply it to a
+ * separate new. With patch->rewind, the whole patch is checked before old is
+ * written, and a refused patch leaves old as it was. Without it, the blocks
+ * are checked as they come, and old may be written in part.
+ */
 int bspatch(bsdiff_array_like_t *old, const bsdiff_stream_t *patch,
             size_t *new_size);
 
+/**
+ * Applies the patch without touching old, the result is written to new. Old
+ * is only read and new is only written, so they can be two partitions.
+ */
+int bspatch_to(bsdiff_array_like_t *old, bsdiff_array_like_t *new,
+               const bsdiff_stream_t *patch, size_t *new_size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,6 +34,38 @@
 
 #include "../patch_format.h"
 
+/* Try every codec on each chunk and keep the smallest output. */
+#define BSDIFF_CODEC_AUTO 0xff
+
+/* Match finders: the suffix array finds the longest matches, the hash index
+ * of every index_stride-th position of old is linear time and takes 1 to 2
+ * bytes per byte of old with the default stride, at some cost in patch size.
+ * The FM-index finds nearly the same matches as the suffix array in 1.4 bytes
+ * per byte of old instead of 8, but is slower to search. The sparse suffix
+ * array sorts only the suffixes at every index_stride-th position, up to 8,
+ * which on code of fixed-size instructions loses little. Either suffix array
+ * can be sorted lazily, only as far as new can match, see lazy_sort, and
+ * laid out for searching, see search_keys: each entry then carries the first
+ * 8 bytes of its suffix, so most steps of the binary search do not touch old.
+ * That is 16 bytes per entry instead of 8, which the sort needs anyway, and
+ * pays off once old is well past the size of the cache.
+ */
+#define BSDIFF_ENGINE_SUFFIX_ARRAY 0
+#define BSDIFF_ENGINE_HASH 1
+#define BSDIFF_ENGINE_FM_INDEX 2
+#define BSDIFF_ENGINE_SPARSE_SUFFIX_ARRAY 3
+
+/* Effort levels: how closely new is searched. The fast level searches every
+ * 8th byte of new instead of each one, takes a new match only when it gains
+ * more over the current one and compresses with the faster FastLZ level, for
+ * about half the search time. The max level holds on to a long alignment
+ * longer than the default, for smaller patches of loosely related files, and
+ * turns on lookahead.
+ */
+#define BSDIFF_EFFORT_FAST 0
+#define BSDIFF_EFFORT_DEFAULT 1
+#define BSDIFF_EFFORT_MAX 2
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,12 +77,173 @@ struct bsdiff_stream {
 
   void *(*malloc)(size_t size);
   void (*free)(void *ptr);
+  // returns 0 on success and a negative value on failure
   int (*write)(bsdiff_stream_t *stream, const void *buffer, int size);
+  // only for bsdiff_streaming and bsdiff_transcode: returns the bytes read,
+  // 0 at the end of the input and a negative value on failure
+  int (*read)(bsdiff_stream_t *stream, void *buffer, int size);
 };
 
+/* What applying the patch in place, with bspatch, costs the device: the rest
+ * of old is moved to make room for extra strings, and every flash page that
+ * is written to is rewritten. A patch with unreadable diff strings reads old
+ * that is gone by then, bspatch refuses it.
+ */
+typedef struct bsdiff_apply_cost {
+  int64_t shifts;     // times the rest of old is moved
+  int64_t shifted;    // bytes of old moved
+  int64_t written;    // bytes written to the image, moves included
+  int64_t pages;      // flash pages rewritten, of config->page_size bytes
+  int64_t peak;       // bytes the image takes at most
+  int64_t unreadable; // diff strings that read old bspatch has overwritten
+} bsdiff_apply_cost_t;
+
+typedef struct bsdiff_config {
+  uint8_t codec;             // BSDIFF_CODEC_*, used for diff and extra data
+  int64_t write_buffer_size; // output is coalesced up to this many bytes
+  // runs of 4096 or more of one byte in new are jumped over rather than
+  // searched, and go out as BSDIFF_CODEC_ZERO chunks
+  uint8_t zero_chunks;
+  // bytes for the index of old, 0 for no limit; when too small for all of old,
+  // new is diffed a window of old at a time, see src/lib/README.md
+  int64_t memory_budget;
+  uint8_t engine;            // BSDIFF_ENGINE_*
+  int64_t index_stride;      // hash and sparse engines index 1 in this many
+  uint8_t lazy_sort;         // sort only the suffixes of old new can match
+  uint8_t search_keys;       // keep 8 bytes of each suffix beside its entry
+  // old_sz + 1 entries from bsdiff_sa_build or bsdiff_sa_update, NULL to build
+  // an index; replaces the engine, memory_budget, lazy_sort and search_keys
+  const int64_t *old_sa;
+  uint8_t effort;            // BSDIFF_EFFORT_*
+  // milliseconds of wall clock, 0 for no limit; past it the rest of new is
+  // searched at the fast level, past twice it not at all
+  int64_t time_budget;
+  // weigh the matches in the next few bytes of new before taking one, so that
+  // one long match is not cut into several blocks
+  uint8_t lookahead;
+  // keep the patch applicable in place by bspatch, on by default; without it
+  // the patch may only apply with bspatch_to, see src/lib/README.md
+  uint8_t in_place;
+  int64_t page_size;         // flash page size apply_cost counts in
+  bsdiff_apply_cost_t *apply_cost; // filled in when not NULL
+  // BSDIFF_FILTER_*, for code of that machine; the patch then needs the
+  // bsdiff_header_v2_t that names it, which the caller of bsdiff_ex writes
+  uint8_t filter;
+  int64_t threads;           // bsdiff_bundle diffs this many files at once
+} bsdiff_config_t;
+
+/**
+ * Sets every field to its default: FastLZ, the suffix array, the default
+ * effort, in_place on and no budgets.
+ */
+void bsdiff_config_init(bsdiff_config_t *config);
+
 int bsdiff(const uint8_t *old, int64_t old_sz, const uint8_t *new,
            int64_t new_sz, bsdiff_stream_t *stream);
 
+int bsdiff_ex(const uint8_t *old, int64_t old_sz, const uint8_t *new,
+              int64_t new_sz, bsdiff_stream_t *stream,
+              const bsdiff_config_t *config);
+
+/**
+ * Builds the whole patch, header included, in one buffer allocated by
+ * stream->malloc. The chunks are compressed straight into that buffer, and it
+ * is handed over to the caller as is. stream->write is not used.
+ */
+int bsdiff_mem(const uint8_t *old, int64_t old_sz, const uint8_t *new,
+               int64_t new_sz, bsdiff_stream_t *stream,
+               const bsdiff_config_t *config, uint8_t **patch,
+               int64_t *patch_sz);
+
+/**
+ * Like bsdiff_ex, but new is read from stream->read while the blocks are
+ * written, a window at a time. Only old and its index have to be in memory.
+ * The size of new is not known before it ends, so the caller writes the
+ * header afterwards from *new_sz. memory_budget is not applied here.
+ */
+int bsdiff_streaming(const uint8_t *old, int64_t old_sz,
+                     bsdiff_stream_t *stream, const bsdiff_config_t *config,
+                     int64_t *new_sz);
+
+/**
+ * Diffs each of count new files against old, all the old files laid end to
+ * end, see bsdiff_bundle_header_t. Old is indexed once for all of them, and
+ * config->threads of them are diffed at once; stream->malloc and
+ * stream->free are then called from those threads. patch[i] is the whole
+ * patch of new[i], header included, to apply with bspatch_to from all of
+ * old, in a buffer allocated by stream->malloc. in_place, filter,
+ * memory_budget and apply_cost are not used, lazy_sort sorts all of old.
+ */
+int bsdiff_bundle(const uint8_t *old, int64_t old_sz,
+                  const uint8_t *const *new, const int64_t *new_sz,
+                  int64_t count, bsdiff_stream_t *stream,
+                  const bsdiff_config_t *config, uint8_t **patch,
+                  int64_t *patch_sz);
+
+/**
+ * Composes two patches as bsdiff wrote them, first from old to mid and second
+ * from mid to new, into one from old to new, header included, written to
+ * stream->write. Only the block lists and the data of the two patches are
+ * read: mid is not built and nothing is sorted, the time taken goes with the
+ * size of the patches, not of the images. The diff strings of the result are
+ * those of second that read the diff strings of first, added up, the rest is
+ * extra. Both patches have to be of the same filter, if any, and the result
+ * is of that filter. codec, zero_chunks, effort and write_buffer_size are
+ * used, the result is not made to be applied in place.
+ */
+int bsdiff_compose(const uint8_t *first, int64_t first_sz,
+                   const uint8_t *second, int64_t second_sz,
+                   bsdiff_stream_t *stream, const bsdiff_config_t *config);
+
+/**
+ * Reads a patch as bsdiff wrote it from stream->read and writes it to
+ * stream->write with its data chunked again, under codec, zero_chunks and
+ * effort, the FastLZ level. Nothing is diffed: the blocks stay as they are
+ * and one chunk is decoded at a time, so memory does not grow with the
+ * patch. Without zero_chunks, the zero chunks of the patch are written as
+ * data, for decoders that do not know them.
+ */
+int bsdiff_transcode(bsdiff_stream_t *stream, const bsdiff_config_t *config);
+
+typedef struct bsdiff_estimate {
+  int64_t patch_sz; // bytes the patch bsdiff_ex writes would take
+  int64_t diff_ms;  // milliseconds bsdiff_ex would take to write it
+} bsdiff_estimate_t;
+
+/**
+ * Predicts what bsdiff_ex would make of old and new under config, in a small
+ * part of its time: old gets a hash index, which takes linear time, and a
+ * few windows spread over new are diffed against it, the rest scaled from
+ * them. Whether a delta pays off against sending new whole can be decided
+ * from the estimate before anything is sorted. Images that change unevenly
+ * make it less exact, and it runs a few percent high for the suffix array
+ * engines, which find longer matches. memory_budget, lazy_sort, time_budget,
+ * in_place and filter are not taken into account. Nothing is written to
+ * stream->write.
+ */
+int bsdiff_estimate(const uint8_t *old, int64_t old_sz, const uint8_t *new,
+                    int64_t new_sz, bsdiff_stream_t *stream,
+                    const bsdiff_config_t *config,
+                    bsdiff_estimate_t *estimate);
+
+/**
+ * Sorts the suffixes of old into sa, old_sz + 1 entries, for old_sa.
+ */
+int bsdiff_sa_build(bsdiff_stream_t *stream, const uint8_t *old,
+                    int64_t old_sz, int64_t *sa);
+
+/**
+ * Derives the suffix array of new, new_sz + 1 entries in new_sa, from old_sa
+ * and patch, a patch from old to new as bsdiff wrote it. Suffixes in the runs
+ * the patch copies unchanged keep the order old_sa has them in, only the
+ * changed parts are sorted from scratch. Along a chain of releases, each
+ * diff can take the suffix array of its old from the previous one.
+ */
+int bsdiff_sa_update(bsdiff_stream_t *stream, const uint8_t *old,
+                     int64_t old_sz, const int64_t *old_sa,
+                     const uint8_t *new, int64_t new_sz, const uint8_t *patch,
+                     int64_t patch_sz, int64_t *new_sa);
+
 #ifdef __cplusplus
 }
 #endif
@@ -34,6 +34,32 @@
 
 #define BSDIFF_SIGNATURE "YUEYU/BSDIFF"
 #define BSDIFF_SIGNATURE_LEN (sizeof(BSDIFF_SIGNATURE) - 1) /* -1 for '\0' */
+/* a patch of filtered images, the header goes on with the filter */
+#define BSDIFF_SIGNATURE_V2 "YUEYU/BSDIF2"
+/* a patch of images with their deflate streams inflated, see below */
+#define BSDIFF_SIGNATURE_DEFLATE "YUEYU/BSDEFL"
+/* a patch of a tree of files, see below */
+#define BSDIFF_SIGNATURE_BUNDLE "YUEYU/BSDBUN"
+
+/* Branch filters, see bsdiff_header_v2_t. */
+#define BSDIFF_FILTER_NONE 0
+#define BSDIFF_FILTER_X86 1
+#define BSDIFF_FILTER_ARM_THUMB 2
+#define BSDIFF_FILTER_ARM64 3
+#define BSDIFF_FILTER_RISCV 4
+/* each block of the image is filtered on its own */
+#define BSDIFF_FILTER_BLOCK_SIZE 1024
+
+/* Codecs of the compressed chunks, see the format of data below. */
+#define BSDIFF_CODEC_FASTLZ 0
+#define BSDIFF_CODEC_RANS 1
+#define BSDIFF_CODEC_ZERO 2
+
+#define PATCH_CHUNK_FLAG_LAST 0x01
+#define PATCH_CHUNK_CODEC_SHIFT 1
+#define PATCH_CHUNK_FLAG(CODEC, LAST)                                          \
+  ((uint8_t)(((CODEC) << PATCH_CHUNK_CODEC_SHIFT) | ((LAST) ? 1 : 0)))
+#define PATCH_CHUNK_CODEC(FLAG) ((FLAG) >> PATCH_CHUNK_CODEC_SHIFT)
 
 #define PATCH_BLK_SZ(BLK_PTR)                                                  \
   (sizeof(*(BLK_PTR)) + (BLK_PTR)->len_diff + (BLK_PTR)->len_extra)
@@ -47,6 +73,76 @@ typedef struct bsdiff_header {
   uint64_t new_sz;
 } __attribute__((packed)) bsdiff_header_t;
 
+/**
+ * With a branch filter, the relative targets of calls and branches in both
+ * images are made absolute before they are diffed, so that code moved by a
+ * few bytes does not change every call across it. The patch turns old into
+ * the filtered new, which bspatch turns back. Old and new are filtered one
+ * BSDIFF_FILTER_BLOCK_SIZE block at a time, an instruction across two blocks
+ * is left as it is: bspatch reads old a block at a time, wherever the patch
+ * takes it.
+ *
+ * A patch without a filter has the plain header, as before filters existed.
+ */
+typedef struct bsdiff_header_v2 {
+  char signature[BSDIFF_SIGNATURE_LEN]; // BSDIFF_SIGNATURE_V2
+  uint64_t new_sz;
+  uint8_t filter; // BSDIFF_FILTER_*
+} __attribute__((packed)) bsdiff_header_v2_t;
+
+/**
+ * A small change to a gzip file or a zip member changes all of its
+ * compressed bytes after it. bsdiff_bin -x diffs such images with their
+ * deflate streams inflated: all those of old, and those of new that zlib
+ * compresses back to the same bytes, with the parameters it finds. The rest
+ * of new is diffed as it is.
+ *
+ * The header is followed by old_streams and then new_streams
+ * bsdiff_deflate_stream_t, each in the order of the image, and then a whole
+ * patch, header included, from inflated old to inflated new. bspatch_bin
+ * inflates the streams of old, applies that patch and compresses the
+ * streams of new back, in memory.
+ */
+typedef struct bsdiff_deflate_header {
+  char signature[BSDIFF_SIGNATURE_LEN]; // BSDIFF_SIGNATURE_DEFLATE
+  uint64_t new_sz;                      // of new with its streams compressed
+  uint32_t old_streams;
+  uint32_t new_streams;
+} __attribute__((packed)) bsdiff_deflate_header_t;
+
+typedef struct bsdiff_deflate_stream {
+  uint64_t offset;   // where the raw deflate data starts in the image
+  uint64_t len;      // compressed bytes
+  uint64_t raw_len;  // bytes it inflates to
+  uint32_t crc;      // crc32 of the compressed bytes, new only
+  uint8_t level;     // deflateInit2 parameters that give those bytes back,
+  uint8_t mem_level; // new only
+  uint8_t strategy;
+} __attribute__((packed)) bsdiff_deflate_stream_t;
+
+/**
+ * A patch of a tree of files, from bsdiff_bin -b. Each new file is patched
+ * from all the old files laid end to end, so what moved from one file to
+ * another still matches.
+ *
+ * The header is followed by old_files and then new_files entries, each
+ * followed by its name_len bytes of name, a path relative to the root of the
+ * tree. Old files are laid out in the order of their entries. Then comes
+ * the patch of each new file in the order of theirs, a whole patch of
+ * patch_sz bytes, header included.
+ */
+typedef struct bsdiff_bundle_header {
+  char signature[BSDIFF_SIGNATURE_LEN]; // BSDIFF_SIGNATURE_BUNDLE
+  uint32_t old_files;
+  uint32_t new_files;
+} __attribute__((packed)) bsdiff_bundle_header_t;
+
+typedef struct bsdiff_bundle_entry {
+  uint64_t size;     // of the file
+  uint64_t patch_sz; // of its patch, new files only
+  uint32_t name_len; // without a terminating '\0'
+} __attribute__((packed)) bsdiff_bundle_entry_t;
+
 typedef struct patch_block {
   uint64_t len_diff;  // read len_diff bytes as diff
   uint64_t len_extra; // read len_extra bytes as extra
@@ -63,6 +159,14 @@ typedef struct patch_block {
  * +-------------------------+
  * | compressed              |
  * +-------------------------+
+ *
+ * Bit 0 of the end flag marks the last chunk of a block, the higher bits tell
+ * the codec of the chunk. Patches made before the codec bits existed only
+ * contain 0 and 1, which are FastLZ chunks.
+ *
+ * A BSDIFF_CODEC_ZERO chunk has no payload, its size field is the number of
+ * zero bytes it stands for. It is not bound to the chunk buffer size, so one
+ * chunk covers a whole run of zeros however long it is.
  */
 
 #ifdef __cplusplus
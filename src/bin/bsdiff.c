@@ -29,14 +29,22 @@
 #include <sys/types.h>
 
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <bsdiff/legacy/bsdiff.h>
 
+#include "deflate.h"
+
 // static int bz2_write(struct bsdiff_stream *stream, const void *buffer,
 //                      int size) {
 //   int bz2err;
@@ -52,76 +60,1001 @@
 //   return 0;
 // }
 
+#define USAGE                                                                  \
+  "usage: %s [-c fastlz|rans|auto] [-z] [-m MiB] [-e sa|hash|fm|sparse] "      \
+  "[-k stride] [-l] [-i] [-E fast|default|max] [-t ms] [-a] [-A | -I] [-r] "  \
+  "[-f x86|thumb|arm64|riscv] [-x] [-s oldsa] [-S newsa] "                     \
+  "oldfile newfile|- patchfile\n"                                              \
+  "       %s -b [-c fastlz|rans|auto] [-z] [-e sa|hash|fm|sparse] "            \
+  "[-k stride] [-E fast|default|max] [-t ms] [-a] [-j threads] olddir "        \
+  "newdir patchfile\n"                                                         \
+  "       %s -p [-c fastlz|rans|auto] [-z] [-E fast|default|max] oldpatch "    \
+  "newpatch patchfile\n"                                                       \
+  "       %s -T [-c fastlz|rans|auto] [-z] [-E fast|default|max] patchfile "   \
+  "newpatchfile\n"                                                            \
+  "       %s -n [-c fastlz|rans|auto] [-z] [-e sa|hash|fm|sparse] "            \
+  "[-k stride] [-i] [-E fast|default|max] [-a] [-s oldsa] oldfile newfile\n"
+
 static int file_write(struct bsdiff_stream *stream, const void *buffer,
                       int size) {
-  return fwrite(buffer, size, 1, (FILE *)stream->opaque);
+  return fwrite(buffer, size, 1, (FILE *)stream->opaque) == 1 ? 0 : -1;
 }
 
-int main(int argc, char *argv[]) {
+// the plain header, or the one that names the filter
+static int write_header(FILE *pf, const bsdiff_config_t *config,
+                        int64_t new_sz) {
+  bsdiff_header_t header = {
+      .signature = BSDIFF_SIGNATURE,
+      .new_sz = new_sz,
+  };
+  bsdiff_header_v2_t header_v2 = {
+      .signature = BSDIFF_SIGNATURE_V2,
+      .new_sz = new_sz,
+      .filter = config->filter,
+  };
+
+  if (config->filter != BSDIFF_FILTER_NONE) {
+    return fwrite(&header_v2, sizeof(header_v2), 1, pf) == 1 ? 0 : -1;
+  }
+
+  return fwrite(&header, sizeof(header), 1, pf) == 1 ? 0 : -1;
+}
+
+/* Writes the deflate header and streams, see bsdiff_deflate_header_t, and
+ * sets x_old and x_new to old and new inflated, for the patch that follows.
+ * Nothing is written when new has no stream that compresses back, the
+ * patch is then a plain one.
+ */
+static int expand_streams(FILE *pf, const uint8_t *old, off_t old_sz,
+                          const uint8_t *new, off_t new_sz, uint8_t **x_old,
+                          off_t *x_old_sz, uint8_t **x_new, off_t *x_new_sz) {
+  bsdiff_deflate_header_t header = {
+      .signature = BSDIFF_SIGNATURE_DEFLATE,
+      .new_sz = new_sz,
+  };
+  bsdiff_deflate_stream_t *old_streams, *new_streams;
+  uint32_t old_count, new_count;
+  size_t sz;
+  int ret;
+
+  if (deflate_find(new, new_sz, 1, &new_streams, &new_count) != 0) {
+    return -1;
+  }
+  if (new_count == 0) {
+    free(new_streams);
+    return 0;
+  }
+  if (deflate_find(old, old_sz, 0, &old_streams, &old_count) != 0) {
+    free(new_streams);
+    return -1;
+  }
+
+  header.old_streams = old_count;
+  header.new_streams = new_count;
+  *x_old = deflate_expand(old, old_sz, old_streams, old_count, &sz);
+  *x_old_sz = sz;
+  *x_new = deflate_expand(new, new_sz, new_streams, new_count, &sz);
+  *x_new_sz = sz;
+
+  ret = 0;
+  if (*x_old == NULL || *x_new == NULL ||
+      fwrite(&header, sizeof(header), 1, pf) != 1 ||
+      fwrite(old_streams, sizeof(*old_streams), old_count, pf) != old_count ||
+      fwrite(new_streams, sizeof(*new_streams), new_count, pf) != new_count) {
+    ret = -1;
+  }
+
+  free(old_streams);
+  free(new_streams);
+
+  return ret;
+}
+
+// new is streamed from stdin when its path is "-"
+static int stdin_read(struct bsdiff_stream *stream, void *buffer, int size) {
+  size_t n;
+
+  (void)stream;
+  n = fread(buffer, 1, size, stdin);
+
+  return n == 0 && ferror(stdin) ? -1 : (int)n;
+}
+
+/* Reads the file into a zeroed buffer, the holes of a sparse file are not
+ * read at all and their pages are never touched. Sets *sparse when a hole
+ * was found.
+ */
+static uint8_t *load_file(const char *path, off_t *sz, int *sparse) {
+  uint8_t *buffer;
+  off_t data, hole;
+  ssize_t n;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY, 0)) < 0) {
+    return NULL;
+  }
+  if (((*sz = lseek(fd, 0, SEEK_END)) == -1) || // get size
+      ((buffer = calloc(*sz + 1, 1)) == NULL)   // alloc zeroed mem
+  ) {
+    close(fd);
+    return NULL;
+  }
+
+  *sparse = 0;
+  for (hole = 0; hole < *sz; hole = data + n) {
+    // without SEEK_DATA support the whole file is one extent
+    if ((data = lseek(fd, hole, SEEK_DATA)) < 0) {
+      if (errno == ENXIO) {
+        *sparse = 1;
+        break;
+      }
+      data = hole;
+    }
+    *sparse |= data != hole;
+
+    if ((n = lseek(fd, data, SEEK_HOLE)) < 0) {
+      n = *sz;
+    }
+    n -= data;
+    if (pread(fd, buffer + data, n, data) != n) {
+      free(buffer);
+      close(fd);
+      return NULL;
+    }
+  }
 
+  if (close(fd) == -1) {
+    free(buffer);
+    return NULL;
+  }
+
+  return buffer;
+}
+
+/* Maps the file instead of reading it, so a file larger than RAM is paged
+ * in and out by the kernel. Holes are counted from the allocated blocks.
+ */
+static uint8_t *map_file(const char *path, off_t *sz, int *sparse) {
+  struct stat sb;
+  void *data;
   int fd;
+
+  if (((fd = open(path, O_RDONLY, 0)) < 0) || (fstat(fd, &sb) != 0)) {
+    return NULL;
+  }
+
+  *sz = sb.st_size;
+  *sparse = (off_t)sb.st_blocks * 512 < sb.st_size;
+
+  // an empty file cannot be mapped
+  data = *sz == 0 ? calloc(1, 1)
+                  : mmap(NULL, *sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  return data == MAP_FAILED ? NULL : data;
+}
+
+static void unmap_file(uint8_t *data, off_t sz) {
+  if (sz == 0) {
+    free(data);
+  } else {
+    munmap(data, sz);
+  }
+}
+
+static int save_sa(const char *path, const int64_t *sa, off_t sz) {
+  FILE *f;
+  int ret;
+
+  if ((f = fopen(path, "w")) == NULL) {
+    return -1;
+  }
+
+  ret = fwrite(sa, sizeof(int64_t), sz + 1, f) == (size_t)sz + 1 ? 0 : -1;
+  if (fclose(f) != 0) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+/* Whether sa, sz + 1 entries, holds each position of data once. Its entries
+ * are used as offsets into data, a stale or damaged cache must not be.
+ */
+static int check_sa(const int64_t *sa, off_t sz) {
+  uint8_t *seen;
+  int64_t i;
+  int ret;
+
+  if ((seen = calloc(sz / 8 + 1, 1)) == NULL) {
+    return -1;
+  }
+
+  ret = 0;
+  for (i = 0; i <= sz && ret == 0; i++) {
+    if (sa[i] < 0 || sa[i] > sz || (seen[sa[i] / 8] >> (sa[i] % 8) & 1)) {
+      ret = -1;
+    } else {
+      seen[sa[i] / 8] |= 1 << (sa[i] % 8);
+    }
+  }
+
+  free(seen);
+  return ret;
+}
+
+/* The suffix array of data cached in path, which is sorted and saved there
+ * first when the file does not exist yet.
+ */
+static int64_t *load_sa(bsdiff_stream_t *stream, const char *path,
+                        const uint8_t *data, off_t sz) {
+  int64_t *sa;
+  FILE *f;
+
+  if ((sa = malloc((sz + 1) * sizeof(int64_t))) == NULL) {
+    return NULL;
+  }
+
+  if ((f = fopen(path, "r")) == NULL) {
+    if (errno == ENOENT && bsdiff_sa_build(stream, data, sz, sa) == 0 &&
+        save_sa(path, sa, sz) == 0) {
+      return sa;
+    }
+    free(sa);
+    return NULL;
+  }
+
+  // a file of another size, or other entries, is not of this old
+  if (fread(sa, sizeof(int64_t), sz + 1, f) != (size_t)sz + 1 ||
+      fgetc(f) != EOF || check_sa(sa, sz) != 0) {
+    errno = EINVAL;
+    free(sa);
+    sa = NULL;
+  }
+  fclose(f);
+
+  return sa;
+}
+
+/* The regular files of a tree, as paths relative to its root. nftw takes no
+ * context, so the tree being listed is here.
+ */
+typedef struct tree {
+  char **names;
+  size_t count;
+  size_t cap;
+  size_t root_len;
+} tree_t;
+
+static tree_t *listing;
+
+static int list_file(const char *path, const struct stat *sb, int type,
+                     struct FTW *ftw) {
+  char **grown;
+
+  (void)ftw; // the depth does not matter, only the files
+  if (type != FTW_F || !S_ISREG(sb->st_mode)) {
+    return 0;
+  }
+
+  if (listing->count == listing->cap) {
+    listing->cap = listing->cap ? 2 * listing->cap : 64;
+    grown = realloc(listing->names, listing->cap * sizeof(char *));
+    if (grown == NULL) {
+      return -1;
+    }
+    listing->names = grown;
+  }
+  if ((listing->names[listing->count] = strdup(path + listing->root_len)) ==
+      NULL) {
+    return -1;
+  }
+  listing->count++;
+
+  return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// lists the tree under root, sorted so that the patch does not depend on it
+static void list_tree(const char *root, tree_t *tree) {
+  tree->names = NULL;
+  tree->count = 0;
+  tree->cap = 0;
+  tree->root_len = strlen(root);
+  while (tree->root_len > 1 && root[tree->root_len - 1] == '/') {
+    tree->root_len--;
+  }
+  tree->root_len++; // and the '/' after it
+
+  listing = tree;
+  if (nftw(root, list_file, 16, FTW_PHYS) != 0) {
+    err(1, "failed to list the files under %s\n", root);
+  }
+  qsort(tree->names, tree->count, sizeof(char *), compare_names);
+}
+
+static void free_tree(tree_t *tree) {
+  size_t i;
+
+  for (i = 0; i < tree->count; i++) {
+    free(tree->names[i]);
+  }
+  free(tree->names);
+}
+
+static int write_entry(FILE *pf, const char *name, uint64_t size,
+                       uint64_t patch_sz) {
+  bsdiff_bundle_entry_t entry = {
+      .size = size,
+      .patch_sz = patch_sz,
+      .name_len = strlen(name),
+  };
+
+  return fwrite(&entry, sizeof(entry), 1, pf) == 1 &&
+                 fwrite(name, 1, entry.name_len, pf) == entry.name_len
+             ? 0
+             : -1;
+}
+
+/* Diffs the tree under new_dir against the one under old_dir into one patch,
+ * see bsdiff_bundle_header_t. The old files are read into one buffer, laid
+ * end to end, and every new file is held in memory.
+ */
+static void diff_bundle(const char *old_dir, const char *new_dir,
+                        const char *patch_path, bsdiff_config_t *config) {
+  bsdiff_bundle_header_t header = {
+      .signature = BSDIFF_SIGNATURE_BUNDLE,
+  };
+  tree_t old_tree, new_tree;
+  char path[PATH_MAX];
+  uint8_t *old, *file, **new, **patch;
+  int64_t *old_sz, *new_sz, *patch_sz, total;
+  bsdiff_stream_t stream;
+  off_t sz;
+  int sparse;
+  size_t i;
+  FILE *pf;
+
+  list_tree(old_dir, &old_tree);
+  list_tree(new_dir, &new_tree);
+
+  old_sz = malloc((old_tree.count + 1) * sizeof(int64_t));
+  new = malloc((new_tree.count + 1) * sizeof(uint8_t *));
+  new_sz = malloc((new_tree.count + 1) * sizeof(int64_t));
+  patch = malloc((new_tree.count + 1) * sizeof(uint8_t *));
+  patch_sz = malloc((new_tree.count + 1) * sizeof(int64_t));
+  if (old_sz == NULL || new == NULL || new_sz == NULL || patch == NULL ||
+      patch_sz == NULL) {
+    err(1, "failed to allocate the file list\n");
+  }
+
+  // the old files end to end
+  old = NULL;
+  total = 0;
+  for (i = 0; i < old_tree.count; i++) {
+    if (snprintf(path, sizeof(path), "%s/%s", old_dir, old_tree.names[i]) >=
+            (int)sizeof(path) ||
+        (file = load_file(path, &sz, &sparse)) == NULL ||
+        (old = realloc(old, total + sz + 1)) == NULL) {
+      err(1, "failed to read old: %s\n", path);
+    }
+    memcpy(old + total, file, sz);
+    free(file);
+    old_sz[i] = sz;
+    total += sz;
+  }
+
+  for (i = 0; i < new_tree.count; i++) {
+    if (snprintf(path, sizeof(path), "%s/%s", new_dir, new_tree.names[i]) >=
+            (int)sizeof(path) ||
+        (new[i] = load_file(path, &sz, &sparse)) == NULL) {
+      err(1, "failed to read new: %s\n", path);
+    }
+    new_sz[i] = sz;
+  }
+
+  stream.malloc = malloc;
+  stream.free = free;
+  stream.write = NULL; // the patches are built in memory
+  stream.read = NULL;
+  stream.opaque = NULL;
+
+  if (bsdiff_bundle(old, total, (const uint8_t *const *)new, new_sz,
+                    new_tree.count, &stream, config, patch, patch_sz) != 0) {
+    errx(1, "internal err at bsdiff\n");
+  }
+
+  if ((pf = fopen(patch_path, "w")) == NULL) {
+    err(1, "failed to create patch: %s\n", patch_path);
+  }
+  header.old_files = old_tree.count;
+  header.new_files = new_tree.count;
+  if (fwrite(&header, sizeof(header), 1, pf) != 1) {
+    err(1, "failed to write header\n");
+  }
+  for (i = 0; i < old_tree.count; i++) {
+    if (write_entry(pf, old_tree.names[i], old_sz[i], 0) != 0) {
+      err(1, "failed to write header\n");
+    }
+  }
+  for (i = 0; i < new_tree.count; i++) {
+    if (write_entry(pf, new_tree.names[i], new_sz[i], patch_sz[i]) != 0) {
+      err(1, "failed to write header\n");
+    }
+  }
+  for (i = 0; i < new_tree.count; i++) {
+    if (fwrite(patch[i], 1, patch_sz[i], pf) != (size_t)patch_sz[i]) {
+      err(1, "failed to write patch\n");
+    }
+    free(patch[i]);
+    free(new[i]);
+  }
+  if (fclose(pf)) {
+    err(1, "internal err at fclose\n");
+  }
+
+  free(patch_sz);
+  free(patch);
+  free(new_sz);
+  free(new);
+  free(old_sz);
+  free(old);
+  free_tree(&new_tree);
+  free_tree(&old_tree);
+}
+
+/* Composes the patch from old to mid and the one from mid to new into one
+ * from old to new.
+ */
+static void compose(const char *first_path, const char *second_path,
+                    const char *patch_path, bsdiff_config_t *config) {
+  uint8_t *first, *second;
+  off_t first_sz, second_sz;
+  bsdiff_stream_t stream;
+  int sparse;
+  FILE *pf;
+
+  if ((first = load_file(first_path, &first_sz, &sparse)) == NULL) {
+    err(1, "failed to read patch: %s\n", first_path);
+  }
+  if ((second = load_file(second_path, &second_sz, &sparse)) == NULL) {
+    err(1, "failed to read patch: %s\n", second_path);
+  }
+
+  if ((pf = fopen(patch_path, "w")) == NULL) {
+    err(1, "failed to create patch: %s\n", patch_path);
+  }
+
+  stream.malloc = malloc;
+  stream.free = free;
+  stream.write = file_write;
+  stream.read = NULL;
+  stream.opaque = pf;
+
+  if (bsdiff_compose(first, first_sz, second, second_sz, &stream, config) !=
+      0) {
+    errx(1, "failed to compose the patches, they have to go from old to mid "
+            "and from mid to new, with the same filter if any\n");
+  }
+
+  if (fclose(pf)) {
+    err(1, "internal err at fclose\n");
+  }
+
+  free(second);
+  free(first);
+}
+
+// the patch read and the one written by bsdiff_transcode
+typedef struct transcode_files {
+  FILE *in;
+  FILE *out;
+} transcode_files_t;
+
+static int transcode_read(struct bsdiff_stream *stream, void *buffer,
+                          int size) {
+  FILE *fp;
+  size_t n;
+
+  fp = ((transcode_files_t *)stream->opaque)->in;
+  n = fread(buffer, 1, size, fp);
+
+  return n == 0 && ferror(fp) ? -1 : (int)n;
+}
+
+static int transcode_write(struct bsdiff_stream *stream, const void *buffer,
+                           int size) {
+  FILE *fp;
+
+  fp = ((transcode_files_t *)stream->opaque)->out;
+
+  return fwrite(buffer, size, 1, fp) == 1 ? 0 : -1;
+}
+
+/* Writes the patch again with its data chunked under config. The header and
+ * streams of a deflate patch are copied as they are, the patch after them is
+ * the one transcoded.
+ */
+static void transcode(const char *in_path, const char *out_path,
+                      bsdiff_config_t *config) {
+  bsdiff_deflate_header_t header;
+  bsdiff_deflate_stream_t entry;
+  transcode_files_t files;
+  bsdiff_stream_t stream;
+  uint64_t i;
+  size_t n;
+
+  if ((files.in = fopen(in_path, "r")) == NULL) {
+    err(1, "failed to open patch: %s\n", in_path);
+  }
+  if ((files.out = fopen(out_path, "w")) == NULL) {
+    err(1, "failed to create patch: %s\n", out_path);
+  }
+
+  n = fread(&header, 1, sizeof(header), files.in);
+  if (n >= BSDIFF_SIGNATURE_LEN &&
+      memcmp(header.signature, BSDIFF_SIGNATURE_DEFLATE,
+             BSDIFF_SIGNATURE_LEN) == 0) {
+    if (n != sizeof(header) ||
+        fwrite(&header, sizeof(header), 1, files.out) != 1) {
+      errx(1, "failed to copy the deflate header\n");
+    }
+    for (i = 0; i < (uint64_t)header.old_streams + header.new_streams; i++) {
+      if (fread(&entry, sizeof(entry), 1, files.in) != 1 ||
+          fwrite(&entry, sizeof(entry), 1, files.out) != 1) {
+        errx(1, "failed to copy the deflate streams\n");
+      }
+    }
+  } else if (n >= BSDIFF_SIGNATURE_LEN &&
+             memcmp(header.signature, BSDIFF_SIGNATURE_BUNDLE,
+                    BSDIFF_SIGNATURE_LEN) == 0) {
+    errx(1, "bundle patches cannot be transcoded\n");
+  } else if (fseek(files.in, 0, SEEK_SET) != 0) {
+    err(1, "failed to read patch: %s\n", in_path);
+  }
+
+  stream.malloc = malloc;
+  stream.free = free;
+  stream.write = transcode_write;
+  stream.read = transcode_read;
+  stream.opaque = &files;
+
+  if (bsdiff_transcode(&stream, config) != 0) {
+    errx(1, "failed to transcode the patch: %s\n", in_path);
+  }
+
+  if (fclose(files.out)) {
+    err(1, "internal err at fclose\n");
+  }
+  fclose(files.in);
+}
+
+/* Prints what the patch from old to new would take, in bytes and time,
+ * without diffing them.
+ */
+static void estimate(const char *old_path, const char *new_path,
+                     const char *old_sa_path, bsdiff_config_t *config) {
+  uint8_t *old, *new;
+  off_t old_sz, new_sz;
+  int old_sparse, new_sparse;
+  bsdiff_stream_t stream;
+  bsdiff_estimate_t result;
+  int64_t *old_sa;
+
+  if ((old = load_file(old_path, &old_sz, &old_sparse)) == NULL) {
+    err(1, "failed to read old: %s\n", old_path);
+  }
+  if ((new = load_file(new_path, &new_sz, &new_sparse)) == NULL) {
+    err(1, "failed to read new: %s\n", new_path);
+  }
+  config->zero_chunks |= old_sparse || new_sparse;
+
+  stream.malloc = malloc;
+  stream.free = free;
+  stream.write = NULL;
+  stream.read = NULL;
+  stream.opaque = NULL;
+
+  old_sa = NULL;
+  if (old_sa_path != NULL) {
+    if ((old_sa = load_sa(&stream, old_sa_path, old, old_sz)) == NULL) {
+      err(1, "failed to load the suffix array of old: %s\n", old_sa_path);
+    }
+    config->old_sa = old_sa;
+  }
+
+  if (bsdiff_estimate(old, old_sz, new, new_sz, &stream, config, &result) !=
+      0) {
+    errx(1, "failed to estimate the patch\n");
+  }
+
+  printf("patch: %lld bytes of %lld, %lld ms to diff\n",
+         (long long)result.patch_sz, (long long)new_sz,
+         (long long)result.diff_ms);
+
+  free(old_sa);
+  free(new);
+  free(old);
+}
+
+int main(int argc, char *argv[]) {
+
   int bz2err;
   uint8_t *old, *new;
   off_t old_sz, new_sz;
   FILE *pf;
+  const char *old_path, *new_path, *patch_path;
   bsdiff_stream_t stream;
+  bsdiff_config_t config;
+  int opt, old_sparse, new_sparse, zero_chunks, streaming;
+  int64_t streamed_sz;
+  const char *old_sa_path, *new_sa_path;
+  int64_t *old_sa, *new_sa;
+  uint8_t *patch;
+  off_t patch_sz;
+  int patch_sparse;
+  bsdiff_apply_cost_t cost;
+  int report, placed, expand, bundle, chain, recode, predict;
+  uint8_t *x_old, *x_new;
+  off_t x_old_sz, x_new_sz;
   // BZFILE *bz2;
 
-  bsdiff_header_t header = {
-      .signature = BSDIFF_SIGNATURE,
-      .new_sz = 0,
-  };
+  bsdiff_config_init(&config);
+  zero_chunks = 0;
+  old_sa_path = NULL;
+  new_sa_path = NULL;
+  report = 0;
+  placed = 0;
+  expand = 0;
+  bundle = 0;
+  chain = 0;
+  recode = 0;
+  predict = 0;
+  config.threads = 0;
 
-  if (argc != 4) {
-    errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+  while ((opt = getopt(argc, argv, "c:zm:e:k:liE:t:aAIrf:xs:S:bj:pTn")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (strcmp(optarg, "fastlz") == 0) {
+        config.codec = BSDIFF_CODEC_FASTLZ;
+      } else if (strcmp(optarg, "rans") == 0) {
+        config.codec = BSDIFF_CODEC_RANS;
+      } else if (strcmp(optarg, "auto") == 0) {
+        config.codec = BSDIFF_CODEC_AUTO;
+      } else {
+        errx(1, "unknown codec: %s\n", optarg);
+      }
+      break;
+    case 'z':
+      zero_chunks = 1;
+      break;
+    case 'm':
+      config.memory_budget = strtoll(optarg, NULL, 10) * 1024 * 1024;
+      if (config.memory_budget <= 0) {
+        errx(1, "invalid memory budget: %s\n", optarg);
+      }
+      break;
+    case 'e':
+      if (strcmp(optarg, "sa") == 0) {
+        config.engine = BSDIFF_ENGINE_SUFFIX_ARRAY;
+      } else if (strcmp(optarg, "hash") == 0) {
+        config.engine = BSDIFF_ENGINE_HASH;
+      } else if (strcmp(optarg, "fm") == 0) {
+        config.engine = BSDIFF_ENGINE_FM_INDEX;
+      } else if (strcmp(optarg, "sparse") == 0) {
+        config.engine = BSDIFF_ENGINE_SPARSE_SUFFIX_ARRAY;
+      } else {
+        errx(1, "unknown engine: %s\n", optarg);
+      }
+      break;
+    case 'l':
+      config.lazy_sort = 1;
+      break;
+    case 'i':
+      config.search_keys = 1;
+      break;
+    case 'E':
+      if (strcmp(optarg, "fast") == 0) {
+        config.effort = BSDIFF_EFFORT_FAST;
+      } else if (strcmp(optarg, "default") == 0) {
+        config.effort = BSDIFF_EFFORT_DEFAULT;
+      } else if (strcmp(optarg, "max") == 0) {
+        config.effort = BSDIFF_EFFORT_MAX;
+      } else {
+        errx(1, "unknown effort: %s\n", optarg);
+      }
+      break;
+    case 't':
+      config.time_budget = strtoll(optarg, NULL, 10);
+      if (config.time_budget <= 0) {
+        errx(1, "invalid time budget: %s\n", optarg);
+      }
+      break;
+    case 'a':
+      config.lookahead = 1;
+      break;
+    case 'A':
+      config.in_place = 0;
+      placed = 1;
+      break;
+    case 'I':
+      config.in_place = 1;
+      report = 1;
+      placed = 1;
+      break;
+    case 'r':
+      report = 1;
+      break;
+    case 'f':
+      if (strcmp(optarg, "x86") == 0) {
+        config.filter = BSDIFF_FILTER_X86;
+      } else if (strcmp(optarg, "thumb") == 0) {
+        config.filter = BSDIFF_FILTER_ARM_THUMB;
+      } else if (strcmp(optarg, "arm64") == 0) {
+        config.filter = BSDIFF_FILTER_ARM64;
+      } else if (strcmp(optarg, "riscv") == 0) {
+        config.filter = BSDIFF_FILTER_RISCV;
+      } else {
+        errx(1, "unknown filter: %s\n", optarg);
+      }
+      break;
+    case 'x':
+      expand = 1;
+      break;
+    case 's':
+      old_sa_path = optarg;
+      break;
+    case 'S':
+      new_sa_path = optarg;
+      break;
+    case 'b':
+      bundle = 1;
+      break;
+    case 'p':
+      chain = 1;
+      break;
+    case 'T':
+      recode = 1;
+      break;
+    case 'n':
+      predict = 1;
+      break;
+    case 'j':
+      config.threads = strtoll(optarg, NULL, 10);
+      if (config.threads <= 0) {
+        errx(1, "invalid number of threads: %s\n", optarg);
+      }
+      break;
+    case 'k':
+      config.index_stride = strtoll(optarg, NULL, 10);
+      if (config.index_stride <= 0) {
+        errx(1, "invalid index stride: %s\n", optarg);
+      }
+      break;
+    default:
+      errx(1, USAGE, argv[0], argv[0], argv[0], argv[0], argv[0]);
+    }
   }
 
-  if (((fd = open(argv[1], O_RDONLY, 0)) < 0) ||   // open old
-      ((old_sz = lseek(fd, 0, SEEK_END)) == -1) || // get old_sz
-      ((old = malloc(old_sz + 1)) == NULL) ||      // alloc mem
-      (lseek(fd, 0, SEEK_SET) != 0) ||             // move file cursor to begin
-      (read(fd, old, old_sz) != old_sz) ||         // read all the file
-      (close(fd) == -1)                            // close
-  ) {
-    err(1, "failed to read old: %s\n", argv[1]);
+  if (argc - optind != (recode || predict ? 2 : 3)) {
+    errx(1, USAGE, argv[0], argv[0], argv[0], argv[0], argv[0]);
   }
 
-  if (((fd = open(argv[2], O_RDONLY, 0)) < 0) ||   // open new
-      ((new_sz = lseek(fd, 0, SEEK_END)) == -1) || // get new_sz
-      ((new = malloc(new_sz + 1)) == NULL) ||      // alloc mem
-      (lseek(fd, 0, SEEK_SET) != 0) ||             // move file cursor to begin
-      (read(fd, new, new_sz) != new_sz) ||         // read all the file
-      (close(fd) == -1)                            // close
-  ) {
-    err(1, "failed to read new: %s\n", argv[2]);
+  // what the patch would take, nothing is written
+  if (predict) {
+    if (config.memory_budget > 0 || placed || report ||
+        config.filter != BSDIFF_FILTER_NONE || expand || new_sa_path != NULL ||
+        bundle || chain || recode) {
+      errx(1, "-m, -A, -I, -r, -f, -x, -S, -b, -p and -T cannot be used "
+              "with -n\n");
+    }
+    config.zero_chunks = zero_chunks;
+    estimate(argv[optind], argv[optind + 1], old_sa_path, &config);
+    return 0;
   }
 
-  if ((pf = fopen(argv[3], "w")) == NULL) {
-    err(1, "failed to create patch: %s\n", argv[3]);
+  // a patch chunked again, nothing is diffed
+  if (recode) {
+    if (config.memory_budget > 0 || placed || report ||
+        config.filter != BSDIFF_FILTER_NONE || expand || old_sa_path != NULL ||
+        new_sa_path != NULL || bundle || chain) {
+      errx(1, "-m, -A, -I, -r, -f, -x, -s, -S, -b and -p cannot be used "
+              "with -T\n");
+    }
+    config.zero_chunks = zero_chunks;
+    transcode(argv[optind], argv[optind + 1], &config);
+    return 0;
   }
 
-  // write header (signature+new_sz)
-  header.new_sz = new_sz;
-  if (fwrite(&header, sizeof(header), 1, pf) != 1) {
+  // the suffix arrays are of the images as they are, not filtered
+  if (config.filter != BSDIFF_FILTER_NONE &&
+      (old_sa_path != NULL || new_sa_path != NULL)) {
+    errx(1, "-s and -S cannot be used with -f\n");
+  }
+  if (expand && (old_sa_path != NULL || new_sa_path != NULL)) {
+    errx(1, "-s and -S cannot be used with -x\n");
+  }
+
+  old_path = argv[optind];
+  new_path = argv[optind + 1];
+  patch_path = argv[optind + 2];
+
+  // two patches in a row, composed without the images
+  if (chain) {
+    if (config.memory_budget > 0 || placed || report ||
+        config.filter != BSDIFF_FILTER_NONE || expand || old_sa_path != NULL ||
+        new_sa_path != NULL || bundle) {
+      errx(1, "-m, -A, -I, -r, -f, -x, -s, -S and -b cannot be used with "
+              "-p\n");
+    }
+    config.zero_chunks = zero_chunks;
+    compose(old_path, new_path, patch_path, &config);
+    return 0;
+  }
+
+  // a tree of files, every new file diffed against all the old ones at once
+  if (bundle) {
+    if (config.memory_budget > 0 || placed || report ||
+        config.filter != BSDIFF_FILTER_NONE || expand || old_sa_path != NULL ||
+        new_sa_path != NULL) {
+      errx(1, "-m, -A, -I, -r, -f, -x, -s and -S cannot be used with -b\n");
+    }
+    if (config.threads == 0) {
+      config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    config.zero_chunks = zero_chunks;
+    diff_bundle(old_path, new_path, patch_path, &config);
+    return 0;
+  }
+
+  // under a memory budget the inputs are mapped rather than loaded
+  if (config.memory_budget > 0) {
+    old = map_file(old_path, &old_sz, &old_sparse);
+  } else {
+    old = load_file(old_path, &old_sz, &old_sparse);
+  }
+  if (old == NULL) {
+    err(1, "failed to read old: %s\n", old_path);
+  }
+
+  streaming = strcmp(new_path, "-") == 0;
+  if (streaming && (new_sa_path != NULL || expand)) {
+    errx(1, "-S and -x need new in memory, it cannot be streamed\n");
+  }
+  if (streaming) {
+    new = NULL;
+    new_sz = 0;
+    new_sparse = 0;
+  } else if (config.memory_budget > 0) {
+    new = map_file(new_path, &new_sz, &new_sparse);
+  } else {
+    new = load_file(new_path, &new_sz, &new_sparse);
+  }
+  if (new == NULL && !streaming) {
+    err(1, "failed to read new: %s\n", new_path);
+  }
+
+  // sparse images are mostly zeros, -z forces zero chunks for the others
+  config.zero_chunks = zero_chunks || old_sparse || new_sparse;
+
+  if ((pf = fopen(patch_path, "w")) == NULL) {
+    err(1, "failed to create patch: %s\n", patch_path);
+  }
+
+  // with -x, the patch between the inflated images follows the streams
+  x_old = old;
+  x_old_sz = old_sz;
+  x_new = new;
+  x_new_sz = new_sz;
+  if (expand && expand_streams(pf, old, old_sz, new, new_sz, &x_old,
+                               &x_old_sz, &x_new, &x_new_sz) != 0) {
+    errx(1, "failed to inflate the deflate streams\n");
+  }
+
+  // write header (signature+new_sz), when streaming new_sz is filled in later
+  if (write_header(pf, &config, x_new_sz) != 0) {
     err(1, "failed to write header\n");
   }
 
   stream.malloc = malloc;
   stream.free = free;
   stream.write = file_write;
+  stream.read = stdin_read;
   stream.opaque = pf;
 
-  if (bsdiff(old, old_sz, new, new_sz, &stream)) {
+  /* The apply cost is only estimated with new in memory, and always is, so
+   * that a patch that cannot be applied in place does not go unnoticed.
+   */
+  if (!streaming) {
+    config.apply_cost = &cost;
+  }
+
+  old_sa = NULL;
+  if (old_sa_path != NULL) {
+    if ((old_sa = load_sa(&stream, old_sa_path, old, old_sz)) == NULL) {
+      err(1, "failed to load the suffix array of old: %s\n", old_sa_path);
+    }
+    config.old_sa = old_sa;
+  }
+
+  if (streaming) {
+    if (bsdiff_streaming(old, old_sz, &stream, &config, &streamed_sz)) {
+      err(1, "internal err at bsdiff\n");
+    }
+
+    if (fseek(pf, 0, SEEK_SET) != 0 ||
+        write_header(pf, &config, streamed_sz) != 0) {
+      err(1, "failed to write header\n");
+    }
+  } else if (bsdiff_ex(x_old, x_old_sz, x_new, x_new_sz, &stream, &config)) {
     err(1, "internal err at bsdiff\n");
     return -1;
   }
 
+  if (config.apply_cost != NULL && report) {
+    fprintf(stderr,
+            "patch: %lld bytes, in place: %lld moves of %lld bytes, "
+            "%lld bytes in %lld pages written, %lld bytes at peak\n",
+            (long long)ftello(pf), (long long)cost.shifts,
+            (long long)cost.shifted, (long long)cost.written,
+            (long long)cost.pages, (long long)cost.peak);
+  }
+
+  // bspatch refuses such a patch, bspatch_to still applies it
+  if (config.apply_cost != NULL && cost.unreadable > 0) {
+    if (config.in_place) {
+      fclose(pf);
+      unlink(patch_path);
+      errx(1, "%lld diff strings read old that is gone, the patch cannot be "
+              "applied in place\n",
+           (long long)cost.unreadable);
+    }
+    warnx("%lld diff strings read old that is gone, the patch cannot be "
+          "applied in place, only to a separate new file",
+          (long long)cost.unreadable);
+  }
+
   if (fclose(pf)) {
     err(1, "internal err at fclose\n");
   }
 
-  free(old);
-  free(new);
+  // the suffix array of new, for the next diff of the chain, from the patch
+  if (new_sa_path != NULL) {
+    if ((patch = load_file(patch_path, &patch_sz, &patch_sparse)) == NULL) {
+      err(1, "failed to read patch: %s\n", patch_path);
+    }
+    if (old_sa == NULL &&
+        ((old_sa = malloc((old_sz + 1) * sizeof(int64_t))) == NULL ||
+         bsdiff_sa_build(&stream, old, old_sz, old_sa) != 0)) {
+      errx(1, "failed to sort old\n");
+    }
+    if ((new_sa = malloc((new_sz + 1) * sizeof(int64_t))) == NULL ||
+        bsdiff_sa_update(&stream, old, old_sz, old_sa, new, new_sz, patch,
+                         patch_sz, new_sa) != 0) {
+      errx(1, "failed to derive the suffix array of new\n");
+    }
+    if (save_sa(new_sa_path, new_sa, new_sz) != 0) {
+      err(1, "failed to write the suffix array of new: %s\n", new_sa_path);
+    }
+    free(patch);
+    free(new_sa);
+  }
+  free(old_sa);
+  if (x_old != old) {
+    free(x_old);
+    free(x_new);
+  }
+
+  if (config.memory_budget > 0) {
+    unmap_file(old, old_sz);
+    unmap_file(new, new_sz);
+  } else {
+    free(old);
+    free(new);
+  }
 
   return 0;
 }
@@ -28,18 +28,32 @@
 
 #include <bzlib.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
 #include <bsdiff/adapters/array_like_adapter.h>
+#include <bsdiff/adapters/file_like_adapter.h>
 #include <bsdiff/bspatch.h>
 
+#include "deflate.h"
+
+#define USAGE                                                                  \
+  "usage: %s [-f | -d] oldfile newfile patchfile\n"                           \
+  "       %s -b olddir newdir patchfile\n"
+
 // static int bz2_read(const file_stream_t *stream, void *buffer, int size) {
 //   int n;
 //   int bz2err;
@@ -58,56 +72,785 @@ static size_t file_read(const bsdiff_stream_t *stream, void *buffer,
   return fread(buffer, 1, size, (FILE *)stream->opaque);
 }
 
+// the patch is the whole file
+static int file_rewind(const bsdiff_stream_t *stream) {
+  return fseeko((FILE *)stream->opaque, 0, SEEK_SET);
+}
+
+static size_t fd_size(int fd, const struct stat *sb) {
+  uint64_t sz;
+
+  sz = sb->st_size;
+#ifdef BLKGETSIZE64
+  if (S_ISBLK(sb->st_mode) && ioctl(fd, BLKGETSIZE64, &sz) != 0) {
+    err(1, "failed to get the size of the block device");
+  }
+#endif
+
+  return sz;
+}
+
+/* Finds the first data extent at or after off. Returns its start and sets
+ * *end past it, or returns size when only holes are left. Without SEEK_DATA
+ * support everything from off on is data.
+ */
+static off_t next_extent(int fd, off_t off, off_t size, off_t *end) {
+  off_t data;
+
+  *end = size;
+#ifdef SEEK_DATA
+  if ((data = lseek(fd, off, SEEK_DATA)) < 0) {
+    return errno == ENXIO ? size : off;
+  }
+  if ((*end = lseek(fd, data, SEEK_HOLE)) < 0) {
+    *end = size;
+  }
+  return data;
+#else
+  return off;
+#endif
+}
+
+// copies the data extents of from, holes stay holes
+static void copy_file(const char *from, const char *to) {
+  static uint8_t buffer[1024 * 1024];
+  struct stat sb;
+  off_t data, end, pos;
+  ssize_t n;
+  int in, out;
+
+  if (((in = open(from, O_RDONLY, 0)) < 0) || (fstat(in, &sb) != 0) ||
+      ((out = open(to, O_CREAT | O_TRUNC | O_WRONLY, sb.st_mode)) < 0)) {
+    err(1, "failed to copy %s to %s", from, to);
+  }
+
+  end = 0;
+  while ((data = next_extent(in, end, sb.st_size, &end)) < sb.st_size) {
+    for (pos = data; pos < end; pos += n) {
+      n = end - pos < (off_t)sizeof(buffer) ? end - pos : sizeof(buffer);
+      if (pread(in, buffer, n, pos) != n || pwrite(out, buffer, n, pos) != n) {
+        err(1, "failed to copy %s to %s", from, to);
+      }
+    }
+  }
+
+  if (ftruncate(out, sb.st_size) != 0 || close(in) != 0 || close(out) != 0) {
+    err(1, "failed to copy %s to %s", from, to);
+  }
+}
+
+/* Whether old and new are one file, under whatever two paths. New need not
+ * exist yet.
+ */
+static int same_file(const char *old_path, const char *new_path) {
+  struct stat old_sb, new_sb;
+
+  if (stat(old_path, &old_sb) != 0) {
+    err(1, "failed to open old file: %s\n", old_path);
+  }
+  if (stat(new_path, &new_sb) != 0) {
+    return 0;
+  }
+
+  // two device nodes of one block device are the same, too
+  if (S_ISBLK(old_sb.st_mode) && S_ISBLK(new_sb.st_mode)) {
+    return old_sb.st_rdev == new_sb.st_rdev;
+  }
+
+  return old_sb.st_dev == new_sb.st_dev && old_sb.st_ino == new_sb.st_ino;
+}
+
+/* Patches the new file (a copy of old, or old itself when both name the same
+ * file) in place through the file-like adapter, so nothing is loaded into
+ * memory. Works for block devices, too. Returns 1, with new as it was, for a
+ * patch that cannot be applied in place.
+ */
+static int patch_file(const char *old_path, const char *new_path,
+                      const bsdiff_stream_t *patch) {
+  file_like_t file_like;
+  bsdiff_array_like_t file;
+  struct stat sb;
+  size_t new_sz;
+  int fd, ret;
+
+  if (!same_file(old_path, new_path)) {
+    copy_file(old_path, new_path);
+  }
+
+  if (((fd = open(new_path, O_RDWR, 0)) < 0) || (fstat(fd, &sb) != 0)) {
+    err(1, "failed to open new file: %s\n", new_path);
+  }
+
+  if ((errno = make_file_like(&file_like, fd, fd_size(fd, &sb))) != 0) {
+    err(1, "failed to set up the file adapter");
+  }
+  if (S_ISREG(sb.st_mode)) {
+    file_like_set_sparse(&file_like);
+  }
+  make_file_like_adapter(&file, &file_like);
+
+  ret = bspatch(&file, patch, &new_sz);
+  if (ret == BSPATCH_IN_PLACE_ERR) {
+    destroy_file_like(&file_like);
+    close(fd);
+    return 1;
+  }
+  if (ret != BSPATCH_SUCCESS) {
+    errx(1, "internal err at bspatch");
+  }
+
+  if ((errno = destroy_file_like(&file_like)) != 0) {
+    err(1, "failed to write the new file at: %s", new_path);
+  }
+
+  if ((S_ISREG(sb.st_mode) && ftruncate(fd, new_sz) != 0) || close(fd) != 0) {
+    err(1, "failed to write the new file at: %s", new_path);
+  }
+
+  return 0;
+}
+
+// opens path with O_DIRECT, or without it when the file system refuses
+static int open_direct(const char *path, int flags, mode_t mode, int *direct) {
+  int fd;
+
+  *direct = 0;
+#ifdef O_DIRECT
+  if ((fd = open(path, flags | O_DIRECT, mode)) >= 0) {
+    *direct = 1;
+    return fd;
+  }
+  if (errno != EINVAL) {
+    return -1;
+  }
+  warnx("O_DIRECT is not supported for %s, using buffered I/O", path);
+#endif
+
+  return open(path, flags, mode);
+}
+
+static size_t sector_size(int fd, const struct stat *sb) {
+  int sz;
+
+  sz = FILE_LIKE_BUFFER_ALIGN;
+#ifdef BLKSSZGET
+  if (S_ISBLK(sb->st_mode) && ioctl(fd, BLKSSZGET, &sz) != 0) {
+    err(1, "failed to get the sector size of the block device");
+  }
+#endif
+
+  return sz;
+}
+
+/* A/B update: reads old and writes new (two files or two partitions) with
+ * O_DIRECT, so neither image goes through the page cache. Old is left as it
+ * was.
+ */
+static void patch_direct(const char *old_path, const char *new_path,
+                         const bsdiff_stream_t *patch) {
+  file_like_t old_like, new_like;
+  bsdiff_array_like_t old, new;
+  struct stat old_sb, new_sb;
+  size_t old_sz, new_sz;
+  int old_fd, new_fd, old_direct, new_direct;
+
+  // new is truncated while old is read, they cannot be one file
+  if (same_file(old_path, new_path)) {
+    errx(1, "old and new are the same file: %s\n", new_path);
+  }
+
+  if (((old_fd = open_direct(old_path, O_RDONLY, 0, &old_direct)) < 0) ||
+      (fstat(old_fd, &old_sb) != 0)) {
+    err(1, "failed to open old file: %s\n", old_path);
+  }
+
+  // block devices are written over, anything else is created afresh
+  if (stat(new_path, &new_sb) == 0 && S_ISBLK(new_sb.st_mode)) {
+    new_fd = open_direct(new_path, O_WRONLY, 0, &new_direct);
+  } else {
+    new_fd = open_direct(new_path, O_CREAT | O_TRUNC | O_WRONLY,
+                         old_sb.st_mode, &new_direct);
+  }
+  if (new_fd < 0 || fstat(new_fd, &new_sb) != 0) {
+    err(1, "failed to open new file: %s\n", new_path);
+  }
+
+  // new is only written, so none of it has to be read back
+  old_sz = fd_size(old_fd, &old_sb);
+  if ((errno = make_file_like(&old_like, old_fd, old_sz)) != 0 ||
+      (errno = make_file_like(&new_like, new_fd, 0)) != 0) {
+    err(1, "failed to set up the file adapter");
+  }
+  if (old_direct) {
+    file_like_set_direct(&old_like, sector_size(old_fd, &old_sb));
+  }
+  if (new_direct) {
+    file_like_set_direct(&new_like, sector_size(new_fd, &new_sb));
+  }
+  if (S_ISREG(new_sb.st_mode)) {
+    file_like_set_sparse(&new_like);
+  }
+  make_file_like_adapter(&old, &old_like);
+  make_file_like_adapter(&new, &new_like);
+
+  if (bspatch_to(&old, &new, patch, &new_sz)) {
+    errx(1, "internal err at bspatch");
+  }
+
+  if ((errno = destroy_file_like(&new_like)) != 0) {
+    err(1, "failed to write the new file at: %s", new_path);
+  }
+  destroy_file_like(&old_like);
+
+  // the last block went out rounded up to a whole sector
+  if ((S_ISREG(new_sb.st_mode) && ftruncate(new_fd, new_sz) != 0) ||
+      fsync(new_fd) != 0 || close(new_fd) != 0) {
+    err(1, "failed to write the new file at: %s", new_path);
+  }
+  close(old_fd);
+}
+
+// -f and the memory mode fall back the same way, and say so the same way
+static void warn_anew(const char *new_path) {
+  warnx("the patch cannot be applied in place, %s is written anew", new_path);
+}
+
+/* Applies a patch that cannot be applied in place from old to a separate new,
+ * as -d does. Where new is old itself, new is staged beside it and then
+ * takes its place.
+ */
+static void patch_staged(const char *old_path, const char *new_path,
+                         const bsdiff_stream_t *patch) {
+  char staged[PATH_MAX];
+  struct stat sb;
+
+  if (patch->rewind(patch) != 0) {
+    err(1, "failed to read the patch");
+  }
+
+  if (!same_file(old_path, new_path)) {
+    patch_direct(old_path, new_path, patch);
+    return;
+  }
+
+  if (stat(new_path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    errx(1, "the patch cannot be applied over %s, apply it with -d\n",
+         new_path);
+  }
+  if (snprintf(staged, PATH_MAX, "%s.bspatch", new_path) >= PATH_MAX) {
+    errx(1, "path too long: %s\n", new_path);
+  }
+  patch_direct(old_path, staged, patch);
+  if (rename(staged, new_path) != 0) {
+    err(1, "failed to replace %s\n", new_path);
+  }
+}
+
+/* The image of the memory mode. New can be larger than old, and old is moved
+ * ahead of it on the way, so the buffer grows as bspatch writes past it.
+ */
+typedef struct growing_array {
+  array_like_t array; // first, array_like_read takes it for an array_like_t
+  size_t cap;
+} growing_array_t;
+
+static size_t growing_write(bsdiff_array_like_t *arr, size_t offset,
+                            void *buffer, size_t size) {
+  growing_array_t *ga;
+  uint8_t *grown;
+  size_t cap;
+
+  ga = (growing_array_t *)arr->opaque;
+  if (offset + size > ga->cap) {
+    cap = offset + size > 2 * ga->cap ? offset + size : 2 * ga->cap;
+    if ((grown = realloc(ga->array.arr, cap)) == NULL) {
+      return 0;
+    }
+    ga->array.arr = grown;
+    ga->cap = cap;
+  }
+  memcpy(ga->array.arr + offset, buffer, size);
+
+  return size;
+}
+
+/* Applies a patch with deflate streams, see bsdiff_deflate_header_t: the
+ * streams of old are inflated, and those of new compressed back after.
+ */
+static uint8_t *patch_deflate(const uint8_t *old, size_t old_sz,
+                              const bsdiff_stream_t *patch, size_t *new_sz) {
+  bsdiff_deflate_header_t header;
+  bsdiff_deflate_stream_t *old_streams, *new_streams;
+  size_t old_len, new_len, x_old_sz, x_new_sz;
+  uint8_t *x_old, *new;
+  array_like_t x_old_array;
+  growing_array_t x_new_array;
+  bsdiff_array_like_t x_old_like, x_new_like;
+
+  if (patch->read(patch, &header, sizeof(header)) != sizeof(header) ||
+      header.old_streams > old_sz || header.new_streams > header.new_sz) {
+    errx(1, "corrupt patch\n");
+  }
+
+  old_len = header.old_streams * sizeof(*old_streams);
+  new_len = header.new_streams * sizeof(*new_streams);
+  if ((old_streams = malloc(old_len + 1)) == NULL ||
+      (new_streams = malloc(new_len + 1)) == NULL ||
+      patch->read(patch, old_streams, old_len) != old_len ||
+      patch->read(patch, new_streams, new_len) != new_len) {
+    errx(1, "corrupt patch\n");
+  }
+
+  x_old = deflate_expand(old, old_sz, old_streams, header.old_streams,
+                         &x_old_sz);
+  if (x_old == NULL) {
+    errx(1, "failed to inflate the deflate streams of old\n");
+  }
+
+  // inflated new grows as bspatch writes it
+  make_array_like(&x_old_array, x_old, x_old_sz);
+  make_array_like_adapter(&x_old_like, &x_old_array);
+  make_array_like(&x_new_array.array, NULL, 0);
+  make_array_like_adapter(&x_new_like, &x_new_array.array);
+  x_new_array.cap = 0;
+  x_new_like.opaque = &x_new_array;
+  x_new_like.write = growing_write;
+
+  if (bspatch_to(&x_old_like, &x_new_like, patch, &x_new_sz)) {
+    errx(1, "internal err at bspatch");
+  }
+
+  new = deflate_compress(x_new_array.array.arr, x_new_sz, new_streams,
+                         header.new_streams, header.new_sz);
+  if (new == NULL) {
+    errx(1, "failed to compress the deflate streams of new back\n");
+  }
+
+  free(x_new_array.array.arr);
+  free(x_old);
+  free(new_streams);
+  free(old_streams);
+  *new_sz = header.new_sz;
+
+  return new;
+}
+
+/* Applies a patch that bspatch refused to apply in place to a new array
+ * beside old. Nothing of old was written by then.
+ */
+static uint8_t *patch_to_buffer(bsdiff_array_like_t *old,
+                                const bsdiff_stream_t *patch, size_t *new_sz) {
+  growing_array_t new_array;
+  bsdiff_array_like_t new;
+
+  if (patch->rewind(patch) != 0) {
+    err(1, "failed to read the patch");
+  }
+
+  make_array_like(&new_array.array, NULL, 0);
+  make_array_like_adapter(&new, &new_array.array);
+  new_array.cap = 0;
+  new.opaque = &new_array;
+  new.write = growing_write;
+
+  if (bspatch_to(old, &new, patch, new_sz)) {
+    errx(1, "internal err at bspatch");
+  }
+
+  return new_array.array.arr;
+}
+
+/* The old files of a bundle laid end to end, see bsdiff_bundle_header_t.
+ * One of them is open at a time.
+ */
+typedef struct tree_like {
+  const char *root;
+  char **names;
+  uint64_t *offsets; // where each file starts, and where the last one ends
+  uint32_t count;
+  uint32_t open; // the file fd is of, count for none
+  int fd;
+} tree_like_t;
+
+// root/name into path, which takes PATH_MAX bytes
+static void join_path(char *path, const char *root, const char *name,
+                      const char *suffix) {
+  if (snprintf(path, PATH_MAX, "%s/%s%s", root, name, suffix) >= PATH_MAX) {
+    errx(1, "path too long: %s/%s\n", root, name);
+  }
+}
+
+static size_t tree_read(const bsdiff_array_like_t *arr, size_t offset,
+                        void *buffer, size_t size) {
+  tree_like_t *tree;
+  char path[PATH_MAX];
+  uint32_t lo, hi, mid;
+  size_t i, n;
+
+  tree = (tree_like_t *)arr->opaque;
+  for (i = 0; i < size; i += n) {
+    // the last file starting at or before the offset, empty ones are passed
+    lo = 0;
+    hi = tree->count;
+    while (hi - lo > 1) {
+      mid = lo + (hi - lo) / 2;
+      if (tree->offsets[mid] <= offset + i) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    while (lo < tree->count && tree->offsets[lo + 1] <= offset + i) {
+      lo++;
+    }
+    if (lo >= tree->count) {
+      return i;
+    }
+
+    if (lo != tree->open) {
+      if (tree->open != tree->count) {
+        close(tree->fd);
+        tree->open = tree->count;
+      }
+      join_path(path, tree->root, tree->names[lo], "");
+      if ((tree->fd = open(path, O_RDONLY, 0)) < 0) {
+        return i;
+      }
+      tree->open = lo;
+    }
+
+    n = size - i;
+    if (n > tree->offsets[lo + 1] - (offset + i)) {
+      n = tree->offsets[lo + 1] - (offset + i);
+    }
+    if (pread(tree->fd, (uint8_t *)buffer + i, n,
+              offset + i - tree->offsets[lo]) != (ssize_t)n) {
+      return i;
+    }
+  }
+
+  return size;
+}
+
+static size_t tree_len(bsdiff_array_like_t *arr) {
+  const tree_like_t *tree;
+
+  tree = (const tree_like_t *)arr->opaque;
+
+  return tree->offsets[tree->count];
+}
+
+static size_t fd_write(bsdiff_array_like_t *arr, size_t offset, void *buffer,
+                       size_t size) {
+  return pwrite(*(int *)arr->opaque, buffer, size, offset) == (ssize_t)size
+             ? size
+             : 0;
+}
+
+/* bspatch_to only asks old for its length, never new, which starts out empty
+ * anyway.
+ */
+static size_t fd_len(bsdiff_array_like_t *arr) {
+  (void)arr;
+
+  return 0;
+}
+
+/* A name from the patch, which has to stay inside the tree: not absolute,
+ * no "..", nothing empty.
+ */
+static char *read_name(FILE *fp, uint32_t len) {
+  char *name, *part;
+
+  if (len == 0 || len >= PATH_MAX || (name = malloc(len + 1)) == NULL ||
+      fread(name, 1, len, fp) != len) {
+    errx(1, "corrupt patch\n");
+  }
+  name[len] = '\0';
+
+  if (strlen(name) != len || name[0] == '/' || name[len - 1] == '/' ||
+      strstr(name, "//") != NULL) {
+    errx(1, "corrupt patch, bad file name: %s\n", name);
+  }
+  for (part = name; part != NULL; part = strchr(part, '/')) {
+    part += *part == '/';
+    if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0')) {
+      errx(1, "corrupt patch, bad file name: %s\n", name);
+    }
+  }
+
+  return name;
+}
+
+// creates the directories path is in, under root
+static void make_parents(char *path, size_t root_len) {
+  char *slash;
+
+  for (slash = strchr(path + root_len + 1, '/'); slash != NULL;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+      err(1, "failed to create %s\n", path);
+    }
+    *slash = '/';
+  }
+}
+
+/* Applies a bundle, see bsdiff_bundle_header_t, a new file at a time. Into
+ * the old tree itself, each new file is written beside the old one, and
+ * they replace the old files only once all are patched, as any new file may
+ * read any old one. Old files the new tree does not have are removed then.
+ */
+static void patch_bundle(const char *old_dir, const char *new_dir, FILE *fp,
+                         const bsdiff_stream_t *patch) {
+  bsdiff_bundle_header_t header;
+  bsdiff_bundle_entry_t *entries;
+  tree_like_t tree;
+  bsdiff_array_like_t old, new;
+  char path[PATH_MAX], staged[PATH_MAX];
+  char **names;
+  struct stat old_sb, new_sb, sb;
+  size_t new_sz;
+  uint32_t i, j, count;
+  off_t start;
+  mode_t mode;
+  int fd, in_place;
+
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.signature, BSDIFF_SIGNATURE_BUNDLE,
+             BSDIFF_SIGNATURE_LEN) != 0 ||
+      (uint64_t)header.old_files + header.new_files >= UINT32_MAX) {
+    errx(1, "corrupt patch\n");
+  }
+
+  count = header.old_files + header.new_files;
+  entries = malloc((count + 1) * sizeof(*entries));
+  names = malloc((count + 1) * sizeof(*names));
+  tree.offsets = malloc((header.old_files + 1) * sizeof(uint64_t));
+  if (entries == NULL || names == NULL || tree.offsets == NULL) {
+    err(1, "failed to allocate the file list\n");
+  }
+  for (i = 0; i < count; i++) {
+    if (fread(&entries[i], sizeof(*entries), 1, fp) != 1) {
+      errx(1, "corrupt patch\n");
+    }
+    names[i] = read_name(fp, entries[i].name_len);
+  }
+
+  // the old tree has to be the one the patch was made from
+  tree.offsets[0] = 0;
+  for (i = 0; i < header.old_files; i++) {
+    join_path(path, old_dir, names[i], "");
+    if (stat(path, &sb) != 0 || (uint64_t)sb.st_size != entries[i].size) {
+      errx(1, "old is not the tree the patch was made from: %s\n", path);
+    }
+    tree.offsets[i + 1] = tree.offsets[i] + entries[i].size;
+  }
+  tree.root = old_dir;
+  tree.names = names;
+  tree.count = header.old_files;
+  tree.open = tree.count;
+  old.opaque = &tree;
+  old.read = tree_read;
+  old.write = NULL; // the old files are only read
+  old.len = tree_len;
+
+  if (mkdir(new_dir, 0755) != 0 && errno != EEXIST) {
+    err(1, "failed to create %s\n", new_dir);
+  }
+  if (stat(old_dir, &old_sb) != 0 || stat(new_dir, &new_sb) != 0) {
+    err(1, "failed to open %s\n", old_dir);
+  }
+  in_place = old_sb.st_dev == new_sb.st_dev && old_sb.st_ino == new_sb.st_ino;
+
+  new.opaque = &fd;
+  new.read = NULL; // new is only written
+  new.write = fd_write;
+  new.len = fd_len;
+
+  start = ftello(fp);
+  for (i = header.old_files; i < count; i++) {
+    // a file that was there keeps its mode
+    join_path(path, old_dir, names[i], "");
+    mode = stat(path, &sb) == 0 ? sb.st_mode & 07777 : 0644;
+
+    join_path(path, new_dir, names[i], in_place ? ".bspatch" : "");
+    make_parents(path, strlen(new_dir));
+    if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, mode)) < 0) {
+      err(1, "failed to create %s\n", path);
+    }
+
+    if (bspatch_to(&old, &new, patch, &new_sz) != 0 ||
+        new_sz != entries[i].size) {
+      errx(1, "internal err at bspatch: %s\n", names[i]);
+    }
+    if (ftruncate(fd, new_sz) != 0 || close(fd) != 0) {
+      err(1, "failed to write the new file at: %s", path);
+    }
+
+    // the patch of a file may not be read to its very end
+    start += entries[i].patch_sz;
+    if (fseeko(fp, start, SEEK_SET) != 0) {
+      errx(1, "corrupt patch\n");
+    }
+  }
+  if (tree.open != tree.count) {
+    close(tree.fd);
+  }
+
+  if (in_place) {
+    for (i = header.old_files; i < count; i++) {
+      join_path(path, new_dir, names[i], "");
+      join_path(staged, new_dir, names[i], ".bspatch");
+      if (rename(staged, path) != 0) {
+        err(1, "failed to replace %s\n", path);
+      }
+    }
+    for (i = 0; i < header.old_files; i++) {
+      for (j = header.old_files; j < count; j++) {
+        if (strcmp(names[i], names[j]) == 0) {
+          break;
+        }
+      }
+      join_path(path, old_dir, names[i], "");
+      if (j == count && unlink(path) != 0) {
+        err(1, "failed to remove %s\n", path);
+      }
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    free(names[i]);
+  }
+  free(names);
+  free(entries);
+  free(tree.offsets);
+}
+
 int main(int argc, char *argv[]) {
   FILE *fp;
   int fd;
   int bz2err;
 
-  uint8_t *old_buffer;
+  uint8_t *old_buffer, *new_buffer;
   struct stat sb;
 
   size_t old_sz;
-  array_like_t old_array_like;
+  growing_array_t old_array_like;
   bsdiff_array_like_t old;
   bsdiff_stream_t patch;
   size_t new_sz;
 
-  if (argc != 4) {
-    errx(1, "usage: %s oldfile newfile patchfile\n", argv[0]);
+  const char *old_path, *new_path, *patch_path;
+  int opt, file_mode, direct_mode, deflate, bundle, ret;
+  char signature[BSDIFF_SIGNATURE_LEN];
+
+  file_mode = 0;
+  direct_mode = 0;
+  bundle = 0;
+  while ((opt = getopt(argc, argv, "fdb")) != -1) {
+    switch (opt) {
+    case 'f':
+      file_mode = 1;
+      break;
+    case 'd':
+      direct_mode = 1;
+      break;
+    case 'b':
+      bundle = 1;
+      break;
+    default:
+      errx(1, USAGE, argv[0], argv[0]);
+    }
   }
 
-  if (((fd = open(argv[1], O_RDONLY, 0)) < 0) ||
-      ((old_sz = lseek(fd, 0, SEEK_END)) == -1) ||
-      ((old_buffer = malloc(old_sz + 1)) == NULL) ||
-      (lseek(fd, 0, SEEK_SET) != 0) ||
-      (read(fd, old_buffer, old_sz) != old_sz) || (fstat(fd, &sb)) ||
-      (close(fd) == -1)) {
-    err(1, "failed to open old file: %s\n", argv[1]);
+  if (argc - optind != 3 || file_mode + direct_mode + bundle > 1) {
+    errx(1, USAGE, argv[0], argv[0]);
   }
 
-  make_array_like(&old_array_like, old_buffer, old_sz);
-  make_array_like_adapter(&old, &old_array_like);
+  old_path = argv[optind];
+  new_path = argv[optind + 1];
+  patch_path = argv[optind + 2];
 
   // open patch file
-  fp = fopen(argv[3], "r");
+  fp = fopen(patch_path, "r");
   if (fp == NULL) {
-    err(1, "failed to open patch file: %s\n", argv[3]);
+    err(1, "failed to open patch file: %s\n", patch_path);
   }
 
   patch.opaque = fp;
   patch.read = file_read;
   patch.write = NULL; // patch will not be writen
+  patch.rewind = file_rewind;
 
-  if (bspatch(&old, &patch, &new_sz)) {
-    errx(1, "internal err at bspatch");
+  if (bundle) {
+    patch_bundle(old_path, new_path, fp, &patch);
+    fclose(fp);
+    return 0;
+  }
+
+  // a patch with deflate streams is only applied in memory
+  deflate = fread(signature, 1, sizeof(signature), fp) == sizeof(signature) &&
+            memcmp(signature, BSDIFF_SIGNATURE_DEFLATE,
+                   BSDIFF_SIGNATURE_LEN) == 0;
+  rewind(fp);
+  if (deflate && (file_mode || direct_mode)) {
+    errx(1, "a patch made with -x cannot be applied with -f or -d\n");
+  }
+
+  if (file_mode) {
+    if (patch_file(old_path, new_path, &patch) != 0) {
+      warn_anew(new_path);
+      patch_staged(old_path, new_path, &patch);
+    }
+    fclose(fp);
+    return 0;
+  }
+
+  if (direct_mode) {
+    patch_direct(old_path, new_path, &patch);
+    fclose(fp);
+    return 0;
+  }
+
+  if (((fd = open(old_path, O_RDONLY, 0)) < 0) ||
+      ((old_sz = lseek(fd, 0, SEEK_END)) == -1) ||
+      ((old_buffer = malloc(old_sz + 1)) == NULL) ||
+      (lseek(fd, 0, SEEK_SET) != 0) ||
+      (read(fd, old_buffer, old_sz) != old_sz) || (fstat(fd, &sb)) ||
+      (close(fd) == -1)) {
+    err(1, "failed to open old file: %s\n", old_path);
+  }
+
+  if (deflate) {
+    new_buffer = patch_deflate(old_buffer, old_sz, &patch, &new_sz);
+    free(old_buffer);
+    old_buffer = new_buffer;
+  } else {
+    make_array_like(&old_array_like.array, old_buffer, old_sz);
+    make_array_like_adapter(&old, &old_array_like.array);
+    old_array_like.cap = old_sz + 1;
+    old.opaque = &old_array_like;
+    old.write = growing_write;
+
+    ret = bspatch(&old, &patch, &new_sz);
+    if (ret == BSPATCH_IN_PLACE_ERR) {
+      warn_anew(new_path);
+      new_buffer = patch_to_buffer(&old, &patch, &new_sz);
+      free(old_array_like.array.arr);
+      old_array_like.array.arr = new_buffer;
+    } else if (ret != BSPATCH_SUCCESS) {
+      errx(1, "internal err at bspatch");
+    }
+    old_buffer = old_array_like.array.arr;
   }
 
   fclose(fp);
 
   // write the new file
-  if (((fd = open(argv[2], O_CREAT | O_TRUNC | O_WRONLY, sb.st_mode)) < 0) ||
-      (write(fd, old_buffer, new_sz) != old_sz) || (close(fd) == -1)) {
-    err(1, "failed to write the new file at: %s", argv[2]);
+  if (((fd = open(new_path, O_CREAT | O_TRUNC | O_WRONLY, sb.st_mode)) < 0) ||
+      (write(fd, old_buffer, new_sz) != new_sz) || (close(fd) == -1)) {
+    err(1, "failed to write the new file at: %s", new_path);
   }
 
   free(old_buffer);
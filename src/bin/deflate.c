@@ -0,0 +1,346 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "deflate.h"
+
+// streams that inflate to less are left as they are
+#define DEFLATE_MIN_RAW (64)
+// bytes inflated or deflated at a time, on the stack
+#define DEFLATE_CHUNK (16 * 1024)
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+/* The levels tried to compress a stream back, the usual ones first. Only
+ * zlib's default strategy is tried, the others are rare in archives.
+ */
+static const uint8_t levels[] = {6, 9, 1, 5, 4, 3, 2, 7, 8};
+static const uint8_t mem_levels[] = {8, 9};
+
+static uint32_t load16(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+/* Where the deflate data of a gzip member or a local zip entry at pos
+ * starts, 0 when there is none.
+ */
+static size_t stream_start(const uint8_t *image, size_t sz, size_t pos) {
+  const uint8_t *p;
+  size_t start;
+
+  p = image + pos;
+  if (pos + 10 <= sz && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 &&
+      (p[3] & 0xe0) == 0) {
+    start = pos + 10;
+    if ((p[3] & 0x04) && start + 2 <= sz) { // FEXTRA
+      start += 2 + load16(image + start);
+    }
+    if (p[3] & 0x08) { // FNAME
+      while (start < sz && image[start++] != 0) {
+      }
+    }
+    if (p[3] & 0x10) { // FCOMMENT
+      while (start < sz && image[start++] != 0) {
+      }
+    }
+    if (p[3] & 0x02) { // FHCRC
+      start += 2;
+    }
+    return start < sz ? start : 0;
+  }
+
+  // deflated entries only, the sizes may be in a data descriptor after it
+  if (pos + 30 <= sz && memcmp(p, "PK\3\4", 4) == 0 && load16(p + 8) == 8) {
+    start = pos + 30 + load16(p + 26) + load16(p + 28);
+    return start < sz ? start : 0;
+  }
+
+  return 0;
+}
+
+/* Sets the lengths of the stream at stream->offset, which ends somewhere
+ * within the sz bytes of image.
+ */
+static int inflate_len(const uint8_t *image, size_t sz,
+                       bsdiff_deflate_stream_t *stream) {
+  uint8_t out[DEFLATE_CHUNK];
+  z_stream z;
+  int ret;
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+    return -1;
+  }
+
+  z.next_in = (Bytef *)image + stream->offset;
+  z.avail_in = MIN(sz - stream->offset, UINT_MAX);
+  do {
+    z.next_out = out;
+    z.avail_out = sizeof(out);
+    ret = inflate(&z, Z_NO_FLUSH);
+  } while (ret == Z_OK);
+
+  stream->len = z.total_in;
+  stream->raw_len = z.total_out;
+  inflateEnd(&z);
+
+  return ret == Z_STREAM_END ? 0 : -1;
+}
+
+// inflates the stream, which has to be exactly len bytes into raw_len
+static int inflate_into(const uint8_t *src, uint64_t len, uint8_t *dst,
+                        uint64_t raw_len) {
+  z_stream z;
+  int ret;
+
+  if (len > UINT_MAX || raw_len > UINT_MAX) {
+    return -1;
+  }
+
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+    return -1;
+  }
+
+  z.next_in = (Bytef *)src;
+  z.avail_in = len;
+  z.next_out = dst;
+  z.avail_out = raw_len;
+  ret = inflate(&z, Z_FINISH);
+  if (ret == Z_STREAM_END && (z.total_in != len || z.total_out != raw_len)) {
+    ret = Z_DATA_ERROR;
+  }
+  inflateEnd(&z);
+
+  return ret == Z_STREAM_END ? 0 : -1;
+}
+
+/* Deflates raw with the parameters of stream into dst, which takes exactly
+ * stream->len bytes. With check, dst already holds them and is compared
+ * instead, up to the first byte that differs.
+ */
+static int deflate_into(const bsdiff_deflate_stream_t *stream,
+                        const uint8_t *raw, uint8_t *dst, int check) {
+  uint8_t out[DEFLATE_CHUNK];
+  uint64_t done, n;
+  z_stream z;
+  int ret;
+
+  if (stream->raw_len > UINT_MAX) {
+    return -1;
+  }
+
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, stream->level, Z_DEFLATED, -MAX_WBITS,
+                   stream->mem_level, stream->strategy) != Z_OK) {
+    return -1;
+  }
+
+  z.next_in = (Bytef *)raw;
+  z.avail_in = stream->raw_len;
+  done = 0;
+  do {
+    z.next_out = out;
+    z.avail_out = sizeof(out);
+    ret = deflate(&z, Z_FINISH);
+    n = sizeof(out) - z.avail_out;
+    if ((ret != Z_OK && ret != Z_STREAM_END) || done + n > stream->len ||
+        (check ? memcmp(dst + done, out, n) != 0
+               : (memcpy(dst + done, out, n), 0))) {
+      ret = Z_DATA_ERROR;
+      break;
+    }
+    done += n;
+  } while (ret == Z_OK);
+  deflateEnd(&z);
+
+  return ret == Z_STREAM_END && done == stream->len ? 0 : -1;
+}
+
+// finds parameters that compress raw back to the stream at src
+static int find_params(bsdiff_deflate_stream_t *stream, const uint8_t *src,
+                       const uint8_t *raw) {
+  size_t i, j;
+
+  stream->strategy = Z_DEFAULT_STRATEGY;
+  for (i = 0; i < sizeof(levels); i++) {
+    for (j = 0; j < sizeof(mem_levels); j++) {
+      stream->level = levels[i];
+      stream->mem_level = mem_levels[j];
+      if (deflate_into(stream, raw, (uint8_t *)src, 1) == 0) {
+        return 0;
+      }
+    }
+  }
+
+  return -1;
+}
+
+int deflate_find(const uint8_t *image, size_t sz, int exact,
+                 bsdiff_deflate_stream_t **streams, uint32_t *count) {
+  bsdiff_deflate_stream_t stream, *grown;
+  uint32_t cap;
+  uint8_t *raw;
+  size_t pos;
+  int ok;
+
+  *streams = NULL;
+  *count = 0;
+  cap = 0;
+  for (pos = 0; pos < sz; pos++) {
+    memset(&stream, 0, sizeof(stream));
+    stream.offset = stream_start(image, sz, pos);
+    if (stream.offset == 0 || inflate_len(image, sz, &stream) != 0 ||
+        stream.raw_len < DEFLATE_MIN_RAW) {
+      continue;
+    }
+
+    ok = 1;
+    if (exact) {
+      raw = malloc(stream.raw_len);
+      ok = raw != NULL &&
+           inflate_into(image + stream.offset, stream.len, raw,
+                        stream.raw_len) == 0 &&
+           find_params(&stream, image + stream.offset, raw) == 0;
+      stream.crc = crc32(0, image + stream.offset, stream.len);
+      free(raw);
+    }
+
+    // a stream that cannot be compressed back is diffed as it is
+    if (ok) {
+      if (*count == cap) {
+        cap = cap ? 2 * cap : 16;
+        if ((grown = realloc(*streams, cap * sizeof(stream))) == NULL) {
+          free(*streams);
+          *streams = NULL;
+          *count = 0;
+          return -1;
+        }
+        *streams = grown;
+      }
+      (*streams)[(*count)++] = stream;
+    }
+    pos = stream.offset + stream.len - 1;
+  }
+
+  return 0;
+}
+
+/* The size of image with its streams inflated. Fails when the streams are
+ * not in order within its sz bytes.
+ */
+static int expanded_size(const bsdiff_deflate_stream_t *streams,
+                         uint32_t count, size_t sz, size_t *expanded) {
+  uint64_t end;
+  uint32_t i;
+
+  end = 0;
+  *expanded = sz;
+  for (i = 0; i < count; i++) {
+    if (streams[i].offset < end || streams[i].len > sz ||
+        streams[i].offset > sz - streams[i].len ||
+        streams[i].raw_len > UINT_MAX ||
+        streams[i].raw_len > SIZE_MAX - *expanded) {
+      return -1;
+    }
+    end = streams[i].offset + streams[i].len;
+    *expanded += streams[i].raw_len - streams[i].len;
+  }
+
+  return 0;
+}
+
+uint8_t *deflate_expand(const uint8_t *image, size_t sz,
+                        const bsdiff_deflate_stream_t *streams,
+                        uint32_t count, size_t *expanded_sz) {
+  uint8_t *expanded, *out;
+  uint64_t pos;
+  uint32_t i;
+
+  if (expanded_size(streams, count, sz, expanded_sz) != 0) {
+    return NULL;
+  }
+  if ((expanded = malloc(*expanded_sz + 1)) == NULL) {
+    return NULL;
+  }
+
+  out = expanded;
+  pos = 0;
+  for (i = 0; i < count; i++) {
+    memcpy(out, image + pos, streams[i].offset - pos);
+    out += streams[i].offset - pos;
+    if (inflate_into(image + streams[i].offset, streams[i].len, out,
+                     streams[i].raw_len) != 0) {
+      free(expanded);
+      return NULL;
+    }
+    out += streams[i].raw_len;
+    pos = streams[i].offset + streams[i].len;
+  }
+  memcpy(out, image + pos, sz - pos);
+
+  return expanded;
+}
+
+uint8_t *deflate_compress(const uint8_t *expanded, size_t expanded_sz,
+                          const bsdiff_deflate_stream_t *streams,
+                          uint32_t count, size_t sz) {
+  const uint8_t *in;
+  uint8_t *image;
+  uint64_t pos;
+  size_t n;
+  uint32_t i;
+
+  if (expanded_size(streams, count, sz, &n) != 0 || n != expanded_sz) {
+    return NULL;
+  }
+  if ((image = malloc(sz + 1)) == NULL) {
+    return NULL;
+  }
+
+  in = expanded;
+  pos = 0;
+  for (i = 0; i < count; i++) {
+    memcpy(image + pos, in, streams[i].offset - pos);
+    in += streams[i].offset - pos;
+    if (deflate_into(&streams[i], in, image + streams[i].offset, 0) != 0 ||
+        crc32(0, image + streams[i].offset, streams[i].len) !=
+            streams[i].crc) {
+      free(image);
+      return NULL;
+    }
+    in += streams[i].raw_len;
+    pos = streams[i].offset + streams[i].len;
+  }
+  memcpy(image + pos, in, sz - pos);
+
+  return image;
+}
@@ -0,0 +1,63 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_BIN_DEFLATE_H_
+#define _BSDIFF_BIN_DEFLATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bsdiff/patch_format.h>
+
+/**
+ * Finds the deflate streams of gzip members and zip entries in image, see
+ * bsdiff_deflate_header_t. With exact, only the streams zlib compresses back
+ * to the same bytes are kept, with the parameters that do. The streams are
+ * in *streams, allocated by malloc. Returns 0 on success.
+ */
+int deflate_find(const uint8_t *image, size_t sz, int exact,
+                 bsdiff_deflate_stream_t **streams, uint32_t *count);
+
+/**
+ * Image with its streams inflated, in a buffer allocated by malloc. NULL
+ * when the streams are not those of image.
+ */
+uint8_t *deflate_expand(const uint8_t *image, size_t sz,
+                        const bsdiff_deflate_stream_t *streams,
+                        uint32_t count, size_t *expanded_sz);
+
+/**
+ * The image of sz bytes deflate_expand gave expanded for, with its streams
+ * compressed back, in a buffer allocated by malloc. NULL when a stream does
+ * not come out as it was, e.g. with another version of zlib.
+ */
+uint8_t *deflate_compress(const uint8_t *expanded, size_t expanded_sz,
+                          const bsdiff_deflate_stream_t *streams,
+                          uint32_t count, size_t sz);
+
+#endif // _BSDIFF_BIN_DEFLATE_H_
@@ -27,14 +27,60 @@
  */
 
 #include <limits.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
 
 #include <bsdiff/legacy/bsdiff.h>
-#include <fastlz.h>
 
-#include "bsearch.h"
+#include "filter.h"
 #include "helper.h"
-#include "qsufsort.h"
+#include "in_place.h"
+#include "match_index.h"
+#include "writer.h"
+
+/* How hard new is searched, one of the effort levels, and the clock that
+ * lowers it once config->time_budget runs out.
+ */
+typedef struct effort {
+  int64_t stride;    // bytes of new stepped over after a fruitless search
+  int64_t mismatch;  // bytes a match must gain over the current alignment
+  int64_t ahead;     // positions searched past a match, for config->lookahead
+  int level;         // FastLZ compression level
+  uint8_t forward;   // config->in_place, old before the last match is gone
+  uint8_t skip_runs; // config->zero_chunks, long runs of one byte jumped
+
+  int64_t budget;   // config->time_budget, 0 for no limit
+  int64_t deadline; // wall clock in ms the budget runs out at
+  int64_t probes;   // searches left until the clock is read again
+  uint8_t stopped;  // twice the budget is gone, nothing more is searched
+
+  int64_t searches; // of old so far, for bsdiff_estimate
+} effort_t;
+
+/* The default is the threshold of the original bsdiff, which suits bzip2.
+ * With the codecs here a higher one keeps more of a long alignment and makes
+ * patches of loosely related binaries up to a fifth smaller, at little cost
+ * in time.
+ */
+static const effort_t effort_levels[] = {
+    [BSDIFF_EFFORT_FAST] = {.stride = 8, .mismatch = 16, .level = 1},
+    [BSDIFF_EFFORT_DEFAULT] = {.stride = 1, .mismatch = 8, .level = 2},
+    [BSDIFF_EFFORT_MAX] = {.stride = 1,
+                           .mismatch = 32,
+                           .ahead = LOOKAHEAD_MAX,
+                           .level = 2},
+};
+
+/* The image bspatch builds new in, followed block by block, for
+ * config->in_place and the estimate in config->apply_cost.
+ */
+typedef struct apply {
+  in_place_t image;
+  int64_t page_size;
+  int64_t last_page; // the page written last, going on in it costs nothing
+  bsdiff_apply_cost_t cost;
+} apply_t;
 
 typedef struct bsdiff_request {
   bsdiff_stream_t *stream;
@@ -44,9 +90,11 @@ typedef struct bsdiff_request {
   const uint8_t *new;
   int64_t newsize;
 
-  int64_t *sa;
-  patch_block_t *block;
-  uint8_t *compress_buffer;
+  match_index_t *index;
+  const bsdiff_config_t *config;
+  writer_t *writer;
+  effort_t *effort;
+  apply_t *apply; // NULL unless config->in_place or config->apply_cost
 } bsdiff_request_t;
 
 typedef struct approximate_match {
@@ -64,42 +112,333 @@ static int64_t backward_ext_len(const uint8_t *old, int64_t old_beg,
                                 int64_t old_end, const uint8_t *new,
                                 int64_t new_beg, int64_t new_end);
 
-static am_t approximate_match(const int64_t *sa, const uint8_t *old,
-                              int64_t old_sz, int64_t old_cursor,
-                              const uint8_t *new, int64_t new_sz,
-                              int64_t new_cursor);
+static am_t approximate_match(const match_index_t *index, effort_t *effort,
+                              const uint8_t *old, int64_t old_sz,
+                              int64_t old_cursor, const uint8_t *new,
+                              int64_t new_sz, int64_t new_cursor);
 
-static int bsdiff_internal(const bsdiff_request_t req) {
-  am_t match; // approximate match result
+static int64_t now_us(void) {
+  struct timespec ts;
 
-  int64_t old_cursor, new_cursor;
-  int64_t last_old_cur, last_new_cur;
-  int64_t lenf, lenb;
-  int64_t len_diff, len_extra, len_skip;
+  if (timespec_get(&ts, TIME_UTC) == 0) {
+    return 0;
+  }
+
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t now_ms(void) { return now_us() / 1000; }
+
+static void effort_init(effort_t *effort, const bsdiff_config_t *config) {
+  *effort = effort_levels[MIN(config->effort, BSDIFF_EFFORT_MAX)];
+  if (config->lookahead) {
+    effort->ahead = LOOKAHEAD_MAX;
+  }
+  effort->forward = config->in_place;
+  effort->skip_runs = config->zero_chunks;
+  effort->budget = MAX(config->time_budget, 0);
+  effort->deadline = effort->budget > 0 ? now_ms() + effort->budget : 0;
+  effort->probes = EFFORT_CLOCK_PROBES;
+  effort->stopped = 0;
+  effort->searches = 0;
+}
+
+/* Past the deadline new is searched at the fast level, and past twice the
+ * budget not at all: the rest of new goes out as it lines up with old.
+ */
+static void effort_update(effort_t *effort) {
+  int64_t now;
+
+  if (effort->budget == 0 || effort->stopped) {
+    return;
+  }
+
+  now = now_ms();
+  if (now >= effort->deadline + effort->budget) {
+    effort->stopped = 1;
+  } else if (now >= effort->deadline) {
+    effort->stride = effort_levels[BSDIFF_EFFORT_FAST].stride;
+    effort->mismatch = effort_levels[BSDIFF_EFFORT_FAST].mismatch;
+    effort->ahead = effort_levels[BSDIFF_EFFORT_FAST].ahead;
+    effort->level = effort_levels[BSDIFF_EFFORT_FAST].level;
+  }
+}
+
+// counts a search, and reads the clock every EFFORT_CLOCK_PROBES of them
+static void effort_probe(effort_t *effort) {
+  effort->searches++;
+  if (--effort->probes <= 0) {
+    effort->probes = EFFORT_CLOCK_PROBES;
+    effort_update(effort);
+  }
+}
+
+static void apply_init(apply_t *apply, const bsdiff_config_t *config,
+                       int64_t old_sz, int64_t new_sz) {
+  in_place_init(&apply->image, old_sz, new_sz);
+  apply->page_size = config->page_size > 0 ? config->page_size : 1;
+  apply->last_page = -1;
+  memset(&apply->cost, 0, sizeof(apply->cost));
+  apply->cost.peak = MAX(old_sz, new_sz);
+}
+
+static void count_write(apply_t *apply, int64_t pos, int64_t len) {
+  int64_t first, last;
+
+  if (len <= 0) {
+    return;
+  }
+
+  first = pos / apply->page_size;
+  last = (pos + len - 1) / apply->page_size;
+  apply->cost.pages += last - first + (first != apply->last_page);
+  apply->cost.written += len;
+  apply->last_page = last;
+}
+
+/* Counts what bspatch writes for a block. It writes the diff string a buffer
+ * at a time, and leaves out the buffers that change nothing.
+ */
+static void count_block(apply_t *apply, const uint8_t *new, const uint8_t *old,
+                        int64_t len_diff, int64_t len_extra,
+                        int64_t len_skip) {
+  in_place_t *ip;
+  int64_t i, n, from, shift;
+
+  ip = &apply->image;
+  if (!in_place_readable(ip, len_diff)) {
+    apply->cost.unreadable++;
+  }
+
+  from = ip->old_cursor - ip->lag;
+  for (i = 0; i < len_diff; i += n) {
+    n = MIN(FASTLZ_BUFFER_SIZE, len_diff - i);
+    if (from != ip->new_cursor || memcmp(new + i, old + i, n) != 0) {
+      count_write(apply, ip->new_cursor + i, n);
+    }
+  }
+  in_place_diff(ip, len_diff);
+
+  shift = in_place_room(ip, len_extra);
+  if (shift > 0) {
+    if (!in_place_safe(ip)) {
+      apply->cost.unreadable++;
+    }
+    from = ip->old_cursor - ip->lag;
+    apply->cost.shifts++;
+    apply->cost.shifted += ip->end - from;
+    apply->last_page = -1;
+    count_write(apply, from + shift, ip->end - from);
+    apply->last_page = -1;
+  }
+  count_write(apply, ip->new_cursor, len_extra);
+
+  in_place_extra(ip, len_extra, shift);
+  in_place_skip(ip, len_skip);
+  apply->cost.peak = MAX(apply->cost.peak, ip->end);
+}
+
+// whether bspatch still has old where the block leaves it, see in_place.h
+static int in_place_fits(const apply_t *apply, int64_t len_diff,
+                         int64_t len_extra, int64_t len_skip) {
+  in_place_t ip;
+
+  ip = apply->image;
+  in_place_diff(&ip, len_diff);
+  in_place_extra(&ip, len_extra, in_place_room(&ip, len_extra));
+  in_place_skip(&ip, len_skip);
+
+  return in_place_safe(&ip);
+}
+
+// bytes of old bspatch moves for the extra string of the block
+static int64_t in_place_moved(const apply_t *apply, int64_t len_diff,
+                              int64_t len_extra) {
+  in_place_t ip;
+
+  ip = apply->image;
+  in_place_diff(&ip, len_diff);
+  if (in_place_room(&ip, len_extra) == 0) {
+    return 0;
+  }
+
+  return ip.end - (ip.old_cursor - ip.lag);
+}
+
+/* Counts the filter pass of bspatch over the image, which writes back the
+ * blocks the filter changes.
+ */
+static void count_filter(apply_t *apply, const uint8_t *plain,
+                         const uint8_t *filtered, int64_t len) {
+  int64_t pos, n;
+
+  for (pos = 0; pos < len; pos += n) {
+    n = MIN(BSDIFF_FILTER_BLOCK_SIZE, len - pos);
+    if (memcmp(plain + pos, filtered + pos, n) != 0) {
+      count_write(apply, pos, n);
+    }
+  }
+}
+
+// length of the common prefix, compared a word at a time
+static int64_t common_prefix(const uint8_t *a, const uint8_t *b,
+                             int64_t len) {
+  uint64_t x, y;
   int64_t i;
 
-  uint8_t fastlz_buffer[FASTLZ_BUFFER_SIZE];
+  for (i = 0; i + (int64_t)sizeof(x) <= len; i += sizeof(x)) {
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    if (x != y) {
+      break;
+    }
+  }
 
-  int64_t *buffer;
+  for (; i < len && a[i] == b[i]; i++) {
+  }
 
-  uint64_t out_sz;
-  uint8_t last_block_flag;
+  return i;
+}
 
-  buffer = req.stream->malloc((req.oldsize + 1) * sizeof(int64_t));
-  if (buffer == NULL) {
-    return -1;
+// length of the common suffix of a[0, a_len) and b[0, b_len)
+static int64_t common_suffix(const uint8_t *a, int64_t a_len, const uint8_t *b,
+                             int64_t b_len) {
+  uint64_t x, y;
+  int64_t i, len;
+
+  len = MIN(a_len, b_len);
+  for (i = 0; i + (int64_t)sizeof(x) <= len; i += sizeof(x)) {
+    memcpy(&x, a + a_len - i - sizeof(x), sizeof(x));
+    memcpy(&y, b + b_len - i - sizeof(y), sizeof(y));
+    if (x != y) {
+      break;
+    }
+  }
+
+  for (; i < len && a[a_len - i - 1] == b[b_len - i - 1]; i++) {
+  }
+
+  return i;
+}
+
+// length of the run of data[0] at the start of data, a word at a time
+static int64_t byte_run(const uint8_t *data, int64_t len) {
+  uint64_t x, word;
+  int64_t i;
+
+  if (len == 0) {
+    return 0;
+  }
+
+  memset(&word, data[0], sizeof(word));
+  for (i = 0; i + (int64_t)sizeof(x) <= len; i += sizeof(x)) {
+    memcpy(&x, data + i, sizeof(x));
+    if (x != word) {
+      break;
+    }
+  }
+
+  for (; i < len && data[i] == data[0]; i++) {
+  }
+
+  return i;
+}
+
+/* The data of a block is its diff string, new[i] - old[i] for i < len_diff,
+ * followed by its extra string, new[i] for len_diff <= i < len. None of it is
+ * stored: writer_data has it generated a chunk at a time into its buffer and
+ * compresses it from there.
+ */
+typedef struct block_data {
+  const uint8_t *new;
+  const uint8_t *old;
+  int64_t len_diff;
+  int64_t pos; // of the next byte to fill
+} block_data_t;
+
+static int fill_data(void *opaque, uint8_t *buffer, int64_t len) {
+  block_data_t *data;
+  int64_t i, beg;
+
+  data = (block_data_t *)opaque;
+  beg = data->pos;
+  for (i = beg; i < beg + len && i < data->len_diff; i++) {
+    buffer[i - beg] = data->new[i] - data->old[i];
+  }
+
+  memcpy(buffer + (i - beg), data->new + i, beg + len - i);
+  data->pos += len;
+
+  return 0;
+}
+
+/* Writes one block, its diff string starts at new[0] and old[0] and its extra
+ * string follows the diff string in new. The lengths are known up front, so
+ * the header goes out first and the data is streamed after it.
+ */
+static void write_block(const bsdiff_request_t *req, const uint8_t *new,
+                        const uint8_t *old, int64_t len_diff,
+                        int64_t len_extra, int64_t len_skip) {
+  patch_block_t block;
+  block_data_t data;
+
+  block.len_diff = len_diff;
+  block.len_extra = len_extra;
+  block.len_skip = len_skip;
+
+  if (req->apply != NULL) {
+    count_block(req->apply, new, old, len_diff, len_extra, len_skip);
   }
 
-  qsufsort(req.sa, buffer, req.old, req.oldsize);
-  req.stream->free(buffer);
+  // write block
+  writer_write(req->writer, &block, sizeof(block));
+
+  // compress and write data in block
+  data.new = new;
+  data.old = old;
+  data.len_diff = len_diff;
+  data.pos = 0;
+  writer_data(req->writer, req->config->codec, req->effort->level,
+              req->config->zero_chunks, len_diff + len_extra, fill_data,
+              &data);
+}
+
+/* Under config->in_place, an extra string that makes bspatch move the rest
+ * of old costs more than it saves over diffing it against the old it takes
+ * the place of, at old_pos + lenf.
+ */
+static void diff_extra(const bsdiff_request_t *req, int64_t old_pos,
+                       int64_t *lenf, int64_t *len_extra, int64_t *len_skip) {
+  if (*len_extra > 0 && old_pos + *lenf + *len_extra <= req->oldsize &&
+      *len_extra < in_place_moved(req->apply, *lenf, *len_extra) &&
+      in_place_fits(req->apply, *lenf + *len_extra, 0,
+                    *len_skip - *len_extra)) {
+    *lenf += *len_extra;
+    *len_skip -= *len_extra;
+    *len_extra = 0;
+  }
+}
+
+/* Diffs req.new against req.old, whose index must be built already. On entry
+ * old_pos is the position in old lined up with the start of new, on return
+ * it is where the blocks left old: at old_end, or, when old_end is negative,
+ * lined up with the end of new so that the next piece of new can follow.
+ */
+static int bsdiff_internal(const bsdiff_request_t req, int64_t *old_pos,
+                           int64_t old_end) {
+  am_t match; // approximate match result
+
+  int64_t old_cursor, new_cursor;
+  int64_t last_old_cur, last_new_cur;
+  int64_t lenf, lenb, len_extra, len_skip;
 
   new_cursor = 0;
-  old_cursor = 0;
+  old_cursor = *old_pos;
   last_new_cur = 0;
-  last_old_cur = 0;
+  last_old_cur = *old_pos;
 
   while (new_cursor < req.newsize) {
-    match = approximate_match(req.sa,                           // suffix array
+    match = approximate_match(req.index, req.effort,           // index
                               req.old, req.oldsize, old_cursor, // old
                               req.new, req.newsize, new_cursor  // new
     );
@@ -107,71 +446,489 @@ static int bsdiff_internal(const bsdiff_request_t req) {
     new_cursor = match.new_pos;
     old_cursor = match.old_pos;
 
-    // get lenf
-    lenf = forward_ext_len(req.old, last_old_cur, old_cursor, req.new,
+    /* get lenf, it may run past old_cursor: the match can lie before the
+     * last one in old, or be a stray one at the very end of new
+     */
+    lenf = forward_ext_len(req.old, last_old_cur, req.oldsize, req.new,
                            last_new_cur, new_cursor);
 
     // get lenb
     lenb = backward_ext_len(req.old, last_old_cur + lenf, old_cursor, req.new,
                             last_new_cur + lenf, new_cursor);
 
-    len_diff = lenf;
     len_extra = (new_cursor - lenb) - (last_new_cur + lenf);
     len_skip = (old_cursor - lenb) - (last_old_cur + lenf);
 
-    req.block->len_diff = len_diff;
-    req.block->len_extra = len_extra;
-    req.block->len_skip = len_skip;
+    if (req.apply != NULL && req.config->in_place) {
+      // near the end of new, the match left may lie behind the alignment
+      if (!in_place_fits(req.apply, lenf, len_extra, len_skip)) {
+        old_cursor =
+            MIN(last_old_cur + (new_cursor - last_new_cur), req.oldsize);
+        lenb = 0;
+        len_extra = new_cursor - (last_new_cur + lenf);
+        len_skip = old_cursor - (last_old_cur + lenf);
+      }
 
-    // fill diff
-    for (i = 0; i < len_diff; i++) {
-      req.block->data[i] =
-          req.new[last_new_cur + i] - req.old[last_old_cur + i];
+      diff_extra(&req, last_old_cur, &lenf, &len_extra, &len_skip);
     }
 
-    // fill extra
-    for (i = 0; i < len_extra; i++) {
-      req.block->data[len_diff + i] = req.new[last_new_cur + lenf + i];
+    write_block(&req, req.new + last_new_cur, req.old + last_old_cur, lenf,
+                len_extra, len_skip);
+
+    last_new_cur = new_cursor - lenb;
+    last_old_cur = old_cursor - lenb;
+  }
+
+  if (old_end < 0) {
+    old_end = last_old_cur + (req.newsize - last_new_cur);
+  }
+
+  /* The backward extension of the last match is still to be written, and old
+   * has to be left at old_end for whatever follows.
+   */
+  if (last_new_cur < req.newsize || last_old_cur != old_end) {
+    lenf = forward_ext_len(req.old, last_old_cur, req.oldsize, req.new,
+                           last_new_cur, req.newsize);
+    len_extra = req.newsize - (last_new_cur + lenf);
+    len_skip = old_end - (last_old_cur + lenf);
+    if (req.apply != NULL && req.config->in_place) {
+      diff_extra(&req, last_old_cur, &lenf, &len_extra, &len_skip);
+    }
+    write_block(&req, req.new + last_new_cur, req.old + last_old_cur, lenf,
+                len_extra, len_skip);
+  }
+  *old_pos = old_end;
+
+  return req.writer->err;
+}
+
+void bsdiff_config_init(bsdiff_config_t *config) {
+  config->codec = BSDIFF_CODEC_FASTLZ;
+  config->write_buffer_size = BSDIFF_WRITE_BUFFER_SIZE;
+  config->zero_chunks = 0;
+  config->memory_budget = 0;
+  config->engine = BSDIFF_ENGINE_SUFFIX_ARRAY;
+  config->index_stride = BSDIFF_INDEX_STRIDE;
+  config->lazy_sort = 0;
+  config->search_keys = 0;
+  config->old_sa = NULL;
+  config->effort = BSDIFF_EFFORT_DEFAULT;
+  config->time_budget = 0;
+  config->lookahead = 0;
+  config->in_place = 1;
+  config->page_size = BSDIFF_PAGE_SIZE;
+  config->apply_cost = NULL;
+  config->filter = BSDIFF_FILTER_NONE;
+  config->threads = 1;
+}
+
+/* Old and new as config->filter turns them, in one buffer from
+ * stream->malloc. NULL when it cannot be allocated.
+ */
+static uint8_t *filter_copy(bsdiff_stream_t *stream, uint8_t filter,
+                            const uint8_t *old, int64_t old_sz,
+                            const uint8_t *new, int64_t new_sz) {
+  uint8_t *buffer;
+
+  buffer = stream->malloc(MAX(old_sz + new_sz, 1));
+  if (buffer == NULL) {
+    return NULL;
+  }
+
+  memcpy(buffer, old, old_sz);
+  memcpy(buffer + old_sz, new, new_sz);
+  filter_encode(filter, buffer, old_sz, 0);
+  filter_encode(filter, buffer + old_sz, new_sz, 0);
+
+  return buffer;
+}
+
+/* A coarse index of all of old, for a memory_budget too small to index it
+ * whole: every stride-th position of old by the hash of its 8 bytes, as in
+ * the hash engine, in COARSE_SHARE of the budget. It finds the window of
+ * old the content of a segment of new has moved to.
+ */
+typedef struct coarse {
+  uint32_t *table; // anchors, position / stride
+  int bits;
+  int64_t stride;
+} coarse_t;
+
+static int coarse_build(coarse_t *c, bsdiff_stream_t *stream,
+                        const uint8_t *old, int64_t old_sz, int64_t budget) {
+  uint32_t *slot;
+  int64_t p;
+
+  // about one anchor in two slots, numbered by uint32_t
+  for (c->bits = 1;
+       ((int64_t)sizeof(uint32_t) << (c->bits + 1)) <= budget && c->bits < 32;
+       c->bits++) {
+  }
+  c->stride = MAX(old_sz / ((int64_t)1 << (c->bits - 1)), HASH_INDEX_KEY_LEN);
+
+  c->table = stream->malloc(sizeof(uint32_t) << c->bits);
+  if (c->table == NULL) {
+    return -1;
+  }
+  memset(c->table, 0xff, sizeof(uint32_t) << c->bits);
+
+  for (p = 0; p + HASH_INDEX_KEY_LEN <= old_sz; p += c->stride) {
+    slot = &c->table[hash_index_key(old + p, c->bits)];
+    if (*slot == HASH_INDEX_EMPTY) {
+      *slot = p / c->stride;
     }
+  }
 
-    // write block
-    req.stream->write(req.stream, req.block, sizeof(*req.block));
+  return 0;
+}
+
+/* Start of the window of old that the most bytes of new, matched through the
+ * anchors, lie in, or -1 if none match. votes has two slots for each bucket
+ * of window / COARSE_SPLIT bytes of old, the bytes matched there and the
+ * first position of old they were matched at. Runs of one byte match
+ * anywhere, they do not vote.
+ */
+static int64_t coarse_window(const coarse_t *c, const uint8_t *old,
+                             int64_t old_sz, const uint8_t *new,
+                             int64_t new_sz, int64_t window, int64_t *votes) {
+  int64_t bucket, buckets, q, p, len, sum, best, beg, b;
+  int64_t *first;
+  uint32_t anchor;
 
-    // compress and write data in block
-    for (i = 0; i < len_diff + len_extra; i += FASTLZ_INPUT_SIZE) {
-      out_sz = fastlz_compress_level(2, req.block->data + i, FASTLZ_INPUT_SIZE,
-                                     fastlz_buffer);
-      last_block_flag = 0;
-      if ((i + FASTLZ_INPUT_SIZE) >= (len_diff + len_extra)) {
-        last_block_flag = 1;
+  bucket = MAX(window / COARSE_SPLIT, 1);
+  buckets = (old_sz + bucket - 1) / bucket;
+  first = votes + buckets;
+  memset(votes, 0, buckets * sizeof(int64_t));
+
+  for (q = 0; q + HASH_INDEX_KEY_LEN <= new_sz;) {
+    anchor = c->table[hash_index_key(new + q, c->bits)];
+    if (anchor != HASH_INDEX_EMPTY) {
+      p = anchor * c->stride;
+      len = matchlen(old + p, old_sz - p, new + q, new_sz - q);
+      if (len >= COARSE_MATCH_MIN) {
+        if (byte_run(new + q, len) < len) {
+          b = p / bucket;
+          first[b] = votes[b] == 0 ? p : MIN(first[b], p);
+          votes[b] += len;
+        }
+        q += len;
+        continue;
       }
-      req.stream->write(req.stream, &out_sz, sizeof(out_sz));
-      req.stream->write(req.stream, &last_block_flag, sizeof(last_block_flag));
-      req.stream->write(req.stream, fastlz_buffer, out_sz);
     }
+    q++;
+  }
 
-    last_new_cur = new_cursor - lenb;
-    last_old_cur = old_cursor - lenb;
+  // the window that starts where the best run of buckets is first matched
+  best = 0;
+  beg = -1;
+  sum = 0;
+  for (b = 0; b < buckets; b++) {
+    sum += votes[b];
+    if (b >= COARSE_SPLIT) {
+      sum -= votes[b - COARSE_SPLIT];
+    }
+    if (sum > best) {
+      best = sum;
+      beg = MAX(b + 1 - COARSE_SPLIT, 0);
+    }
+  }
+  if (beg < 0) {
+    return -1;
+  }
+  while (votes[beg] == 0) {
+    beg++;
   }
 
-  return 0;
+  return MIN(first[beg], old_sz - window);
+}
+
+/* Diffs the core of old and new. When old does not fit in one window, new is
+ * cut into segments, and each segment is diffed against the window of old
+ * its matches fall in most, found through a coarse index of all of old, or
+ * else the window around the same relative position. Skip blocks move old
+ * between the windows, back as well as on. In place, old cannot be gone back
+ * to, and the windows follow the relative position.
+ */
+static int bsdiff_core(const bsdiff_request_t *core) {
+  bsdiff_request_t seg;
+  match_index_t index;
+  coarse_t coarse;
+  int64_t budget, window, segments, seg_sz, old_pos, seg_pos, beg, k;
+  int64_t *votes;
+  double center;
+  int ret;
+
+  budget = core->config->memory_budget;
+  window = core->oldsize;
+  coarse.table = NULL;
+  votes = NULL;
+  if (budget > 0 &&
+      match_index_window(core->config, budget) < core->oldsize &&
+      !core->config->in_place) {
+    // the coarse index and its votes come out of the budget
+    if (coarse_build(&coarse, core->stream, core->old, core->oldsize,
+                     budget / COARSE_SHARE) != 0) {
+      return -1;
+    }
+    budget -= sizeof(uint32_t) << coarse.bits;
+    window = match_index_window(core->config, budget);
+    window = MIN(core->oldsize, MAX(window, BSDIFF_WINDOW_MIN));
+    votes = core->stream->malloc(
+        2 * ((core->oldsize + window - 1) / MAX(window / COARSE_SPLIT, 1)) *
+        sizeof(int64_t));
+    if (votes == NULL) {
+      core->stream->free(coarse.table);
+      return -1;
+    }
+  }
+  segments = (core->oldsize + window - 1) / window;
+  /* Placed by content, a segment of half a window can take its window from
+   * wherever it came from, moved pieces are cut across less often.
+   */
+  if (votes != NULL) {
+    segments *= 2;
+  }
+  seg_sz = (core->newsize + segments - 1) / segments;
+
+  seg = *core;
+  seg.index = &index;
+
+  ret = 0;
+  old_pos = 0;
+  for (k = 0; k * seg_sz < core->newsize && ret == 0; k++) {
+    seg.new = core->new + k * seg_sz;
+    seg.newsize = MIN(seg_sz, core->newsize - k * seg_sz);
+
+    beg = -1;
+    if (votes != NULL) {
+      beg = coarse_window(&coarse, core->old, core->oldsize, seg.new,
+                          seg.newsize, window, votes);
+    }
+    if (beg < 0) {
+      // the middle of the segment, scaled to old
+      center = (double)(k * seg_sz + seg.newsize / 2) * core->oldsize /
+               core->newsize;
+      beg = MIN(MAX((int64_t)center - window / 2, 0), core->oldsize - window);
+    }
+    // applied in place, old that is passed cannot be gone back to
+    if (core->config->in_place) {
+      beg = MIN(MAX(beg, old_pos), core->oldsize);
+    }
+    seg.old = core->old + beg;
+    seg.oldsize = MIN(window, core->oldsize - beg);
+
+    if (beg != old_pos) {
+      write_block(core, core->new, core->old, 0, 0, beg - old_pos);
+    }
+
+    old_pos = beg + seg.oldsize;
+
+    /* Out of time, or out of old, the segment goes out as it lines up with
+     * its window.
+     */
+    effort_update(core->effort);
+    if (core->effort->stopped || seg.oldsize == 0) {
+      seg_pos = MIN(seg.newsize, seg.oldsize);
+      write_block(&seg, seg.new, seg.old, seg_pos, seg.newsize - seg_pos,
+                  seg.oldsize - seg_pos);
+      ret = seg.writer->err;
+      continue;
+    }
+
+    seg_pos = 0;
+    ret = match_index_build(&index, seg.stream, seg.config, seg.old,
+                            seg.oldsize, seg.new, seg.newsize);
+    if (ret == 0) {
+      ret = bsdiff_internal(seg, &seg_pos, seg.oldsize);
+      match_index_free(&index, seg.stream);
+    }
+  }
+
+  if (ret == 0 && old_pos != core->oldsize) {
+    write_block(core, core->new, core->old, 0, 0, core->oldsize - old_pos);
+  }
+
+  core->stream->free(votes);
+  core->stream->free(coarse.table);
+
+  return ret;
+}
+
+/* The suffix array of all of old is at hand, so there is nothing to save by
+ * trimming or windowing: new is diffed against the whole of old.
+ */
+static int bsdiff_cached(const bsdiff_request_t *req) {
+  bsdiff_request_t full;
+  match_index_t index;
+  int64_t old_pos;
+
+  match_index_use_sa(&index, req->old, req->oldsize, req->config->old_sa);
+
+  full = *req;
+  full.index = &index;
+  old_pos = 0;
+
+  return bsdiff_internal(full, &old_pos, req->oldsize);
+}
+
+/* Only the differing core of old and new is indexed and searched, the common
+ * prefix and suffix are written as plain diff blocks (all zeros) around it.
+ * When either side of the core is empty, e.g. new only appends to old, there
+ * is nothing to search for and the suffix array is not built at all.
+ */
+static int bsdiff_run(bsdiff_request_t *req) {
+  int ret;
+  int64_t prefix, suffix;
+  bsdiff_request_t core;
+
+  if (req->newsize == 0) {
+    return 0;
+  }
+
+  // the suffix array is of old as it is, not as the filter turns it
+  if (req->config->old_sa != NULL &&
+      req->config->filter == BSDIFF_FILTER_NONE && req->oldsize > 0) {
+    return bsdiff_cached(req);
+  }
+
+  prefix = common_prefix(req->old, req->new, MIN(req->oldsize, req->newsize));
+  suffix = common_suffix(req->old + prefix, req->oldsize - prefix,
+                         req->new + prefix, req->newsize - prefix);
+
+  core = *req;
+  core.old += prefix;
+  core.oldsize -= prefix + suffix;
+  core.new += prefix;
+  core.newsize -= prefix + suffix;
+
+  if (core.oldsize == 0 || core.newsize == 0) {
+    write_block(req, req->new, req->old, prefix, core.newsize, core.oldsize);
+  } else {
+    if (prefix > 0) {
+      write_block(req, req->new, req->old, prefix, 0, 0);
+    }
+
+    ret = bsdiff_core(&core);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  if (suffix > 0) {
+    write_block(req, core.new + core.newsize, core.old + core.oldsize, suffix,
+                0, 0);
+  }
+
+  return req->writer->err;
+}
+
+// rejects what no diff can be made under
+static int config_valid(const bsdiff_config_t *config) {
+  return config->write_buffer_size >= 0 && config->memory_budget >= 0;
+}
+
+static int64_t write_buffer_size(const bsdiff_config_t *config) {
+  // one chunk frame must always fit, and stream->write takes an int
+  if (config->write_buffer_size < (int64_t)CHUNK_FRAME_SIZE) {
+    return CHUNK_FRAME_SIZE;
+  }
+  return MIN(config->write_buffer_size, INT_MAX);
 }
 
 int bsdiff(const uint8_t *old, int64_t old_sz, const uint8_t *new,
            int64_t new_sz, bsdiff_stream_t *stream) {
+  bsdiff_config_t config;
+
+  bsdiff_config_init(&config);
+
+  return bsdiff_ex(old, old_sz, new, new_sz, stream, &config);
+}
+
+int bsdiff_ex(const uint8_t *old, int64_t old_sz, const uint8_t *new,
+              int64_t new_sz, bsdiff_stream_t *stream,
+              const bsdiff_config_t *config) {
   int ret;
-  size_t block_sz;
+  writer_t writer;
+  effort_t effort;
+  apply_t apply;
   bsdiff_request_t req;
+  uint8_t *filtered;
 
-  req.sa = stream->malloc((req.oldsize + 1) * sizeof(int64_t));
-  if (req.sa == NULL) {
+  if (!config_valid(config)) {
     return -1;
   }
 
-  block_sz = 2 * (req.newsize + 1) * sizeof(int64_t);
-  req.block = stream->malloc(block_sz);
-  if (req.block == NULL) {
-    stream->free(req.sa);
+  req.old = old;
+  req.oldsize = old_sz;
+  req.new = new;
+  req.newsize = new_sz;
+  req.stream = stream;
+  req.config = config;
+  req.writer = &writer;
+  req.effort = &effort;
+  req.apply = NULL;
+
+  filtered = NULL;
+  if (config->filter != BSDIFF_FILTER_NONE) {
+    filtered = filter_copy(stream, config->filter, old, old_sz, new, new_sz);
+    if (filtered == NULL) {
+      return -1;
+    }
+    req.old = filtered;
+    req.new = filtered + old_sz;
+  }
+
+  if (writer_init(&writer, stream, write_buffer_size(config), 0) != 0) {
+    stream->free(filtered);
+    return -1;
+  }
+  effort_init(&effort, config);
+  if (config->in_place || config->apply_cost != NULL) {
+    apply_init(&apply, config, old_sz, new_sz);
+    req.apply = &apply;
+    if (filtered != NULL) {
+      count_filter(&apply, old, req.old, old_sz);
+    }
+  }
+
+  ret = bsdiff_run(&req);
+  if (ret == 0) {
+    ret = writer_flush(&writer);
+  }
+  if (ret == 0 && req.apply != NULL && filtered != NULL) {
+    count_filter(&apply, new, req.new, new_sz);
+  }
+  if (ret == 0 && config->apply_cost != NULL) {
+    *config->apply_cost = apply.cost;
+  }
+
+  writer_free(&writer);
+  stream->free(filtered);
+
+  return ret;
+}
+
+int bsdiff_mem(const uint8_t *old, int64_t old_sz, const uint8_t *new,
+               int64_t new_sz, bsdiff_stream_t *stream,
+               const bsdiff_config_t *config, uint8_t **patch,
+               int64_t *patch_sz) {
+  int ret;
+  writer_t writer;
+  effort_t effort;
+  apply_t apply;
+  bsdiff_request_t req;
+  uint8_t *filtered;
+  bsdiff_header_t header = {
+      .signature = BSDIFF_SIGNATURE,
+      .new_sz = new_sz,
+  };
+  bsdiff_header_v2_t header_v2 = {
+      .signature = BSDIFF_SIGNATURE_V2,
+      .new_sz = new_sz,
+      .filter = config->filter,
+  };
+
+  if (!config_valid(config)) {
     return -1;
   }
 
@@ -180,19 +937,691 @@ int bsdiff(const uint8_t *old, int64_t old_sz, const uint8_t *new,
   req.new = new;
   req.newsize = new_sz;
   req.stream = stream;
+  req.config = config;
+  req.writer = &writer;
+  req.effort = &effort;
+  req.apply = NULL;
+
+  filtered = NULL;
+  if (config->filter != BSDIFF_FILTER_NONE) {
+    filtered = filter_copy(stream, config->filter, old, old_sz, new, new_sz);
+    if (filtered == NULL) {
+      return -1;
+    }
+    req.old = filtered;
+    req.new = filtered + old_sz;
+  }
+
+  if (writer_init(&writer, stream, write_buffer_size(config), 1) != 0) {
+    stream->free(filtered);
+    return -1;
+  }
+  effort_init(&effort, config);
+  if (config->in_place || config->apply_cost != NULL) {
+    apply_init(&apply, config, old_sz, new_sz);
+    req.apply = &apply;
+    if (filtered != NULL) {
+      count_filter(&apply, old, req.old, old_sz);
+    }
+  }
+
+  if (filtered != NULL) {
+    ret = writer_write(&writer, &header_v2, sizeof(header_v2));
+  } else {
+    ret = writer_write(&writer, &header, sizeof(header));
+  }
+  if (ret == 0) {
+    ret = bsdiff_run(&req);
+  }
+  if (ret == 0 && req.apply != NULL && filtered != NULL) {
+    count_filter(&apply, new, req.new, new_sz);
+  }
+  if (ret == 0 && config->apply_cost != NULL) {
+    *config->apply_cost = apply.cost;
+  }
+
+  if (ret == 0) {
+    *patch = writer_detach(&writer, patch_sz);
+  }
+
+  writer_free(&writer);
+  stream->free(filtered);
+
+  return ret;
+}
+
+// fills buffer from stream->read, short only at the end of new
+static int64_t read_window(bsdiff_stream_t *stream, uint8_t *buffer,
+                           int64_t size) {
+  int64_t total;
+  int n;
+
+  for (total = 0; total < size; total += n) {
+    n = stream->read(stream, buffer + total, size - total);
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+  }
+
+  return total;
+}
+
+int bsdiff_streaming(const uint8_t *old, int64_t old_sz,
+                     bsdiff_stream_t *stream, const bsdiff_config_t *config,
+                     int64_t *new_sz) {
+  int ret;
+  writer_t writer;
+  effort_t effort;
+  apply_t apply;
+  bsdiff_request_t req;
+  match_index_t index;
+  uint8_t *window, *filtered;
+  int64_t old_pos, n;
+
+  if (!config_valid(config)) {
+    return -1;
+  }
+
+  req.old = old;
+  req.oldsize = old_sz;
+  req.stream = stream;
+  req.config = config;
+  req.writer = &writer;
+  req.effort = &effort;
+  req.apply = NULL;
+  req.index = &index;
+
+  if (writer_init(&writer, stream, write_buffer_size(config), 0) != 0) {
+    return -1;
+  }
+  effort_init(&effort, config);
+  /* The size of new is not known, so old is followed as if bspatch moved it
+   * no further than it has to. It only gets further ahead of that.
+   */
+  if (config->in_place) {
+    apply_init(&apply, config, old_sz, 0);
+    req.apply = &apply;
+  }
+
+  window = stream->malloc(BSDIFF_NEW_WINDOW);
+  if (window == NULL) {
+    writer_free(&writer);
+    return -1;
+  }
+
+  // each window of new is filtered as it is read, it starts on a block
+  filtered = NULL;
+  if (config->filter != BSDIFF_FILTER_NONE) {
+    filtered = filter_copy(stream, config->filter, old, old_sz, NULL, 0);
+    if (filtered == NULL) {
+      stream->free(window);
+      writer_free(&writer);
+      return -1;
+    }
+    old = filtered;
+    req.old = filtered;
+  }
+
+  // new is not known up front, so the index cannot be lazy
+  if (config->old_sa != NULL && filtered == NULL) {
+    match_index_use_sa(&index, old, old_sz, config->old_sa);
+    ret = 0;
+  } else {
+    ret = match_index_build(&index, stream, config, old, old_sz, NULL, 0);
+  }
+
+  /* Old is carried over from one window to the next, so a window goes on
+   * where the previous one left off. Only matches that straddle the edge of
+   * a window are cut in two.
+   */
+  *new_sz = 0;
+  old_pos = 0;
+  while (ret == 0 && (n = read_window(stream, window, BSDIFF_NEW_WINDOW)) > 0) {
+    req.new = window;
+    req.newsize = n;
+    if (filtered != NULL) {
+      filter_encode(config->filter, window, n, *new_sz);
+    }
+    if (old_sz == 0) {
+      write_block(&req, window, old, 0, n, 0);
+    } else {
+      ret = bsdiff_internal(req, &old_pos, -1);
+    }
+    *new_sz += n;
+  }
+
+  if (ret == 0 && n < 0) {
+    ret = -1;
+  }
+  if (ret == 0) {
+    ret = writer_flush(&writer);
+  }
+
+  match_index_free(&index, stream);
+  stream->free(window);
+  stream->free(filtered);
+  writer_free(&writer);
+
+  return ret;
+}
+
+/* The new files of bsdiff_bundle and the threads that share them out, each
+ * takes the next file that is left.
+ */
+typedef struct bundle {
+  bsdiff_stream_t *stream;
+  bsdiff_config_t config;
+  const uint8_t *old;
+  int64_t old_sz;
+  match_index_t *index;
+
+  const uint8_t *const *new;
+  const int64_t *new_sz;
+  int64_t count;
+  uint8_t **patch;
+  int64_t *patch_sz;
+
+  pthread_mutex_t lock;
+  int64_t next; // the next file to take
+  int err;
+} bundle_t;
+
+// the whole patch of new file i, header included, against all of old
+static int bundle_file(bundle_t *bundle, int64_t i) {
+  int ret;
+  writer_t writer;
+  effort_t effort;
+  bsdiff_request_t req;
+  int64_t old_pos;
+  bsdiff_header_t header = {
+      .signature = BSDIFF_SIGNATURE,
+      .new_sz = bundle->new_sz[i],
+  };
+
+  req.old = bundle->old;
+  req.oldsize = bundle->old_sz;
+  req.new = bundle->new[i];
+  req.newsize = bundle->new_sz[i];
+  req.stream = bundle->stream;
+  req.config = &bundle->config;
+  req.writer = &writer;
+  req.effort = &effort;
+  req.apply = NULL;
+  req.index = bundle->index;
+
+  if (writer_init(&writer, bundle->stream, write_buffer_size(&bundle->config),
+                  1) != 0) {
+    return -1;
+  }
+  effort_init(&effort, &bundle->config);
+
+  old_pos = 0;
+  ret = writer_write(&writer, &header, sizeof(header));
+  if (ret == 0 && req.newsize > 0) {
+    if (req.oldsize == 0) {
+      write_block(&req, req.new, req.old, 0, req.newsize, 0);
+      ret = writer.err;
+    } else {
+      ret = bsdiff_internal(req, &old_pos, -1);
+    }
+  }
+
+  if (ret == 0) {
+    bundle->patch[i] = writer_detach(&writer, &bundle->patch_sz[i]);
+  }
+  writer_free(&writer);
+
+  return ret;
+}
+
+static void *bundle_worker(void *arg) {
+  bundle_t *bundle;
+  int64_t i;
+  int ret;
+
+  bundle = (bundle_t *)arg;
+  for (;;) {
+    pthread_mutex_lock(&bundle->lock);
+    i = bundle->err == 0 ? bundle->next++ : bundle->count;
+    pthread_mutex_unlock(&bundle->lock);
+    if (i >= bundle->count) {
+      return NULL;
+    }
+
+    ret = bundle_file(bundle, i);
+    if (ret != 0) {
+      pthread_mutex_lock(&bundle->lock);
+      bundle->err = ret;
+      pthread_mutex_unlock(&bundle->lock);
+    }
+  }
+}
+
+int bsdiff_bundle(const uint8_t *old, int64_t old_sz,
+                  const uint8_t *const *new, const int64_t *new_sz,
+                  int64_t count, bsdiff_stream_t *stream,
+                  const bsdiff_config_t *config, uint8_t **patch,
+                  int64_t *patch_sz) {
+  pthread_t threads[BSDIFF_THREADS_MAX];
+  match_index_t index;
+  bundle_t bundle;
+  int64_t i, n;
+  int ret;
+
+  for (i = 0; i < count; i++) {
+    patch[i] = NULL;
+    patch_sz[i] = 0;
+  }
+  if (!config_valid(config)) {
+    return -1;
+  }
+
+  // every file is patched from old as a whole, and not in place
+  bundle.stream = stream;
+  bundle.config = *config;
+  bundle.config.in_place = 0;
+  bundle.config.filter = BSDIFF_FILTER_NONE;
+  bundle.old = old;
+  bundle.old_sz = old_sz;
+  bundle.index = &index;
+  bundle.new = new;
+  bundle.new_sz = new_sz;
+  bundle.count = count;
+  bundle.patch = patch;
+  bundle.patch_sz = patch_sz;
+  bundle.next = 0;
+  bundle.err = 0;
+
+  if (config->old_sa != NULL) {
+    match_index_use_sa(&index, old, old_sz, config->old_sa);
+  } else if (match_index_build(&index, stream, &bundle.config, old, old_sz,
+                               NULL, 0) != 0) {
+    return -1;
+  }
+  if (pthread_mutex_init(&bundle.lock, NULL) != 0) {
+    match_index_free(&index, stream);
+    return -1;
+  }
+
+  // the calling thread is one of them, fewer are started if the system says
+  n = MIN(MAX(config->threads, 1), MIN(count, BSDIFF_THREADS_MAX));
+  for (i = 1; i < n; i++) {
+    if (pthread_create(&threads[i], NULL, bundle_worker, &bundle) != 0) {
+      break;
+    }
+  }
+  n = i;
+  bundle_worker(&bundle);
+  for (i = 1; i < n; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  ret = bundle.err;
+
+  if (ret != 0) {
+    for (i = 0; i < count; i++) {
+      stream->free(patch[i]);
+      patch[i] = NULL;
+    }
+  }
+
+  pthread_mutex_destroy(&bundle.lock);
+  match_index_free(&index, stream);
+
+  return ret;
+}
+
+// stream->write of bsdiff_estimate, only the size of the patch is kept
+static int estimate_write(bsdiff_stream_t *stream, const void *buffer,
+                          int size) {
+  (void)buffer;
+  *(int64_t *)stream->opaque += size;
+
+  return 0;
+}
+
+// bits of n, rounded up, as deep as a sorted search of n goes
+static int bits_of(int64_t n) {
+  int bits = 1;
+
+  while (bits < 63 && ((int64_t)1 << bits) < n) {
+    bits++;
+  }
+  return bits;
+}
+
+// microseconds the index takes per search, over searches spread across new
+static double search_cost(const match_index_t *index, const uint8_t *new,
+                          int64_t new_sz) {
+  int64_t i, p, pos, t;
+
+  t = now_us();
+  for (i = 0; i < ESTIMATE_PROBES; i++) {
+    p = (int64_t)((double)new_sz * i / ESTIMATE_PROBES);
+    match_index_search(index, new + p, MIN(new_sz - p, ESTIMATE_PROBE), &pos);
+  }
+
+  return (double)(now_us() - t) / ESTIMATE_PROBES;
+}
+
+// bytes of patch the diff data of len common bytes at new and old takes
+static int64_t zero_data(const bsdiff_request_t *req, const uint8_t *new,
+                         const uint8_t *old, int64_t len) {
+  int64_t *written, before;
+
+  if (len == 0) {
+    return 0;
+  }
+
+  written = (int64_t *)req->writer->stream->opaque;
+  writer_flush(req->writer);
+  before = *written;
+  write_block(req, new, old, len, 0, 0);
+  writer_flush(req->writer);
+  len = *written - before - sizeof(patch_block_t);
+  *written = before;
+
+  return len;
+}
+
+/* Bytes of patch the diff block of zeros for len common bytes at new and old
+ * takes, counted from one chunk of them and the partial one at the end: a
+ * zero chunk covers them all.
+ */
+static int64_t zero_blocks(const bsdiff_request_t *req, const uint8_t *new,
+                           const uint8_t *old, int64_t len) {
+  int64_t full, rest;
+
+  if (len == 0) {
+    return 0;
+  }
+  if (req->config->zero_chunks) {
+    return sizeof(patch_block_t) +
+           zero_data(req, new, old, MIN(len, FASTLZ_INPUT_SIZE));
+  }
+
+  full = len / FASTLZ_INPUT_SIZE;
+  rest = len % FASTLZ_INPUT_SIZE;
+  return sizeof(patch_block_t) +
+         full * zero_data(req, new, old, MIN(len, FASTLZ_INPUT_SIZE)) +
+         zero_data(req, new + len - rest, old + len - rest, rest);
+}
+
+/* A hash index of the whole core of old is built, in linear time, and
+ * ESTIMATE_WINDOWS windows spread over the core of new are diffed against
+ * it, the patch only counted. The suffix array engines find somewhat longer
+ * matches, so the estimate runs a little high for them, and their time is
+ * scaled up from the index of config->engine built for a slice of old.
+ */
+int bsdiff_estimate(const uint8_t *old, int64_t old_sz, const uint8_t *new,
+                    int64_t new_sz, bsdiff_stream_t *stream,
+                    const bsdiff_config_t *config,
+                    bsdiff_estimate_t *estimate) {
+  bsdiff_config_t sample;
+  bsdiff_stream_t counter;
+  bsdiff_request_t req;
+  match_index_t index, slice;
+  writer_t writer;
+  effort_t effort;
+  int64_t prefix, suffix, written, windows, window, k, pos, old_pos;
+  int64_t slice_sz, t, index_us;
+  double diff_us, hash_cost, searched, depth, scale;
+  int ret;
+
+  estimate->patch_sz = sizeof(bsdiff_header_t);
+  estimate->diff_ms = 0;
+  if (!config_valid(config)) {
+    return -1;
+  }
+  if (new_sz == 0) {
+    return 0;
+  }
+
+  // a hash index of old, with the stride config gives the hash engine
+  sample = *config;
+  if (sample.engine != BSDIFF_ENGINE_HASH) {
+    sample.engine = BSDIFF_ENGINE_HASH;
+    sample.index_stride = BSDIFF_INDEX_STRIDE;
+  }
+  sample.memory_budget = 0;
+  sample.old_sa = NULL;
+  sample.time_budget = 0;
+  sample.in_place = 0;
+  sample.apply_cost = NULL;
+  sample.filter = BSDIFF_FILTER_NONE;
+
+  written = 0;
+  counter = *stream;
+  counter.write = estimate_write;
+  counter.opaque = &written;
+  if (writer_init(&writer, &counter, write_buffer_size(config), 0) != 0) {
+    return -1;
+  }
+  effort_init(&effort, &sample);
+
+  req.stream = stream;
+  req.index = &index;
+  req.config = &sample;
+  req.writer = &writer;
+  req.effort = &effort;
+  req.apply = NULL;
 
-  ret = bsdiff_internal(req);
+  // the common prefix and suffix are not searched, see bsdiff_run
+  prefix = common_prefix(old, new, MIN(old_sz, new_sz));
+  suffix = common_suffix(old + prefix, old_sz - prefix, new + prefix,
+                         new_sz - prefix);
+  estimate->patch_sz += zero_blocks(&req, new, old, prefix);
+  estimate->patch_sz += zero_blocks(&req, new + new_sz - suffix,
+                                    old + old_sz - suffix, suffix);
+  req.old = old + prefix;
+  req.oldsize = old_sz - prefix - suffix;
+  new += prefix;
+  new_sz -= prefix + suffix;
+  if (new_sz == 0) {
+    writer_free(&writer);
+    return 0;
+  }
+
+  windows = new_sz <= ESTIMATE_WINDOWS * ESTIMATE_WINDOW ? 1 : ESTIMATE_WINDOWS;
+  window = windows == 1 ? new_sz : ESTIMATE_WINDOW;
 
-  stream->free(req.sa);
-  stream->free(req.block);
+  t = now_us();
+  if (req.oldsize > 0 && match_index_build(&index, stream, &sample, req.old,
+                                           req.oldsize, NULL, 0) != 0) {
+    writer_free(&writer);
+    return -1;
+  }
+  index_us = now_us() - t;
+
+  ret = 0;
+  t = now_us();
+  for (k = 0; k < windows && ret == 0; k++) {
+    pos = windows == 1 ? 0 : (new_sz - window) * k / (windows - 1);
+    req.new = new + pos;
+    req.newsize = window;
+
+    // nothing to search, the core of new is extra
+    if (req.oldsize == 0) {
+      write_block(&req, req.new, req.old, 0, window, 0);
+      continue;
+    }
+
+    // old lined up with the window as the whole of new is
+    old_pos = (int64_t)((double)pos * req.oldsize / new_sz);
+    ret = bsdiff_internal(req, &old_pos, -1);
+  }
+  diff_us = now_us() - t;
+
+  if (ret == 0) {
+    ret = writer_flush(&writer);
+  }
+  writer_free(&writer);
+
+  // each window ends in a block the whole of new would run on through
+  written = MAX(written - (windows - 1) * (int64_t)sizeof(patch_block_t), 0);
+  scale = (double)new_sz / (windows * window);
+  estimate->patch_sz += (int64_t)(written * scale);
+  estimate->diff_ms = (int64_t)(diff_us * scale) / 1000;
+
+  if (req.oldsize == 0) {
+    return ret;
+  }
+  if (ret != 0) {
+    match_index_free(&index, stream);
+    return ret;
+  }
+
+  /* Of the time the windows took, what their searches took goes by what the
+   * index of config->engine takes per search instead, timed on a slice of
+   * old. Past the caches, each level deeper into a suffix array misses them
+   * again, so the slice is scaled up by its depth twice over, which is what
+   * sorting and searching larger images measure.
+   */
+  hash_cost = search_cost(&index, new, new_sz);
+  match_index_free(&index, stream);
+  searched = MIN(diff_us, effort.searches * hash_cost);
+  if (config->engine != BSDIFF_ENGINE_HASH) {
+    slice_sz = MIN(req.oldsize, ESTIMATE_SLICE);
+    sample = *config;
+    sample.memory_budget = 0;
+    sample.lazy_sort = 0;
+    sample.old_sa = NULL;
+
+    t = now_us();
+    ret = match_index_build(&slice, stream, &sample,
+                            req.old + (req.oldsize - slice_sz) / 2, slice_sz,
+                            NULL, 0);
+    t = now_us() - t;
+    if (ret != 0) {
+      return ret;
+    }
+    depth = (double)bits_of(req.oldsize) / bits_of(slice_sz);
+    depth *= depth;
+    index_us = config->old_sa != NULL
+                   ? 0
+                   : (int64_t)(t * depth * req.oldsize / slice_sz);
+    diff_us += searched * (search_cost(&slice, new, new_sz) * depth /
+                               MAX(hash_cost, 0.001) -
+                           1);
+    match_index_free(&slice, stream);
+  }
+
+  estimate->diff_ms = (index_us + (int64_t)(diff_us * scale)) / 1000;
 
   return ret;
 }
 
-static am_t approximate_match(const int64_t *sa, const uint8_t *old,
-                              int64_t old_sz, int64_t old_cursor,
-                              const uint8_t *new, int64_t new_sz,
-                              int64_t new_cursor) {
+/* Whether the len bytes of new at new_cursor, which match old exactly
+ * somewhere, gain more than effort->mismatch bytes over the alignment offset.
+ */
+static int beats_alignment(const effort_t *effort, const uint8_t *old,
+                           int64_t old_sz, int64_t offset, const uint8_t *new,
+                           int64_t new_cursor, int64_t len) {
+  int64_t i, gain;
+
+  gain = 0;
+  for (i = new_cursor; i < new_cursor + len; i++) {
+    if (i + offset >= old_sz || old[i + offset] != new[i]) {
+      if (++gain > effort->mismatch) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* bytes of new[beg, end) old gets wrong in the alignment offset, counted up
+ * to BLOCK_COST
+ */
+static int64_t misses(const uint8_t *old, int64_t old_sz, int64_t offset,
+                      const uint8_t *new, int64_t beg, int64_t end) {
+  int64_t i, n;
+
+  n = 0;
+  for (i = beg; i < end && n < BLOCK_COST; i++) {
+    if (i + offset >= old_sz || old[i + offset] != new[i]) {
+      n++;
+    }
+  }
+
+  return n;
+}
+
+/* The greedy choice takes the first match that beats the current alignment,
+ * even when one a few bytes on runs much further and it leaves a block
+ * behind just to reach that one. Instead, the next effort->ahead positions of
+ * new are searched too, and each match that beats the alignment is a way to
+ * go on. Up to where the furthest of them ends, a way costs the bytes of new
+ * its alignments get wrong, about a byte each in the diff string: before it
+ * the current alignment, from it on its own, but no more than the block it
+ * would take to switch. The cheapest way is taken, the earliest of equals.
+ */
+static void look_ahead(const match_index_t *index, effort_t *effort,
+                       const uint8_t *old, int64_t old_sz, int64_t offset,
+                       int64_t old_floor, const uint8_t *new, int64_t new_sz,
+                       int64_t len, int64_t *new_cursor, int64_t *pos) {
+  int64_t cand_new[LOOKAHEAD_MAX + 1];
+  int64_t cand_old[LOOKAHEAD_MAX + 1];
+  int64_t cand_end[LOOKAHEAD_MAX + 1];
+  int64_t cand_cost[LOOKAHEAD_MAX + 1];
+  int64_t n, i, j, k, cursor, missed, end, best;
+
+  cand_new[0] = *new_cursor;
+  cand_old[0] = *pos;
+  cand_end[0] = *new_cursor + len;
+  cand_cost[0] = 0;
+  end = cand_end[0];
+  n = 1;
+
+  cursor = *new_cursor;
+  missed = 0;
+  for (j = 0; j < MIN(effort->ahead, LOOKAHEAD_MAX); j++) {
+    for (k = 0; k < effort->stride && cursor < new_sz; k++, cursor++) {
+      if (cursor + offset >= old_sz || old[cursor + offset] != new[cursor]) {
+        missed++;
+      }
+    }
+    if (cursor >= new_sz || missed >= BLOCK_COST) {
+      break;
+    }
+
+    effort_probe(effort);
+    len = match_index_search(index, new + cursor, new_sz - cursor,
+                             &cand_old[n]);
+    // the same diagonal as the first match is only its tail
+    if (len == 0 || cand_old[n] - cursor == *pos - *new_cursor ||
+        cand_old[n] < old_floor ||
+        !beats_alignment(effort, old, old_sz, offset, new, cursor, len)) {
+      continue;
+    }
+
+    cand_new[n] = cursor;
+    cand_end[n] = cursor + len;
+    cand_cost[n] = missed;
+    end = MAX(end, cand_end[n]);
+    n++;
+  }
+
+  best = 0;
+  for (i = 0; i < n; i++) {
+    cand_cost[i] +=
+        misses(old, old_sz, cand_old[i] - cand_new[i], new, cand_end[i], end);
+    if (cand_cost[i] < cand_cost[best]) {
+      best = i;
+    }
+  }
+
+  *new_cursor = cand_new[best];
+  *pos = cand_old[best];
+}
+
+static am_t approximate_match(const match_index_t *index, effort_t *effort,
+                              const uint8_t *old, int64_t old_sz,
+                              int64_t old_cursor, const uint8_t *new,
+                              int64_t new_sz, int64_t new_cursor) {
   am_t match;
 
   int64_t len;       // length of exact match
@@ -200,18 +1629,52 @@ static am_t approximate_match(const int64_t *sa, const uint8_t *old,
   int64_t match_cnt; // the matched bytes in a approximate match
   int64_t tmp;
   int64_t offset;
+  int64_t old_floor; // matches before it are passed over
+  int64_t run;
+  int64_t k;
+
+  /* Applied in place, the old before old_cursor has been written over with
+   * new by the time a match there would be read.
+   */
+  old_floor = effort->forward ? old_cursor : 0;
 
   match_cnt = 0;
   offset = old_cursor - new_cursor;
   tmp = new_cursor;
   while (new_cursor < new_sz) {
-    len = bsearch(           // search a exact match region
-        sa,                  // suffix array
-        old, old_sz,         // old data and length
-        new + new_cursor,    // new data
-        new_sz - new_cursor, // new length,
-        0, old_sz, &pos      // begin, end, pos(output)
+    /* A long run of one byte, the 0x00 or 0xff padding of an image, matches
+     * equally well all over old, and stepping through it a byte at a time is
+     * quadratic. Jump over it, the diff or extra string around it takes the
+     * run. Only with zero chunks, which image diffs turn on, so that plain
+     * diffs match as they always have.
+     */
+    run = effort->skip_runs ? byte_run(new + new_cursor, new_sz - new_cursor)
+                            : 0;
+    if (run >= RUN_SKIP) {
+      new_cursor += run;
+      pos = MIN(new_cursor + offset, old_sz);
+      tmp = new_cursor;
+      match_cnt = 0;
+      continue;
+    }
+
+    effort_probe(effort);
+    if (effort->stopped) {
+      new_cursor = new_sz;
+      pos = MIN(new_cursor + offset, old_sz);
+      break;
+    }
+
+    len = match_index_search( // search a exact match region
+        index,                // index of old
+        new + new_cursor,     // new data
+        new_sz - new_cursor,  // new length,
+        &pos                  // pos(output)
     );
+    if (pos < old_floor) {
+      pos = MIN(new_cursor + offset, old_sz);
+      len = 0;
+    }
 
     /* We already know the result in range [tmp, new_cursor + len]. The tmp is
      * initialized as new_cursor. We don't reset the match_cnt and tmp in every
@@ -245,21 +1708,31 @@ static am_t approximate_match(const int64_t *sa, const uint8_t *old,
      */
     if (len != 0 && len == match_cnt) {
       new_cursor += len;
+      pos += len; // still lined up with new_cursor if the loop ends here
       tmp = new_cursor;
       match_cnt = 0;
       continue;
     }
 
-    if (len - match_cnt > 8) {
+    if (len - match_cnt > effort->mismatch) {
+      if (effort->ahead > 0) {
+        look_ahead(index, effort, old, old_sz, offset, old_floor, new, new_sz,
+                   len, &new_cursor, &pos);
+      }
       break;
     }
 
-    if ((new_cursor + offset < old_sz) &&
-        (old[new_cursor + offset] == new[new_cursor])) {
-      match_cnt--;
+    /* Below the default effort the next search is a few bytes on, the bytes
+     * stepped over leave the count of the current alignment as they go.
+     */
+    for (k = 0; k < effort->stride && new_cursor < new_sz; k++) {
+      if ((new_cursor < tmp) && (new_cursor + offset < old_sz) &&
+          (old[new_cursor + offset] == new[new_cursor])) {
+        match_cnt--;
+      }
+      new_cursor++;
     }
-
-    new_cursor++;
+    tmp = MAX(tmp, new_cursor);
   } // while (new_cursor < new_sz)
 
   match.new_pos = new_cursor;
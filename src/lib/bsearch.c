@@ -31,42 +31,154 @@
 #include "bsearch.h"
 #include "helper.h"
 
-static int64_t matchlen(const uint8_t *old, int64_t old_sz, const uint8_t *new,
-                        int64_t new_sz) {
+// compared a word at a time
+int64_t matchlen(const uint8_t *old, int64_t old_sz, const uint8_t *new,
+                 int64_t new_sz) {
+  uint64_t x, y;
   int64_t i, min;
   min = MIN(old_sz, new_sz);
 
-  for (i = 0; i < min; i++) {
-    if (old[i] != new[i]) {
+  for (i = 0; i + (int64_t)sizeof(x) <= min; i += sizeof(x)) {
+    memcpy(&x, old + i, sizeof(x));
+    memcpy(&y, new + i, sizeof(y));
+    if (x != y) {
       break;
     }
   }
 
+  for (; i < min && old[i] == new[i]; i++) {
+  }
+
   return i;
 }
 
+/* Every suffix between I[beg] and I[end] shares with new at least the shorter
+ * of the two bounds' common prefixes, so a probe starts comparing past it.
+ * Without that, each probe into a long run of one byte compares the whole run
+ * again.
+ */
 int64_t bsearch(const int64_t *I, const uint8_t *old, int64_t old_sz,
                 const uint8_t *new, int64_t new_sz, int64_t beg, int64_t end,
                 int64_t *pos) {
-  int64_t x, y;
+  int64_t x, y, lo, hi, skip, len;
+
+  lo = 0; // common prefix of new and the suffix at I[beg], if known
+  hi = 0; // and at I[end]
+  while (end - beg >= 2) {
+    x = beg + (end - beg) / 2;
+    skip = MIN(lo, hi);
+    len = MIN(old_sz - I[x], new_sz);
+    y = skip + matchlen(old + I[x] + skip, old_sz - I[x] - skip, new + skip,
+                        new_sz - skip);
+    if (y < len && old[I[x] + y] < new[y]) {
+      beg = x;
+      lo = y;
+    } else {
+      end = x;
+      hi = y;
+    }
+  }
+
+  x = lo + matchlen(old + I[beg] + lo, old_sz - I[beg] - lo, new + lo,
+                    new_sz - lo);
+  y = hi + matchlen(old + I[end] + hi, old_sz - I[end] - hi, new + hi,
+                    new_sz - hi);
+
+  if (x > y) {
+    *pos = I[beg];
+    return x;
+  } else {
+    *pos = I[end];
+    return y;
+  }
+}
+
+static uint64_t suffix_key(const uint8_t *p, int64_t len) {
+  uint64_t key;
+  int64_t i;
+
+  key = 0;
+  for (i = 0; i < SA_ENTRY_KEY_LEN; i++) {
+    key = key << 8 | (i < len ? p[i] : 0);
+  }
+
+  return key;
+}
 
-  if (end - beg < 2) {
-    x = matchlen(old + I[beg], old_sz - I[beg], new, new_sz);
-    y = matchlen(old + I[end], old_sz - I[end], new, new_sz);
+sa_entry_t *sa_entries(int64_t *sa, int64_t n, const uint8_t *old,
+                       int64_t old_sz) {
+  sa_entry_t *entries;
+  int64_t i, pos;
 
-    if (x > y) {
-      *pos = I[beg];
-      return x;
+  /* Entry i overwrites sa[2i] and sa[2i + 1]. Filled from the end, no
+   * position is overwritten before it is read.
+   */
+  entries = (sa_entry_t *)sa;
+  for (i = n - 1; i >= 0; i--) {
+    pos = sa[i];
+    entries[i].pos = pos;
+    entries[i].key = suffix_key(old + pos, old_sz - pos);
+  }
+
+  return entries;
+}
+
+// number of leading zero bytes of x
+static int64_t zero_bytes(uint64_t x) {
+  int64_t i;
+
+  for (i = 0; i < SA_ENTRY_KEY_LEN && (x >> 56) == 0; i++) {
+    x <<= 8;
+  }
+
+  return i;
+}
+
+int64_t bsearch_entries(const sa_entry_t *sa, const uint8_t *old,
+                        int64_t old_sz, const uint8_t *new, int64_t new_sz,
+                        int64_t beg, int64_t end, int64_t *pos) {
+  uint64_t key;
+  int64_t x, y, lo, hi, skip, len, p;
+  int less;
+
+  key = suffix_key(new, new_sz);
+  lo = 0;
+  hi = 0;
+  while (end - beg >= 2) {
+    x = beg + (end - beg) / 2;
+    p = sa[x].pos;
+    len = MIN(old_sz - p, new_sz);
+
+    // the keys agree on y bytes, which only count up to the shorter end
+    y = zero_bytes(sa[x].key ^ key);
+    if (y < MIN(len, SA_ENTRY_KEY_LEN)) {
+      less = sa[x].key < key;
     } else {
-      *pos = I[end];
-      return y;
+      skip = MAX(MIN(lo, hi), MIN(y, len));
+      y = skip + matchlen(old + p + skip, old_sz - p - skip, new + skip,
+                          new_sz - skip);
+      less = y < len && old[p + y] < new[y];
+    }
+
+    if (less) {
+      beg = x;
+      lo = y;
+    } else {
+      end = x;
+      hi = y;
     }
   }
 
-  x = beg + (end - beg) / 2;
-  if (memcmp(old + I[x], new, MIN(old_sz - I[x], new_sz)) < 0) {
-    return bsearch(I, old, old_sz, new, new_sz, x, end, pos);
+  x = lo + matchlen(old + sa[beg].pos + lo, old_sz - sa[beg].pos - lo,
+                    new + lo, new_sz - lo);
+  y = hi + matchlen(old + sa[end].pos + hi, old_sz - sa[end].pos - hi,
+                    new + hi, new_sz - hi);
+
+  if (x > y) {
+    *pos = sa[beg].pos;
+    return x;
   } else {
-    return bsearch(I, old, old_sz, new, new_sz, beg, x, pos);
+    *pos = sa[end].pos;
+    return y;
   }
 }
@@ -31,8 +31,35 @@
 
 #include <stdint.h>
 
+// length of the common prefix of old and new
+int64_t matchlen(const uint8_t *old, int64_t old_sz, const uint8_t *new,
+                 int64_t new_sz);
+
 int64_t bsearch(const int64_t *I, const uint8_t *old, int64_t old_sz,
                 const uint8_t *new, int64_t new_sz, int64_t beg, int64_t end,
                 int64_t *pos);
 
+/* An entry of a suffix array laid out for searching: the first
+ * SA_ENTRY_KEY_LEN bytes of the suffix, big-endian and padded with zeros,
+ * beside its position. Most probes are decided by the key alone, without a
+ * second cache miss in old.
+ */
+#define SA_ENTRY_KEY_LEN 8
+
+typedef struct sa_entry {
+  uint64_t key;
+  int64_t pos;
+} sa_entry_t;
+
+/* Turns the n positions at the start of sa into n sa_entry_t in place, so sa
+ * has to have room for 2 * n int64_t.
+ */
+sa_entry_t *sa_entries(int64_t *sa, int64_t n, const uint8_t *old,
+                       int64_t old_sz);
+
+// bsearch over a suffix array of sa_entry_t
+int64_t bsearch_entries(const sa_entry_t *sa, const uint8_t *old,
+                        int64_t old_sz, const uint8_t *new, int64_t new_sz,
+                        int64_t beg, int64_t end, int64_t *pos);
+
 #endif // _BSDIFF_BSEARCH_H_
\ No newline at end of file
@@ -32,7 +32,10 @@
 #include <bsdiff/bspatch.h>
 #include <fastlz.h>
 
+#include "filter.h"
 #include "helper.h"
+#include "in_place.h"
+#include "rans.h"
 
 typedef struct {
   uint8_t compressed[FASTLZ_BUFFER_SIZE];
@@ -44,7 +47,9 @@ typedef struct {
   const bsdiff_stream_t *patch;
 
   size_t cursor;
-} __attribute__((packed)) fastlz_ctx_t;
+
+  rans_table_t rans_table;
+} fastlz_ctx_t;
 
 static void fastlz_ctx_init(fastlz_ctx_t *ctx, const bsdiff_stream_t *patch) {
   ctx->compressed_size = 0;
@@ -54,8 +59,9 @@ static void fastlz_ctx_init(fastlz_ctx_t *ctx, const bsdiff_stream_t *patch) {
   ctx->patch = patch;
 }
 
-static int fastlz_ctx_next(fastlz_ctx_t *ctx) {
-  if (ctx->last_block_flag) {
+// reads the next chunk of the block, its payload is left compressed
+static int fastlz_ctx_frame(fastlz_ctx_t *ctx) {
+  if (ctx->last_block_flag & PATCH_CHUNK_FLAG_LAST) {
     return BSPATCH_DECOMPRESS_ERR;
   }
 
@@ -71,23 +77,67 @@ static int fastlz_ctx_next(fastlz_ctx_t *ctx) {
     return BSPATCH_READ_PATCH_ERR;
   }
 
+  // a zero chunk has no payload, its size is the length of the run
+  if (PATCH_CHUNK_CODEC(ctx->last_block_flag) == BSDIFF_CODEC_ZERO) {
+    if (ctx->compressed_size == 0) {
+      return BSPATCH_DECOMPRESS_ERR;
+    }
+    ctx->decompressed_size = ctx->compressed_size;
+    ctx->cursor = 0;
+    return BSPATCH_SUCCESS;
+  }
+
+  if (ctx->compressed_size > FASTLZ_BUFFER_SIZE) {
+    return BSPATCH_SANITY_CHECK_ERR;
+  }
+
   if (ctx->patch->read(ctx->patch, &ctx->compressed, ctx->compressed_size) !=
       ctx->compressed_size) {
     return BSPATCH_READ_PATCH_ERR;
   }
 
-  ctx->decompressed_size =
-      fastlz_decompress(ctx->compressed, ctx->compressed_size,
-                        ctx->decompressed, FASTLZ_BUFFER_SIZE);
+  return BSPATCH_SUCCESS;
+}
+
+static int fastlz_ctx_next(fastlz_ctx_t *ctx) {
+  int64_t decompressed_size;
+  int ret;
+
+  ret = fastlz_ctx_frame(ctx);
+  if (ret != BSPATCH_SUCCESS ||
+      PATCH_CHUNK_CODEC(ctx->last_block_flag) == BSDIFF_CODEC_ZERO) {
+    return ret;
+  }
+
+  switch (PATCH_CHUNK_CODEC(ctx->last_block_flag)) {
+  case BSDIFF_CODEC_FASTLZ:
+    decompressed_size =
+        fastlz_decompress(ctx->compressed, ctx->compressed_size,
+                          ctx->decompressed, FASTLZ_BUFFER_SIZE);
+    break;
+  case BSDIFF_CODEC_RANS:
+    decompressed_size = rans_decompress(ctx->compressed, ctx->compressed_size,
+                                        ctx->decompressed, FASTLZ_BUFFER_SIZE,
+                                        &ctx->rans_table);
+    break;
+  default:
+    return BSPATCH_DECOMPRESS_ERR;
+  }
+
+  if (decompressed_size <= 0) {
+    return BSPATCH_DECOMPRESS_ERR;
+  }
+
+  ctx->decompressed_size = decompressed_size;
   ctx->cursor = 0;
 
   return BSPATCH_SUCCESS;
 }
 
 static int fastlz_ctx_read(fastlz_ctx_t *ctx, void *buffer, size_t size) {
-  size_t i;
+  size_t i, n;
   int ret;
-  for (size_t i = 0; i < size; i++) {
+  for (i = 0; i < size; i += n) {
     if (ctx->cursor >= ctx->decompressed_size) {
       ret = fastlz_ctx_next(ctx);
       if (ret != BSPATCH_SUCCESS) {
@@ -95,8 +145,13 @@ static int fastlz_ctx_read(fastlz_ctx_t *ctx, void *buffer, size_t size) {
       }
     }
 
-    ((uint8_t *)buffer)[i] = ctx->decompressed[ctx->cursor];
-    ctx->cursor++;
+    n = MIN(size - i, ctx->decompressed_size - ctx->cursor);
+    if (PATCH_CHUNK_CODEC(ctx->last_block_flag) == BSDIFF_CODEC_ZERO) {
+      memset((uint8_t *)buffer + i, 0, n);
+    } else {
+      memcpy((uint8_t *)buffer + i, ctx->decompressed + ctx->cursor, n);
+    }
+    ctx->cursor += n;
   }
 
   return BSPATCH_SUCCESS;
@@ -109,33 +164,366 @@ static void fastlz_ctx_reset(fastlz_ctx_t *ctx) {
   ctx->cursor = 0;
 }
 
+// reads the rest of the chunks of a block without decompressing them
+static int fastlz_ctx_skip(fastlz_ctx_t *ctx) {
+  int ret;
+
+  while (!(ctx->last_block_flag & PATCH_CHUNK_FLAG_LAST)) {
+    ret = fastlz_ctx_frame(ctx);
+    if (ret != BSPATCH_SUCCESS) {
+      return ret;
+    }
+  }
+
+  return BSPATCH_SUCCESS;
+}
+
+/**
+ * Old as the filter turns it, for bspatch to read through arr. One block of
+ * old is kept filtered at a time.
+ */
+typedef struct filter_view {
+  bsdiff_array_like_t arr;
+  bsdiff_array_like_t *image;
+  uint8_t filter;
+  int64_t block_pos; // position of block in the image, -1 before the first
+  int64_t block_len;
+  uint8_t block[BSDIFF_FILTER_BLOCK_SIZE];
+} filter_view_t;
+
+/**
+ * New as the filter turned it, written to arr front to back. Each block is
+ * decoded into image once it is complete, the last one by filter_sink_flush.
+ */
+typedef struct filter_sink {
+  bsdiff_array_like_t arr;
+  bsdiff_array_like_t *image;
+  uint8_t filter;
+  int64_t block_pos;
+  int64_t block_len;
+  uint8_t block[BSDIFF_FILTER_BLOCK_SIZE];
+} filter_sink_t;
+
+static size_t view_read(const bsdiff_array_like_t *arr, size_t offset,
+                        void *buffer, size_t size) {
+  filter_view_t *view;
+  int64_t pos, len, at;
+  size_t i, n;
+
+  view = (filter_view_t *)arr->opaque;
+  for (i = 0; i < size; i += n) {
+    pos = (offset + i) / BSDIFF_FILTER_BLOCK_SIZE * BSDIFF_FILTER_BLOCK_SIZE;
+    if (pos != view->block_pos) {
+      len = MIN(BSDIFF_FILTER_BLOCK_SIZE,
+                (int64_t)view->image->len(view->image) - pos);
+      if (len <= 0 || view->image->read(view->image, pos, view->block, len) !=
+                           (size_t)len) {
+        return i;
+      }
+      filter_block(view->filter, view->block, len, pos, 1);
+      view->block_pos = pos;
+      view->block_len = len;
+    }
+
+    at = (int64_t)(offset + i) - pos;
+    if (at >= view->block_len) {
+      return i;
+    }
+    n = MIN(size - i, (size_t)(view->block_len - at));
+    memcpy((uint8_t *)buffer + i, view->block + at, n);
+  }
+
+  return size;
+}
+
+static size_t view_len(bsdiff_array_like_t *arr) {
+  filter_view_t *view;
+
+  view = (filter_view_t *)arr->opaque;
+
+  return view->image->len(view->image);
+}
+
+static void filter_view_init(filter_view_t *view, bsdiff_array_like_t *image,
+                             uint8_t filter) {
+  view->arr.opaque = view;
+  view->arr.read = view_read;
+  view->arr.write = NULL; // old is only read
+  view->arr.len = view_len;
+  view->image = image;
+  view->filter = filter;
+  view->block_pos = -1;
+  view->block_len = 0;
+}
+
+static int filter_sink_flush(filter_sink_t *sink) {
+  if (sink->block_len == 0) {
+    return 0;
+  }
+
+  filter_block(sink->filter, sink->block, sink->block_len, sink->block_pos, 0);
+  if (sink->image->write(sink->image, sink->block_pos, sink->block,
+                         sink->block_len) != (size_t)sink->block_len) {
+    return -1;
+  }
+  sink->block_pos += sink->block_len;
+  sink->block_len = 0;
+
+  return 0;
+}
+
+static size_t sink_write(bsdiff_array_like_t *arr, size_t offset,
+                         void *buffer, size_t size) {
+  filter_sink_t *sink;
+  size_t i, n;
+
+  sink = (filter_sink_t *)arr->opaque;
+  if ((int64_t)offset != sink->block_pos + sink->block_len) {
+    return 0;
+  }
+
+  for (i = 0; i < size; i += n) {
+    n = MIN(size - i, (size_t)(BSDIFF_FILTER_BLOCK_SIZE - sink->block_len));
+    memcpy(sink->block + sink->block_len, (uint8_t *)buffer + i, n);
+    sink->block_len += n;
+    if (sink->block_len == BSDIFF_FILTER_BLOCK_SIZE &&
+        filter_sink_flush(sink) != 0) {
+      return i;
+    }
+  }
+
+  return size;
+}
+
+static size_t sink_len(bsdiff_array_like_t *arr) {
+  filter_sink_t *sink;
+
+  sink = (filter_sink_t *)arr->opaque;
+
+  return sink->image->len(sink->image);
+}
+
+static void filter_sink_init(filter_sink_t *sink, bsdiff_array_like_t *image,
+                             uint8_t filter) {
+  sink->arr.opaque = sink;
+  sink->arr.read = NULL; // new is only written
+  sink->arr.write = sink_write;
+  sink->arr.len = sink_len;
+  sink->image = image;
+  sink->filter = filter;
+  sink->block_pos = 0;
+  sink->block_len = 0;
+}
+
+/* Encodes or decodes the first len bytes of image where it is, a block at a
+ * time, and writes back only the blocks that change.
+ */
+static int filter_image(bsdiff_array_like_t *image, int64_t len,
+                        uint8_t filter, int encode) {
+  uint8_t block[BSDIFF_FILTER_BLOCK_SIZE];
+  int64_t pos, n;
+
+  for (pos = 0; pos < len; pos += n) {
+    n = MIN(BSDIFF_FILTER_BLOCK_SIZE, len - pos);
+    if (image->read(image, pos, block, n) != (size_t)n) {
+      return -1;
+    }
+    if (filter_block(filter, block, n, pos, encode) > 0 &&
+        image->write(image, pos, block, n) != (size_t)n) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Reads the header of either signature, the plain one has no filter. */
+static int read_header(const bsdiff_stream_t *patch, uint64_t *new_sz,
+                       uint8_t *filter) {
+  bsdiff_header_t header;
+
+  if (patch->read(patch, &header, sizeof(header)) != sizeof(header)) {
+    return BSPATCH_READ_PATCH_ERR;
+  }
+
+  *filter = BSDIFF_FILTER_NONE;
+  if (memcmp(header.signature, BSDIFF_SIGNATURE_V2, BSDIFF_SIGNATURE_LEN) ==
+      0) {
+    if (patch->read(patch, filter, sizeof(*filter)) != sizeof(*filter)) {
+      return BSPATCH_READ_PATCH_ERR;
+    }
+    if (!filter_valid(*filter)) {
+      return BSPATCH_SANITY_CHECK_ERR;
+    }
+  } else if (memcmp(header.signature, BSDIFF_SIGNATURE,
+                    BSDIFF_SIGNATURE_LEN) != 0) {
+    return BSPATCH_SIGNATURE_INCONSISTENCY_ERR;
+  }
+
+  *new_sz = header.new_sz;
+
+  return BSPATCH_SUCCESS;
+}
+
+/* Moves old[from, end) by shift towards the end, a buffer at a time from the
+ * back, so that nothing is overwritten before it is read.
+ */
+static int move_old(bsdiff_array_like_t *old, uint64_t from, uint64_t end,
+                    uint64_t shift) {
+  uint8_t buf[FASTLZ_BUFFER_SIZE];
+  uint64_t n;
+
+  for (; end > from; end -= n) {
+    n = MIN(sizeof(buf), end - from);
+    if (old->read(old, end - n, buf, n) != n) {
+      return BSPATCH_READ_OLD_ERR;
+    }
+    if (old->write(old, end - n + shift, buf, n) != n) {
+      return BSPATCH_WRITE_OLD_ERR;
+    }
+  }
+
+  return BSPATCH_SUCCESS;
+}
+
+/* new = old + diff string, over old: old is read at from and new written at
+ * to, which is never after from. Where both are the same, only the parts the
+ * diff string changes are written back.
+ */
+static int add_diff(fastlz_ctx_t *ctx, bsdiff_array_like_t *old, uint64_t from,
+                    uint64_t to, uint64_t len) {
+  uint8_t p_buf[FASTLZ_BUFFER_SIZE], o_buf[FASTLZ_BUFFER_SIZE];
+  uint64_t i, j, n;
+  uint8_t changed;
+
+  for (i = 0; i < len; i += n) {
+    n = MIN(sizeof(p_buf), len - i);
+    if (fastlz_ctx_read(ctx, p_buf, n) != 0) {
+      return BSPATCH_READ_PATCH_ERR;
+    }
+
+    changed = from != to;
+    for (j = 0; j < n && !changed; j++) {
+      changed = p_buf[j] != 0;
+    }
+    if (!changed) {
+      continue;
+    }
+
+    if (old->read(old, from + i, o_buf, n) != n) {
+      return BSPATCH_READ_OLD_ERR;
+    }
+    for (j = 0; j < n; j++) {
+      p_buf[j] += o_buf[j];
+    }
+    if (old->write(old, to + i, p_buf, n) != n) {
+      return BSPATCH_WRITE_OLD_ERR;
+    }
+  }
+
+  return BSPATCH_SUCCESS;
+}
+
+/* Follows the blocks of the patch through in_place_t, as bspatch will apply
+ * them, with nothing read from old or written to it. The data of the blocks
+ * is skipped over.
+ */
+static int check_in_place(fastlz_ctx_t *ctx, int64_t old_sz, int64_t new_sz) {
+  patch_block_t block;
+  in_place_t ip;
+  int64_t shift;
+  int ret;
+
+  in_place_init(&ip, old_sz, new_sz);
+  while (ip.new_cursor < new_sz) {
+    if (ctx->patch->read(ctx->patch, &block, sizeof(block)) != sizeof(block)) {
+      return BSPATCH_READ_PATCH_ERR;
+    }
+
+    if (block.len_diff > INT_MAX || block.len_extra > INT_MAX ||
+        block.len_diff + block.len_extra >
+            (uint64_t)(new_sz - ip.new_cursor)) {
+      return BSPATCH_SANITY_CHECK_ERR;
+    }
+    if (!in_place_readable(&ip, block.len_diff)) {
+      return BSPATCH_IN_PLACE_ERR;
+    }
+    in_place_diff(&ip, block.len_diff);
+
+    shift = in_place_room(&ip, block.len_extra);
+    if (shift > 0 && !in_place_safe(&ip)) {
+      return BSPATCH_IN_PLACE_ERR;
+    }
+    in_place_extra(&ip, block.len_extra, shift);
+    in_place_skip(&ip, block.len_skip);
+
+    // a block without diff or extra string has no chunks
+    fastlz_ctx_reset(ctx);
+    if (block.len_diff + block.len_extra > 0) {
+      ret = fastlz_ctx_skip(ctx);
+      if (ret != BSPATCH_SUCCESS) {
+        return ret;
+      }
+    }
+  }
+
+  return BSPATCH_SUCCESS;
+}
+
+/**
+ * New is built over old, see in_place.h for where old is along the way. The
+ * image has to take MAX(old, new) bytes, and more where the patch inserts
+ * ahead of what it deletes; bsdiff reports how much in its apply cost. A
+ * patch whose diff strings read old that is gone by then is refused, before
+ * anything is written when the patch can be rewound.
+ */
 int bspatch(bsdiff_array_like_t *old, const bsdiff_stream_t *patch,
             size_t *new_size) {
-  bsdiff_header_t header;
   patch_block_t block;
-  uint8_t p_byte, o_byte; // patch/old byte
-  int64_t old_cursor, new_cursor;
-  int64_t i;
-  uint64_t old_sz, new_sz;
+  uint8_t p_buf[FASTLZ_BUFFER_SIZE];
+  in_place_t ip;
+  int64_t shift;
+  uint64_t i, n, new_sz;
+  uint8_t filter;
+  int ret;
 
   fastlz_ctx_t ctx;
 
   fastlz_ctx_init(&ctx, patch);
 
-  if (patch->read(patch, &header, sizeof(header)) != sizeof(header)) {
-    return BSPATCH_READ_PATCH_ERR;
+  ret = read_header(patch, &new_sz, &filter);
+  if (ret != BSPATCH_SUCCESS) {
+    return ret;
   }
 
-  if (memcmp(header.signature, BSDIFF_SIGNATURE, BSDIFF_SIGNATURE_LEN) != 0) {
-    return BSPATCH_SIGNATURE_INCONSISTENCY_ERR;
+  if (new_sz > INT64_MAX) {
+    return BSPATCH_SANITY_CHECK_ERR;
   }
 
-  old_sz = old->len(old);
-  new_sz = header.new_sz;
+  // the whole patch is checked first, a refused one leaves old untouched
+  if (patch->rewind != NULL) {
+    ret = check_in_place(&ctx, old->len(old), new_sz);
+    if (ret != BSPATCH_SUCCESS) {
+      return ret;
+    }
+    if (patch->rewind(patch) != 0) {
+      return BSPATCH_READ_PATCH_ERR;
+    }
+    fastlz_ctx_reset(&ctx);
+    ret = read_header(patch, &new_sz, &filter);
+    if (ret != BSPATCH_SUCCESS) {
+      return ret;
+    }
+  }
 
-  old_cursor = 0;
-  new_cursor = 0;
-  while (new_cursor < header.new_sz) {
+  // the patch is between the filtered images, old is filtered where it is
+  if (filter != BSDIFF_FILTER_NONE &&
+      filter_image(old, old->len(old), filter, 1) != 0) {
+    return BSPATCH_WRITE_OLD_ERR;
+  }
+
+  in_place_init(&ip, old->len(old), new_sz);
+  while (ip.new_cursor < (int64_t)new_sz) {
     if (patch->read(patch, &block, sizeof(block)) != sizeof(block)) {
       return BSPATCH_READ_PATCH_ERR;
     }
@@ -143,69 +531,148 @@ int bspatch(bsdiff_array_like_t *old, const bsdiff_stream_t *patch,
     fastlz_ctx_reset(&ctx);
 
     // sanity-check
-    if (block.len_diff < 0 || block.len_diff > INT_MAX ||   // len_diff
-        block.len_extra < 0 || block.len_extra > INT_MAX || // len_extra
-        new_cursor + block.len_diff > header.new_sz         // overflow
-    ) {
+    if (block.len_diff > INT_MAX || block.len_extra > INT_MAX || // lengths
+        block.len_diff + block.len_extra >
+            (uint64_t)(new_sz - ip.new_cursor)) { // overflow
       return BSPATCH_SANITY_CHECK_ERR;
     }
+    if (!in_place_readable(&ip, block.len_diff)) {
+      return BSPATCH_IN_PLACE_ERR;
+    }
 
-    // Read diff string and add
-    for (i = 0; i < block.len_diff; i++) {
-      if (fastlz_ctx_read(&ctx, &p_byte, 1) != 0) {
-        return BSPATCH_READ_PATCH_ERR;
+    ret = add_diff(&ctx, old, ip.old_cursor - ip.lag, ip.new_cursor,
+                   block.len_diff);
+    if (ret != BSPATCH_SUCCESS) {
+      return ret;
+    }
+    in_place_diff(&ip, block.len_diff);
+
+    // move the rest of old out of the way of the extra string, if it is in it
+    shift = in_place_room(&ip, block.len_extra);
+    if (shift > 0) {
+      if (!in_place_safe(&ip)) {
+        return BSPATCH_IN_PLACE_ERR;
+      }
+      ret = move_old(old, ip.old_cursor - ip.lag, ip.end, shift);
+      if (ret != BSPATCH_SUCCESS) {
+        return ret;
       }
+    }
 
-      if (old_cursor + i < old_sz) {
-        /* Codebelow is similar to
-         * old[new_cursor + i] = old[old_cursor + i] + byte;
-         */
-        if (old->read(old, old_cursor + i, &o_byte, 1) != 1) {
-          return BSPATCH_READ_OLD_ERR;
-        }
-        o_byte += p_byte;
-        if (old->write(old, new_cursor + i, &o_byte, 1) != 1) {
-          return BSPATCH_WRITE_OLD_ERR;
-        }
+    // copy extra string
+    for (i = 0; i < block.len_extra; i += n) {
+      n = MIN(sizeof(p_buf), block.len_extra - i);
+      if (fastlz_ctx_read(&ctx, p_buf, n) != 0) {
+        return BSPATCH_READ_PATCH_ERR;
+      }
+      if (old->write(old, ip.new_cursor + i, p_buf, n) != n) {
+        return BSPATCH_WRITE_OLD_ERR;
       }
     }
 
-    // adjust pointers
-    new_cursor += block.len_diff;
-    old_cursor += block.len_diff;
+    in_place_extra(&ip, block.len_extra, shift);
+    in_place_skip(&ip, block.len_skip);
+  }
+
+  if (filter != BSDIFF_FILTER_NONE &&
+      filter_image(old, new_sz, filter, 0) != 0) {
+    return BSPATCH_WRITE_OLD_ERR;
+  }
+
+  *new_size = new_sz;
+
+  return BSPATCH_SUCCESS;
+}
+
+int bspatch_to(bsdiff_array_like_t *old, bsdiff_array_like_t *new,
+               const bsdiff_stream_t *patch, size_t *new_size) {
+  patch_block_t block;
+  uint8_t p_buf[FASTLZ_BUFFER_SIZE], o_buf[FASTLZ_BUFFER_SIZE];
+  int64_t old_cursor;
+  uint64_t new_cursor;
+  uint64_t i, j, n;
+  uint64_t old_sz, new_sz;
+  uint8_t filter;
+  filter_view_t view;
+  filter_sink_t sink;
+  int ret;
+
+  fastlz_ctx_t ctx;
+
+  fastlz_ctx_init(&ctx, patch);
+
+  ret = read_header(patch, &new_sz, &filter);
+  if (ret != BSPATCH_SUCCESS) {
+    return ret;
+  }
+
+  // old is read and new written through the filter, a block at a time
+  if (filter != BSDIFF_FILTER_NONE) {
+    filter_view_init(&view, old, filter);
+    filter_sink_init(&sink, new, filter);
+    old = &view.arr;
+    new = &sink.arr;
+  }
+
+  old_sz = old->len(old);
+
+  /* Old is never written, so the old cursor stays in the coordinates of the
+   * original old file: it does not move for the extra string.
+   */
+  old_cursor = 0;
+  new_cursor = 0;
+  while (new_cursor < new_sz) {
+    if (patch->read(patch, &block, sizeof(block)) != sizeof(block)) {
+      return BSPATCH_READ_PATCH_ERR;
+    }
+
+    fastlz_ctx_reset(&ctx);
 
     // sanity-check
-    if (new_cursor + block.len_extra > header.new_sz) {
+    if (block.len_diff > INT_MAX || block.len_extra > INT_MAX ||
+        new_cursor + block.len_diff + block.len_extra > new_sz ||
+        old_cursor < 0 || old_cursor + block.len_diff > old_sz) {
       return BSPATCH_SANITY_CHECK_ERR;
     }
 
-    // move old for the extra string space
-    for (i = old_sz - 1; i >= old_cursor; i--) {
-      /* Code below is similar to
-       * old[i + block.len_extra] = old[i];
-       */
-      if (old->read(old, i, &o_byte, 1) != 1) {
+    // new = old + diff string, a buffer at a time
+    for (i = 0; i < block.len_diff; i += n) {
+      n = MIN(sizeof(p_buf), block.len_diff - i);
+      if (fastlz_ctx_read(&ctx, p_buf, n) != 0) {
+        return BSPATCH_READ_PATCH_ERR;
+      }
+      if (old->read(old, old_cursor + i, o_buf, n) != n) {
         return BSPATCH_READ_OLD_ERR;
       }
-      if (old->write(old, i + block.len_extra, &o_byte, 1) != 1) {
-        return BSPATCH_WRITE_OLD_ERR;
+      for (j = 0; j < n; j++) {
+        p_buf[j] += o_buf[j];
+      }
+      if (new->write(new, new_cursor + i, p_buf, n) != n) {
+        return BSPATCH_WRITE_NEW_ERR;
       }
     }
 
-    // read extra string
-    for (i = 0; i < block.len_extra; i++) {
-      if (fastlz_ctx_read(&ctx, &p_byte, 1) != 0) {
+    new_cursor += block.len_diff;
+    old_cursor += block.len_diff;
+
+    // copy extra string
+    for (i = 0; i < block.len_extra; i += n) {
+      n = MIN(sizeof(p_buf), block.len_extra - i);
+      if (fastlz_ctx_read(&ctx, p_buf, n) != 0) {
         return BSPATCH_READ_PATCH_ERR;
       }
-
-      if (old->write(old, new_cursor + i, &p_byte, 1) != 1) {
-        return BSPATCH_WRITE_OLD_ERR;
+      if (new->write(new, new_cursor + i, p_buf, n) != n) {
+        return BSPATCH_WRITE_NEW_ERR;
       }
     }
 
-    // adjust pointers
+    // len_skip may move the cursor backwards
     new_cursor += block.len_extra;
-    old_cursor += block.len_extra + block.len_skip;
+    old_cursor += (int64_t)block.len_skip;
+  }
+
+  if (filter != BSDIFF_FILTER_NONE && filter_sink_flush(&sink) != 0) {
+    return BSPATCH_WRITE_NEW_ERR;
   }
 
   *new_size = new_sz;
@@ -0,0 +1,556 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include <bsdiff/legacy/bsdiff.h>
+#include <fastlz.h>
+
+#include "helper.h"
+#include "rans.h"
+#include "writer.h"
+
+/* The first patch turns old into mid and the second mid into new. Both are
+ * read as they are, block lists and chunks, and neither mid is built nor
+ * anything sorted.
+ */
+
+/* A block of a patch, in the coordinates of its new: new[pos, pos +
+ * len_diff) is old[old_pos, ...) plus the diff string, the extra string
+ * follows.
+ */
+typedef struct span {
+  int64_t pos;
+  int64_t len_diff;
+  int64_t len_extra;
+  int64_t old_pos;
+} span_t;
+
+// a chunk of a patch, whose data is that of new[pos, ...)
+typedef struct chunk {
+  int64_t pos;
+  int64_t off; // of its frame in the patch
+} chunk_t;
+
+/* The blocks and chunks of a patch. Its diff and extra strings, laid end to
+ * end, line up with its new byte for byte, so the data at any position of
+ * new is found through the chunks. The chunk read last is kept decoded.
+ */
+typedef struct layout {
+  const uint8_t *patch;
+  int64_t patch_sz;
+  int64_t new_sz;
+  uint8_t filter;
+
+  span_t *spans;
+  int64_t span_count;
+  chunk_t *chunks;
+  int64_t chunk_count;
+
+  int64_t cached; // chunk in data, -1 for none
+  int64_t cached_len;
+  uint8_t cached_flag;
+  uint8_t data[FASTLZ_BUFFER_SIZE];
+  rans_table_t table;
+} layout_t;
+
+/* A piece of new, from one block of the second patch: its data added to mid
+ * at mid_pos, or its extra string when mid_pos is -1. old_pos is where it
+ * lines up with old when it is in a diff string of both patches, -1 when
+ * not.
+ */
+typedef struct piece {
+  int64_t len;
+  int64_t mid_pos;
+  int64_t old_pos;
+} piece_t;
+
+typedef struct compose {
+  layout_t first;  // old to mid
+  layout_t second; // mid to new
+
+  piece_t *pieces;
+  int64_t count;
+
+  // where compose_fill goes on
+  int64_t piece;
+  int64_t piece_off;
+  int64_t new_pos;
+
+  const bsdiff_config_t *config;
+  writer_t *writer;
+  int level;
+} compose_t;
+
+// the plain header or the one of a filter, off is set past it
+static int read_header(layout_t *l, int64_t *off) {
+  bsdiff_header_v2_t header;
+
+  if (l->patch_sz < (int64_t)sizeof(bsdiff_header_t)) {
+    return -1;
+  }
+  memcpy(&header, l->patch, sizeof(bsdiff_header_t));
+  *off = sizeof(bsdiff_header_t);
+
+  l->filter = BSDIFF_FILTER_NONE;
+  if (memcmp(header.signature, BSDIFF_SIGNATURE_V2, BSDIFF_SIGNATURE_LEN) ==
+      0) {
+    if (l->patch_sz < (int64_t)sizeof(header)) {
+      return -1;
+    }
+    l->filter = l->patch[sizeof(bsdiff_header_t)];
+    *off = sizeof(header);
+  } else if (memcmp(header.signature, BSDIFF_SIGNATURE,
+                    BSDIFF_SIGNATURE_LEN) != 0) {
+    return -1;
+  }
+
+  if (header.new_sz > INT64_MAX) {
+    return -1;
+  }
+  l->new_sz = header.new_sz;
+
+  return 0;
+}
+
+/* Reads the frame of the chunk at off and sets next past it. The chunk is
+ * decoded into data and len set to its length, unless data is NULL.
+ */
+static int read_chunk(layout_t *l, int64_t off, uint8_t *data, int64_t *len,
+                      uint8_t *flag, int64_t *next) {
+  uint64_t size;
+
+  if (l->patch_sz - off < (int64_t)(sizeof(size) + sizeof(*flag))) {
+    return -1;
+  }
+  memcpy(&size, l->patch + off, sizeof(size));
+  *flag = l->patch[off + sizeof(size)];
+  off += sizeof(size) + sizeof(*flag);
+
+  // a zero chunk has no payload, its size is the length of the run
+  if (PATCH_CHUNK_CODEC(*flag) == BSDIFF_CODEC_ZERO) {
+    if (size == 0 || size > INT64_MAX) {
+      return -1;
+    }
+    *len = size;
+    *next = off;
+    return 0;
+  }
+
+  if (size > FASTLZ_BUFFER_SIZE || size > (uint64_t)(l->patch_sz - off)) {
+    return -1;
+  }
+  *next = off + size;
+  if (data == NULL) {
+    return 0;
+  }
+
+  switch (PATCH_CHUNK_CODEC(*flag)) {
+  case BSDIFF_CODEC_FASTLZ:
+    *len = fastlz_decompress(l->patch + off, size, data, FASTLZ_BUFFER_SIZE);
+    break;
+  case BSDIFF_CODEC_RANS:
+    *len = rans_decompress(l->patch + off, size, data, FASTLZ_BUFFER_SIZE,
+                           &l->table);
+    break;
+  default:
+    return -1;
+  }
+
+  return *len > 0 ? 0 : -1;
+}
+
+/* Walks the blocks of the patch from off. Without spans it only counts the
+ * blocks and chunks, with them it fills them in, decoding every chunk to
+ * learn where the next one starts in new.
+ */
+static int walk_blocks(layout_t *l, int64_t off) {
+  patch_block_t block;
+  int64_t pos, old_pos, end, at, len, next, spans, chunks;
+  uint8_t flag;
+
+  spans = 0;
+  chunks = 0;
+  pos = 0;
+  old_pos = 0;
+  len = 0;
+  next = 0;
+  flag = 0;
+  while (pos < l->new_sz) {
+    if (l->patch_sz - off < (int64_t)sizeof(block)) {
+      return -1;
+    }
+    memcpy(&block, l->patch + off, sizeof(block));
+    off += sizeof(block);
+
+    if (block.len_diff > INT_MAX || block.len_extra > INT_MAX ||
+        block.len_diff + block.len_extra > (uint64_t)(l->new_sz - pos) ||
+        (block.len_diff > 0 && old_pos < 0)) {
+      return -1;
+    }
+    end = pos + block.len_diff + block.len_extra;
+
+    if (l->spans != NULL) {
+      l->spans[spans].pos = pos;
+      l->spans[spans].len_diff = block.len_diff;
+      l->spans[spans].len_extra = block.len_extra;
+      l->spans[spans].old_pos = old_pos;
+    }
+    spans++;
+
+    for (at = pos, flag = end > pos ? 0 : PATCH_CHUNK_FLAG_LAST;
+         !(flag & PATCH_CHUNK_FLAG_LAST); off = next) {
+      if (read_chunk(l, off, l->spans != NULL ? l->data : NULL, &len, &flag,
+                     &next) != 0) {
+        return -1;
+      }
+      if (l->spans != NULL) {
+        if (len > end - at) {
+          return -1;
+        }
+        l->chunks[chunks].pos = at;
+        l->chunks[chunks].off = off;
+        at += len;
+      }
+      chunks++;
+    }
+    if (l->spans != NULL && at != end) {
+      return -1;
+    }
+
+    pos = end;
+    old_pos += block.len_diff + (int64_t)block.len_skip;
+  }
+
+  l->span_count = spans;
+  l->chunk_count = chunks;
+
+  return 0;
+}
+
+static int layout_init(layout_t *l, bsdiff_stream_t *stream,
+                       const uint8_t *patch, int64_t patch_sz) {
+  int64_t off;
+
+  l->patch = patch;
+  l->patch_sz = patch_sz;
+  l->spans = NULL;
+  l->chunks = NULL;
+  l->cached = -1;
+
+  if (read_header(l, &off) != 0 || walk_blocks(l, off) != 0) {
+    return -1;
+  }
+
+  l->spans = stream->malloc((l->span_count + 1) * sizeof(span_t));
+  l->chunks = stream->malloc((l->chunk_count + 1) * sizeof(chunk_t));
+  if (l->spans == NULL || l->chunks == NULL) {
+    return -1;
+  }
+
+  return walk_blocks(l, off);
+}
+
+static void layout_free(layout_t *l, bsdiff_stream_t *stream) {
+  stream->free(l->spans);
+  stream->free(l->chunks);
+}
+
+// the span that holds new[pos], pos < new_sz
+static int64_t find_span(const layout_t *l, int64_t pos) {
+  int64_t lo, hi, mid;
+
+  // the last span that starts at or before pos, past any empty ones
+  lo = 0;
+  hi = l->span_count;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (l->spans[mid].pos <= pos) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+// the data of new[pos, pos + len), a chunk at a time
+static int read_data(layout_t *l, int64_t pos, uint8_t *buffer, int64_t len) {
+  int64_t i, n, at, lo, hi, mid, next;
+
+  for (i = 0; i < len; i += n) {
+    // reads go on mostly where the last one ended
+    if (l->cached < 0 || pos + i < l->chunks[l->cached].pos ||
+        pos + i >= l->chunks[l->cached].pos + l->cached_len) {
+      lo = 0;
+      hi = l->chunk_count;
+      while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (l->chunks[mid].pos <= pos + i) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
+      }
+      if (lo >= l->chunk_count ||
+          read_chunk(l, l->chunks[lo].off, l->data, &l->cached_len,
+                     &l->cached_flag, &next) != 0) {
+        l->cached = -1;
+        return -1;
+      }
+      l->cached = lo;
+    }
+
+    at = pos + i - l->chunks[l->cached].pos;
+    if (at >= l->cached_len) {
+      return -1;
+    }
+    n = MIN(len - i, l->cached_len - at);
+    if (PATCH_CHUNK_CODEC(l->cached_flag) == BSDIFF_CODEC_ZERO) {
+      memset(buffer + i, 0, n);
+    } else {
+      memcpy(buffer + i, l->data + at, n);
+    }
+  }
+
+  return 0;
+}
+
+static void add_piece(piece_t *pieces, int64_t *count, int64_t len,
+                      int64_t mid_pos, int64_t old_pos) {
+  if (pieces != NULL) {
+    pieces[*count].len = len;
+    pieces[*count].mid_pos = mid_pos;
+    pieces[*count].old_pos = old_pos;
+  }
+  (*count)++;
+}
+
+/* Cuts new into pieces, each diff string of the second patch where the
+ * blocks of the first cut mid. Without pieces they are only counted.
+ */
+static int cut_pieces(const compose_t *c, piece_t *pieces, int64_t *count) {
+  const span_t *s, *f;
+  int64_t i, mid, end, n;
+
+  *count = 0;
+  for (i = 0; i < c->second.span_count; i++) {
+    s = &c->second.spans[i];
+    if (s->len_diff > 0 &&
+        (s->old_pos < 0 || s->old_pos > c->first.new_sz - s->len_diff)) {
+      return -1;
+    }
+
+    for (mid = s->old_pos, end = mid + s->len_diff; mid < end; mid += n) {
+      f = &c->first.spans[find_span(&c->first, mid)];
+      if (mid < f->pos + f->len_diff) {
+        n = MIN(end - mid, f->pos + f->len_diff - mid);
+        add_piece(pieces, count, n, mid, f->old_pos + (mid - f->pos));
+      } else {
+        n = MIN(end - mid, f->pos + f->len_diff + f->len_extra - mid);
+        add_piece(pieces, count, n, mid, -1);
+      }
+    }
+
+    if (s->len_extra > 0) {
+      add_piece(pieces, count, s->len_extra, -1, -1);
+    }
+  }
+
+  return 0;
+}
+
+/* The next len bytes of the data of the new patch, len at most
+ * FASTLZ_INPUT_SIZE: the data of the second patch, plus that of the first
+ * where it reads mid. Diff plus diff is the diff against old, diff plus
+ * extra the byte of new.
+ */
+static int compose_fill(void *opaque, uint8_t *buffer, int64_t len) {
+  uint8_t mid[FASTLZ_INPUT_SIZE];
+  compose_t *c;
+  const piece_t *p;
+  int64_t i, j, n;
+
+  c = (compose_t *)opaque;
+  for (i = 0; i < len; i += n) {
+    p = &c->pieces[c->piece];
+    n = MIN(len - i, p->len - c->piece_off);
+    if (read_data(&c->second, c->new_pos, buffer + i, n) != 0) {
+      return -1;
+    }
+    if (p->mid_pos >= 0) {
+      if (read_data(&c->first, p->mid_pos + c->piece_off, mid, n) != 0) {
+        return -1;
+      }
+      for (j = 0; j < n; j++) {
+        buffer[i + j] += mid[j];
+      }
+    }
+
+    c->new_pos += n;
+    c->piece_off += n;
+    if (c->piece_off == p->len) {
+      c->piece++;
+      c->piece_off = 0;
+    }
+  }
+
+  return 0;
+}
+
+static int write_block(compose_t *c, int64_t len_diff, int64_t len_extra,
+                       int64_t len_skip) {
+  patch_block_t block;
+
+  block.len_diff = len_diff;
+  block.len_extra = len_extra;
+  block.len_skip = len_skip;
+  writer_write(c->writer, &block, sizeof(block));
+
+  return writer_data(c->writer, c->config->codec, c->level,
+                     c->config->zero_chunks, len_diff + len_extra,
+                     compose_fill, c);
+}
+
+/* Groups the pieces into blocks: the pieces in a diff string of both
+ * patches that go on in old make up the diff string of a block, those that
+ * follow and are not its extra string. The skip takes old to where the next
+ * diff string starts.
+ */
+static int write_blocks(compose_t *c) {
+  int64_t i, k, old_pos, len_diff, len_extra;
+
+  old_pos = 0;
+  i = 0;
+  if (c->count > 0 && c->pieces[0].old_pos > 0) {
+    old_pos = c->pieces[0].old_pos;
+    if (write_block(c, 0, 0, old_pos) != 0) {
+      return -1;
+    }
+  }
+
+  while (i < c->count) {
+    for (len_diff = 0;
+         i < c->count && c->pieces[i].old_pos == old_pos + len_diff &&
+         len_diff + c->pieces[i].len <= INT_MAX;
+         i++) {
+      len_diff += c->pieces[i].len;
+    }
+    for (len_extra = 0; i < c->count && c->pieces[i].old_pos < 0 &&
+                        len_extra + c->pieces[i].len <= INT_MAX;
+         i++) {
+      len_extra += c->pieces[i].len;
+    }
+
+    old_pos += len_diff;
+    for (k = i; k < c->count && c->pieces[k].old_pos < 0; k++) {
+    }
+    k = k < c->count ? c->pieces[k].old_pos - old_pos : 0;
+
+    if (write_block(c, len_diff, len_extra, k) != 0) {
+      return -1;
+    }
+    old_pos += k;
+  }
+
+  return 0;
+}
+
+int bsdiff_compose(const uint8_t *first, int64_t first_sz,
+                   const uint8_t *second, int64_t second_sz,
+                   bsdiff_stream_t *stream, const bsdiff_config_t *config) {
+  bsdiff_header_v2_t header;
+  writer_t writer;
+  compose_t c;
+  int ret;
+
+  if (config->write_buffer_size < 0) {
+    return -1;
+  }
+
+  c.pieces = NULL;
+  c.piece = 0;
+  c.piece_off = 0;
+  c.new_pos = 0;
+  c.config = config;
+  c.writer = &writer;
+  c.level = config->effort == BSDIFF_EFFORT_FAST ? 1 : 2;
+
+  // both are laid out either way, so that both can be freed
+  ret = layout_init(&c.first, stream, first, first_sz);
+  if (layout_init(&c.second, stream, second, second_sz) != 0) {
+    ret = -1;
+  }
+
+  // the patches have to be of images filtered alike
+  if (ret == 0 && c.first.filter != c.second.filter) {
+    ret = -1;
+  }
+
+  if (ret == 0) {
+    ret = cut_pieces(&c, NULL, &c.count);
+  }
+  if (ret == 0) {
+    c.pieces = stream->malloc((c.count + 1) * sizeof(piece_t));
+    ret = c.pieces != NULL ? cut_pieces(&c, c.pieces, &c.count) : -1;
+  }
+
+  if (ret == 0) {
+    ret = writer_init(
+        &writer, stream,
+        MIN(MAX(config->write_buffer_size, (int64_t)CHUNK_FRAME_SIZE),
+            INT_MAX),
+        0);
+  }
+  if (ret == 0) {
+    memcpy(header.signature,
+           c.first.filter != BSDIFF_FILTER_NONE ? BSDIFF_SIGNATURE_V2
+                                                : BSDIFF_SIGNATURE,
+           BSDIFF_SIGNATURE_LEN);
+    header.new_sz = c.second.new_sz;
+    header.filter = c.first.filter;
+    writer_write(&writer, &header,
+                 c.first.filter != BSDIFF_FILTER_NONE
+                     ? sizeof(header)
+                     : sizeof(bsdiff_header_t));
+
+    ret = write_blocks(&c);
+    if (ret == 0) {
+      ret = writer_flush(&writer);
+    }
+    writer_free(&writer);
+  }
+
+  stream->free(c.pieces);
+  layout_free(&c.second, stream);
+  layout_free(&c.first, stream);
+
+  return ret;
+}
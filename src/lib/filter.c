@@ -0,0 +1,209 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "filter.h"
+#include "helper.h"
+
+static uint32_t load32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static void store32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+/* Whether an instruction is turned is told from bytes the turning leaves
+ * alone, and the bytes it changes are stepped over, so that encoding and
+ * decoding take the same instructions. Each returns how many it turned.
+ */
+
+static int64_t x86(uint8_t *data, int64_t len, int64_t pos, int encode) {
+  int64_t i, n;
+  uint32_t v, ip;
+
+  n = 0;
+  for (i = 0; i + 5 <= len; i++) {
+    // E8 CALL, E9 JMP, the 4 bytes after are stepped over either way
+    if ((data[i] & 0xfe) != 0xe8) {
+      continue;
+    }
+
+    // to a target within 16MB: the top byte is 0x00 or 0xFF
+    if (data[i + 4] == 0x00 || data[i + 4] == 0xff) {
+      ip = (uint32_t)(pos + i + 5);
+      v = load32(data + i + 1);
+      v = encode ? v + ip : v - ip;
+      // modulo 2^25, so that the top byte stays 0x00 or 0xFF
+      v &= 0x01ffffff;
+      if (v & 0x01000000) {
+        v |= 0xfe000000;
+      }
+      store32(data + i + 1, v);
+      n++;
+    }
+
+    i += 4;
+  }
+
+  return n;
+}
+
+static int64_t arm_thumb(uint8_t *data, int64_t len, int64_t pos,
+                         int encode) {
+  int64_t i, n;
+  uint32_t v, ip;
+
+  n = 0;
+  for (i = 0; i + 4 <= len; i += 2) {
+    // BL is a pair of halfwords, 11110 and 11111 then 11 bits of the offset
+    if ((data[i + 1] & 0xf8) != 0xf0 || (data[i + 3] & 0xf8) != 0xf8) {
+      continue;
+    }
+
+    v = (uint32_t)(data[i + 1] & 0x07) << 19 | (uint32_t)data[i] << 11 |
+        (uint32_t)(data[i + 3] & 0x07) << 8 | data[i + 2];
+    ip = (uint32_t)((pos + i + 4) >> 1);
+    v = (encode ? v + ip : v - ip) & 0x3fffff;
+
+    data[i + 1] = (uint8_t)(0xf0 | ((v >> 19) & 0x07));
+    data[i] = (uint8_t)(v >> 11);
+    data[i + 3] = (uint8_t)(0xf8 | ((v >> 8) & 0x07));
+    data[i + 2] = (uint8_t)v;
+
+    i += 2;
+    n++;
+  }
+
+  return n;
+}
+
+static int64_t arm64(uint8_t *data, int64_t len, int64_t pos, int encode) {
+  int64_t i, n;
+  uint32_t w, v, ip;
+
+  n = 0;
+  for (i = 0; i + 4 <= len; i += 4) {
+    w = load32(data + i);
+
+    if ((w >> 26) == 0x25) {
+      // BL, 26 bits of offset in words
+      ip = (uint32_t)((pos + i) >> 2);
+      v = encode ? w + ip : w - ip;
+      w = (w & 0xfc000000) | (v & 0x03ffffff);
+    } else if ((w & 0x9f000000) == 0x90000000) {
+      // ADRP, 21 bits of offset in pages, taken within 2^17 pages
+      v = ((w >> 29) & 0x3) | ((w >> 3) & 0x1ffffc);
+      if (((v + 0x20000) & 0x1c0000) != 0) {
+        continue;
+      }
+      ip = (uint32_t)((pos + i) >> 12);
+      v = (encode ? v + ip : v - ip) & 0x3ffff;
+      if (v & 0x20000) {
+        v |= 0x1c0000;
+      }
+      w = (w & 0x9f00001f) | (v & 0x3) << 29 | (v & 0x1ffffc) << 3;
+    } else {
+      continue;
+    }
+
+    store32(data + i, w);
+    n++;
+  }
+
+  return n;
+}
+
+static int64_t riscv(uint8_t *data, int64_t len, int64_t pos, int encode) {
+  int64_t i, n;
+  uint32_t w, v, ip;
+
+  n = 0;
+  for (i = 0; i + 4 <= len; i += 2) {
+    // JAL to ra or t0, calls and far jumps; compressed code is 2-aligned
+    w = load32(data + i);
+    if ((w & 0xfff) != 0x0ef && (w & 0xfff) != 0x2ef) {
+      continue;
+    }
+
+    // imm[20|10:1|11|19:12] in bits 31..12
+    v = (w >> 31 & 0x1) << 20 | (w >> 21 & 0x3ff) << 1 | (w >> 20 & 0x1) << 11 |
+        (w >> 12 & 0xff) << 12;
+    ip = (uint32_t)(pos + i);
+    v = (encode ? v + ip : v - ip) & 0x1ffffe;
+    w = (w & 0xfff) | (v >> 20 & 0x1) << 31 | (v >> 1 & 0x3ff) << 21 |
+        (v >> 11 & 0x1) << 20 | (v >> 12 & 0xff) << 12;
+    store32(data + i, w);
+
+    i += 2;
+    n++;
+  }
+
+  return n;
+}
+
+int64_t filter_block(uint8_t filter, uint8_t *data, int64_t len, int64_t pos,
+                     int encode) {
+  switch (filter) {
+  case BSDIFF_FILTER_X86:
+    return x86(data, len, pos, encode);
+  case BSDIFF_FILTER_ARM_THUMB:
+    return arm_thumb(data, len, pos, encode);
+  case BSDIFF_FILTER_ARM64:
+    return arm64(data, len, pos, encode);
+  case BSDIFF_FILTER_RISCV:
+    return riscv(data, len, pos, encode);
+  default:
+    return 0;
+  }
+}
+
+static void filter_blocks(uint8_t filter, uint8_t *data, int64_t len,
+                          int64_t pos, int encode) {
+  int64_t i;
+
+  for (i = 0; i < len; i += BSDIFF_FILTER_BLOCK_SIZE) {
+    filter_block(filter, data + i, MIN(BSDIFF_FILTER_BLOCK_SIZE, len - i),
+                 pos + i, encode);
+  }
+}
+
+int filter_valid(uint8_t filter) { return filter <= BSDIFF_FILTER_RISCV; }
+
+void filter_encode(uint8_t filter, uint8_t *data, int64_t len, int64_t pos) {
+  filter_blocks(filter, data, len, pos, 1);
+}
+
+void filter_decode(uint8_t filter, uint8_t *data, int64_t len, int64_t pos) {
+  filter_blocks(filter, data, len, pos, 0);
+}
@@ -0,0 +1,62 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_FILTER_H_
+#define _BSDIFF_FILTER_H_
+
+#include <stdint.h>
+
+#include <bsdiff/patch_format.h>
+
+/**
+ * Branch filters, see bsdiff_header_v2_t. Encoding makes the targets of
+ * calls and branches absolute, decoding makes them relative again. The
+ * instructions turned are:
+ *
+ *   x86       CALL and JMP rel32, where the target is within 16MB
+ *   ARM Thumb BL
+ *   ARM64     BL, and ADRP where the page is within 512MB
+ *   RISC-V    JAL to ra or t0
+ *
+ * data is filtered in place, pos is its position in the image and a multiple
+ * of BSDIFF_FILTER_BLOCK_SIZE. Filtering the blocks of an image in any order
+ * gives the same result.
+ */
+int filter_valid(uint8_t filter);
+
+void filter_encode(uint8_t filter, uint8_t *data, int64_t len, int64_t pos);
+
+void filter_decode(uint8_t filter, uint8_t *data, int64_t len, int64_t pos);
+
+/* Filters one block of at most BSDIFF_FILTER_BLOCK_SIZE bytes at pos, and
+ * returns how many instructions it turned.
+ */
+int64_t filter_block(uint8_t filter, uint8_t *data, int64_t len, int64_t pos,
+                     int encode);
+
+#endif // _BSDIFF_FILTER_H_
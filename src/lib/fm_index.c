@@ -0,0 +1,260 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "bsearch.h"
+#include "fm_index.h"
+
+static int64_t bitvector_blocks(int64_t bits) { return bits / 256 + 1; }
+
+// the words of every 256 bits, then their ranks padded to 8 bytes
+static int64_t bitvector_size(int64_t bits) {
+  int64_t blocks = bitvector_blocks(bits);
+
+  return blocks * 4 * sizeof(uint64_t) +
+         ((blocks * sizeof(uint32_t) + 7) & ~(int64_t)7);
+}
+
+static uint8_t *bitvector_init(fm_bitvector_t *bv, uint8_t *memory,
+                               int64_t bits) {
+  bv->bits = (uint64_t *)memory;
+  bv->ranks = (uint32_t *)(memory + bitvector_blocks(bits) * 4 *
+                                        sizeof(uint64_t));
+
+  return memory + bitvector_size(bits);
+}
+
+static void bitvector_set(fm_bitvector_t *bv, int64_t i) {
+  bv->bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static int bitvector_get(const fm_bitvector_t *bv, int64_t i) {
+  return (bv->bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static int64_t popcount(uint64_t x) {
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+  return (x * 0x0101010101010101ULL) >> 56;
+}
+
+static void bitvector_rank_init(fm_bitvector_t *bv, int64_t bits) {
+  int64_t b, k, ones;
+
+  ones = 0;
+  for (b = 0; b < bitvector_blocks(bits); b++) {
+    bv->ranks[b] = ones;
+    for (k = 0; k < 4; k++) {
+      ones += popcount(bv->bits[b * 4 + k]);
+    }
+  }
+}
+
+// number of ones before i
+static int64_t bitvector_rank(const fm_bitvector_t *bv, int64_t i) {
+  const uint64_t *words = bv->bits + (i >> 8) * 4;
+  int64_t ones = bv->ranks[i >> 8];
+  int64_t k;
+
+  for (k = 0; k < ((i >> 6) & 3); k++) {
+    ones += popcount(words[k]);
+  }
+
+  return ones + popcount(words[k] & (((uint64_t)1 << (i & 63)) - 1));
+}
+
+// follow row i of byte c down the wavelet matrix
+static int64_t wavelet_map(const fm_index_t *fm, uint8_t c, int64_t i) {
+  int64_t ones;
+  int l;
+
+  for (l = 0; l < FM_INDEX_LEVELS; l++) {
+    ones = bitvector_rank(&fm->levels[l], i);
+    i = (c >> (7 - l)) & 1 ? fm->zeros[l] + ones : i - ones;
+  }
+
+  return i;
+}
+
+// number of c in the BWT before row i
+static int64_t wavelet_rank(const fm_index_t *fm, uint8_t c, int64_t i) {
+  int64_t rank = wavelet_map(fm, c, i) - fm->first[c];
+
+  return c == 0 && fm->dollar < i ? rank - 1 : rank;
+}
+
+// the row of the suffix one byte longer than the suffix of row i
+static int64_t lf(const fm_index_t *fm, int64_t i) {
+  int64_t r, ones;
+  uint8_t c;
+  int l, bit;
+
+  c = 0;
+  r = i;
+  for (l = 0; l < FM_INDEX_LEVELS; l++) {
+    bit = bitvector_get(&fm->levels[l], r);
+    ones = bitvector_rank(&fm->levels[l], r);
+    c = c << 1 | bit;
+    r = bit ? fm->zeros[l] + ones : r - ones;
+  }
+
+  r -= fm->first[c];
+  if (c == 0 && fm->dollar < i) {
+    r--;
+  }
+
+  return fm->count[c] + r;
+}
+
+// position in the text of the suffix of row i
+static int64_t locate(const fm_index_t *fm, int64_t i) {
+  int64_t steps;
+
+  // position 0 is sampled, so the walk never reaches the dollar
+  for (steps = 0; !bitvector_get(&fm->sampled, i); steps++) {
+    i = lf(fm, i);
+  }
+
+  return fm->samples[bitvector_rank(&fm->sampled, i)] + steps;
+}
+
+int64_t fm_index_size(int64_t old_sz) {
+  int64_t rows = old_sz + 1;
+
+  return (FM_INDEX_LEVELS + 1) * bitvector_size(rows) +
+         (old_sz / FM_INDEX_SAMPLE + 1) * sizeof(uint32_t);
+}
+
+void fm_index_build(fm_index_t *fm, void *memory, const uint8_t *text,
+                    int64_t old_sz, int64_t *sa) {
+  int64_t hist[256] = {0};
+  int64_t rows, i, j, z, o;
+  uint8_t *bwt, *next, *tmp, *p;
+  int l, c;
+
+  rows = old_sz + 1;
+  fm->rows = rows;
+  fm->dollar = 0;
+
+  memset(memory, 0, fm_index_size(old_sz));
+  p = memory;
+  for (l = 0; l < FM_INDEX_LEVELS; l++) {
+    p = bitvector_init(&fm->levels[l], p, rows);
+  }
+  p = bitvector_init(&fm->sampled, p, rows);
+  fm->samples = (uint32_t *)p;
+
+  for (i = 0; i < old_sz; i++) {
+    hist[text[i]]++;
+  }
+  for (c = 0, j = 1; c < 256; c++) {
+    fm->count[c] = j;
+    j += hist[c];
+  }
+
+  /* The BWT overwrites the suffix array in place: byte i lies in sa[i / 8],
+   * which has been read by the time byte i is written.
+   */
+  bwt = (uint8_t *)sa;
+  for (i = 0, j = 0; i < rows; i++) {
+    if (sa[i] % FM_INDEX_SAMPLE == 0) {
+      bitvector_set(&fm->sampled, i);
+      fm->samples[j++] = sa[i];
+    }
+    if (sa[i] == 0) {
+      fm->dollar = i;
+      bwt[i] = 0;
+    } else {
+      bwt[i] = text[sa[i] - 1];
+    }
+  }
+  bitvector_rank_init(&fm->sampled, rows);
+
+  // every level sorts the bytes stably by their bit, zeros first
+  next = bwt + rows;
+  for (l = 0; l < FM_INDEX_LEVELS; l++) {
+    for (i = 0, z = 0; i < rows; i++) {
+      if ((bwt[i] >> (7 - l)) & 1) {
+        bitvector_set(&fm->levels[l], i);
+      } else {
+        z++;
+      }
+    }
+    bitvector_rank_init(&fm->levels[l], rows);
+    fm->zeros[l] = z;
+
+    for (i = 0, j = 0, o = z; i < rows; i++) {
+      if ((bwt[i] >> (7 - l)) & 1) {
+        next[o++] = bwt[i];
+      } else {
+        next[j++] = bwt[i];
+      }
+    }
+    tmp = bwt;
+    bwt = next;
+    next = tmp;
+  }
+
+  for (c = 0; c < 256; c++) {
+    fm->first[c] = wavelet_map(fm, c, 0);
+  }
+}
+
+int64_t fm_index_search(const fm_index_t *fm, const uint8_t *old,
+                        int64_t old_sz, const uint8_t *new, int64_t new_sz,
+                        int64_t *pos) {
+  int64_t beg, end, b, e, k;
+
+  /* Rows [beg, end) are the suffixes of the reversed text that start with
+   * new[0..k) reversed. Once one is left, or the match is long enough to be
+   * worth taking, the rest is compared with old directly.
+   */
+  beg = 0;
+  end = fm->rows;
+  for (k = 0; k < new_sz && k < FM_INDEX_EXTEND && end - beg > 1; k++) {
+    b = fm->count[new[k]] + wavelet_rank(fm, new[k], beg);
+    e = fm->count[new[k]] + wavelet_rank(fm, new[k], end);
+    if (b >= e) {
+      break;
+    }
+    beg = b;
+    end = e;
+  }
+
+  *pos = 0;
+  if (k == 0) {
+    return 0;
+  }
+
+  *pos = old_sz - locate(fm, beg) - k;
+
+  return k + matchlen(old + *pos + k, old_sz - *pos - k, new + k, new_sz - k);
+}
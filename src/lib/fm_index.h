@@ -0,0 +1,78 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_FM_INDEX_H_
+#define _BSDIFF_FM_INDEX_H_
+
+#include <stdint.h>
+
+#define FM_INDEX_LEVELS 8
+#define FM_INDEX_SAMPLE 32
+#define FM_INDEX_EXTEND 256
+
+typedef struct fm_bitvector {
+  uint64_t *bits;
+  uint32_t *ranks; // number of ones before every 256 bits
+} fm_bitvector_t;
+
+/**
+ * FM-index of old reversed: the BWT held in a wavelet matrix, one bitvector
+ * per bit of a byte, and the suffix array sampled at every FM_INDEX_SAMPLE-th
+ * position of the text. Backward search on the reversed text extends a match
+ * of new forward one byte at a time, the same query the suffix array answers
+ * by binary search.
+ *
+ * The bitvectors take 1.13 bytes per byte of old, the samples and the marks
+ * of the sampled rows another 0.27. Building it needs the suffix array of
+ * old reversed, so the peak is that of qsufsort. Old must be smaller than 4GB.
+ */
+typedef struct fm_index {
+  fm_bitvector_t levels[FM_INDEX_LEVELS];
+  uint32_t zeros[FM_INDEX_LEVELS]; // number of zeros of each level
+  fm_bitvector_t sampled;
+  uint32_t *samples;
+  uint32_t count[256]; // first row of the suffixes starting with each byte
+  uint32_t first[256]; // where each byte starts after the last level
+  int64_t rows;        // old_sz + 1, the empty suffix sorts first
+  int64_t dollar;      // the row of the whole text, its BWT byte is not real
+} fm_index_t;
+
+// number of bytes of the index for old_sz bytes of old
+int64_t fm_index_size(int64_t old_sz);
+
+/* text is old reversed and sa its suffix array from qsufsort, which is used
+ * as scratch and destroyed. memory must hold fm_index_size bytes.
+ */
+void fm_index_build(fm_index_t *fm, void *memory, const uint8_t *text,
+                    int64_t old_sz, int64_t *sa);
+
+int64_t fm_index_search(const fm_index_t *fm, const uint8_t *old,
+                        int64_t old_sz, const uint8_t *new, int64_t new_sz,
+                        int64_t *pos);
+
+#endif // _BSDIFF_FM_INDEX_H_
@@ -0,0 +1,98 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "bsearch.h"
+#include "hash_index.h"
+
+static int hash_index_bits(int64_t old_sz, int64_t stride) {
+  int bits;
+
+  for (bits = 1; ((int64_t)1 << bits) < old_sz / stride; bits++) {
+  }
+
+  return bits;
+}
+
+// multiplicative hash of the 8 bytes at p, one load instead of a rolling hash
+uint64_t hash_index_key(const uint8_t *p, int bits) {
+  uint64_t x;
+
+  memcpy(&x, p, sizeof(x));
+
+  return (x * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+}
+
+int64_t hash_index_size(int64_t old_sz, int64_t stride) {
+  return sizeof(uint32_t) << hash_index_bits(old_sz, stride);
+}
+
+void hash_index_build(hash_index_t *hi, uint32_t *table, const uint8_t *old,
+                      int64_t old_sz, int64_t stride) {
+  uint32_t *slot;
+  int64_t p;
+
+  hi->table = table;
+  hi->bits = hash_index_bits(old_sz, stride);
+  hi->stride = stride;
+
+  memset(table, 0xff, sizeof(uint32_t) << hi->bits);
+
+  for (p = 0; p + HASH_INDEX_KEY_LEN <= old_sz; p += stride) {
+    slot = &table[hash_index_key(old + p, hi->bits)];
+    if (*slot == HASH_INDEX_EMPTY) {
+      *slot = p;
+    }
+  }
+}
+
+int64_t hash_index_search(const hash_index_t *hi, const uint8_t *old,
+                          int64_t old_sz, const uint8_t *new, int64_t new_sz,
+                          int64_t *pos) {
+  int64_t best, len, p, j;
+
+  best = 0;
+  *pos = 0;
+
+  // an anchor at new[j] means the match starts j bytes before it in old
+  for (j = 0; j < hi->stride && j + HASH_INDEX_KEY_LEN <= new_sz; j++) {
+    p = hi->table[hash_index_key(new + j, hi->bits)];
+    if (p == HASH_INDEX_EMPTY || p < j) {
+      continue;
+    }
+
+    len = matchlen(old + p - j, old_sz - (p - j), new, new_sz);
+    if (len > best) {
+      best = len;
+      *pos = p - j;
+    }
+  }
+
+  return best;
+}
@@ -0,0 +1,68 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_HASH_INDEX_H_
+#define _BSDIFF_HASH_INDEX_H_
+
+#include <stdint.h>
+
+#define HASH_INDEX_KEY_LEN 8
+#define HASH_INDEX_EMPTY UINT32_MAX
+
+/**
+ * Hash-anchored index of old. Every stride-th position of old is hashed by
+ * the 8 bytes starting there, and the table keeps the first position of each
+ * hash. A lookup hashes the first stride positions of new, so any match at
+ * least stride + 7 bytes long hits one of the anchors inside it. Candidates
+ * are verified with matchlen.
+ *
+ * The table has a power-of-two number of uint32_t slots, at least one per
+ * anchor and at most two, so with a stride of 4 it takes 1 to 2 bytes per
+ * byte of old. Old must be smaller than 4GB.
+ */
+typedef struct hash_index {
+  uint32_t *table;
+  int bits;
+  int64_t stride;
+} hash_index_t;
+
+// hash of the HASH_INDEX_KEY_LEN bytes at p, in [0, 2^bits)
+uint64_t hash_index_key(const uint8_t *p, int bits);
+
+// number of bytes of the table for old_sz bytes of old
+int64_t hash_index_size(int64_t old_sz, int64_t stride);
+
+// table must hold hash_index_size bytes
+void hash_index_build(hash_index_t *hi, uint32_t *table, const uint8_t *old,
+                      int64_t old_sz, int64_t stride);
+
+int64_t hash_index_search(const hash_index_t *hi, const uint8_t *old,
+                          int64_t old_sz, const uint8_t *new, int64_t new_sz,
+                          int64_t *pos);
+
+#endif // _BSDIFF_HASH_INDEX_H_
@@ -2,7 +2,62 @@
 #define _BSDIFF_LIB_IMPL_HELPER_
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define FASTLZ_BUFFER_SIZE (512) /*  105% of INPUT_SIZE for safety reasons */
 #define FASTLZ_INPUT_SIZE (FASTLZ_BUFFER_SIZE / 21 * 20)
 
+/* size field + end flag + payload */
+#define CHUNK_FRAME_SIZE                                                       \
+  (sizeof(uint64_t) + sizeof(uint8_t) + FASTLZ_BUFFER_SIZE)
+#define BSDIFF_WRITE_BUFFER_SIZE (64 * 1024)
+
+#define BSDIFF_INDEX_STRIDE (4)
+
+/* bytes of new bsdiff_streaming diffs at a time */
+#define BSDIFF_NEW_WINDOW (1024 * 1024)
+
+/* smallest window of old a memory budget can shrink the index to */
+#define BSDIFF_WINDOW_MIN (64 * 1024)
+/* the coarse index that places the windows takes this fraction of the
+ * budget, and places them to a quarter window
+ */
+#define COARSE_SHARE (8)
+#define COARSE_SPLIT (4)
+/* shorter matches through its anchors are taken for chance */
+#define COARSE_MATCH_MIN (32)
+
+/* shorter runs of zeros are left to the codec */
+#define ZERO_RUN_MIN (64)
+/* the matcher jumps over runs of one byte at least this long */
+#define RUN_SKIP (4096)
+
+/* bsdiff_estimate diffs this many windows of new, of this many bytes, and
+ * times the suffix array engines on a slice of old
+ */
+#define ESTIMATE_WINDOWS (32)
+#define ESTIMATE_WINDOW (16 * 1024)
+#define ESTIMATE_SLICE (512 * 1024)
+/* searches timed on each index */
+#define ESTIMATE_PROBES (16384)
+#define ESTIMATE_PROBE (64)
+
+/* positions of new the lookahead searches past a match, at most */
+#define LOOKAHEAD_MAX (32)
+/* and the bytes of patch it counts a block as, header and chunk frame */
+#define BLOCK_COST (40)
+
+/* with a time budget, the clock is read once per this many searches */
+#define EFFORT_CLOCK_PROBES (1024)
+
+/* flash page size the apply cost of a patch is counted in by default */
+#define BSDIFF_PAGE_SIZE (4096)
+
+/* threads bsdiff_bundle starts at most */
+#define BSDIFF_THREADS_MAX (64)
+
+/* bsdiff_sa_update sorts by this many bytes before it refines the order */
+#define SA_UPDATE_PREFIX (32)
+/* and compares neighbours this far to tell whether a tie is already sorted */
+#define SA_UPDATE_VERIFY (1024)
+
 #endif // _BSDIFF_LIB_IMPL_HELPER_
@@ -0,0 +1,83 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "helper.h"
+#include "in_place.h"
+
+void in_place_init(in_place_t *ip, int64_t old_sz, int64_t new_sz) {
+  ip->new_sz = new_sz;
+  ip->old_cursor = 0;
+  ip->new_cursor = 0;
+  ip->lag = 0;
+  ip->end = old_sz;
+  ip->mark = 0;
+}
+
+int in_place_safe(const in_place_t *ip) {
+  /* The diff string is read and written front to back, so reading at or
+   * after new_cursor never reads what it has written itself.
+   */
+  return ip->old_cursor >= ip->mark &&
+         ip->old_cursor - ip->lag >= ip->new_cursor;
+}
+
+int in_place_readable(const in_place_t *ip, int64_t len) {
+  return len == 0 ||
+         (in_place_safe(ip) && ip->old_cursor - ip->lag + len <= ip->end);
+}
+
+int64_t in_place_room(const in_place_t *ip, int64_t len) {
+  int64_t tail;
+
+  tail = ip->old_cursor - ip->lag;
+  if (len == 0 || ip->new_cursor + len <= tail) {
+    return 0;
+  }
+
+  return MAX(ip->new_cursor + len - tail, ip->new_sz - ip->end);
+}
+
+void in_place_diff(in_place_t *ip, int64_t len) {
+  ip->old_cursor += len;
+  ip->new_cursor += len;
+}
+
+void in_place_extra(in_place_t *ip, int64_t len, int64_t shift) {
+  if (len == 0) {
+    return;
+  }
+
+  // the old before old_cursor was not moved, and is overwritten in part
+  ip->lag += len - shift;
+  ip->end += shift;
+  ip->old_cursor += len;
+  ip->new_cursor += len;
+  ip->mark = ip->old_cursor;
+}
+
+void in_place_skip(in_place_t *ip, int64_t len) { ip->old_cursor += len; }
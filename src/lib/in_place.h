@@ -0,0 +1,75 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_IN_PLACE_H_
+#define _BSDIFF_IN_PLACE_H_
+
+#include <stdint.h>
+
+/**
+ * Where old really lies while bspatch builds new over it. The patch format
+ * moves the rest of old past each extra string, at old_cursor, but bspatch
+ * moves it only when the extra string would overwrite it, and then as far as
+ * the end of new, so that one move makes room for the extra strings after it
+ * too. Until then old lags behind the place the format has it at.
+ *
+ * A diff string can only read old where it has not been overwritten by new
+ * yet, nor been left behind by a move: at mark or after it. The diff keeps
+ * to that when it is asked to, in bsdiff_config_t.in_place, and bspatch
+ * checks it.
+ */
+typedef struct in_place {
+  int64_t new_sz;
+  int64_t old_cursor; // as the format counts it
+  int64_t new_cursor;
+  int64_t lag;  // old_cursor is at old_cursor - lag in the image
+  int64_t end;  // where the rest of old ends in the image
+  int64_t mark; // old before this is gone
+} in_place_t;
+
+void in_place_init(in_place_t *ip, int64_t old_sz, int64_t new_sz);
+
+/* whether old is still there at old_cursor */
+int in_place_safe(const in_place_t *ip);
+
+/* whether old still holds the len bytes a diff string would read next */
+int in_place_readable(const in_place_t *ip, int64_t len);
+
+/* how far the rest of old, from old_cursor - lag to end, has to be moved
+ * before an extra string of len bytes can be written
+ */
+int64_t in_place_room(const in_place_t *ip, int64_t len);
+
+void in_place_diff(in_place_t *ip, int64_t len);
+
+/* moves past an extra string after the rest of old was moved by shift */
+void in_place_extra(in_place_t *ip, int64_t len, int64_t shift);
+
+void in_place_skip(in_place_t *ip, int64_t len);
+
+#endif // _BSDIFF_IN_PLACE_H_
@@ -0,0 +1,342 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "bsearch.h"
+#include "fm_index.h"
+#include "helper.h"
+#include "match_index.h"
+#include "qsufsort.h"
+
+static int64_t index_stride(const bsdiff_config_t *config) {
+  if (config->engine == BSDIFF_ENGINE_SPARSE_SUFFIX_ARRAY) {
+    // a symbol of qsufsort_sparse is one uint64_t
+    return MIN(MAX(config->index_stride, 1), 8);
+  }
+
+  return MAX(config->index_stride, 1);
+}
+
+// the hash and FM-index engines store uint32_t positions
+static uint8_t match_index_engine(const bsdiff_config_t *config,
+                                  int64_t old_sz) {
+  if ((config->engine == BSDIFF_ENGINE_HASH ||
+       config->engine == BSDIFF_ENGINE_FM_INDEX) &&
+      old_sz >= HASH_INDEX_EMPTY) {
+    return BSDIFF_ENGINE_SUFFIX_ARRAY;
+  }
+
+  return config->engine;
+}
+
+int64_t match_index_window(const bsdiff_config_t *config, int64_t budget) {
+  if (config->engine == BSDIFF_ENGINE_HASH) {
+    // at most two uint32_t slots per anchor
+    return budget / (2 * sizeof(uint32_t)) * index_stride(config);
+  }
+
+  if (config->engine == BSDIFF_ENGINE_SPARSE_SUFFIX_ARRAY) {
+    // as below, for one suffix in index_stride and the empty one
+    return (budget / (2 * sizeof(int64_t)) - 2) * index_stride(config);
+  }
+
+  /* The suffix array and the qsufsort buffer, both one int64_t per byte. The
+   * FM-index is built from them, so its peak is the same.
+   */
+  return budget / (2 * sizeof(int64_t)) - 1;
+}
+
+static int build_hash(match_index_t *index, bsdiff_stream_t *stream,
+                      const bsdiff_config_t *config) {
+  uint32_t *table;
+
+  table = stream->malloc(
+      hash_index_size(index->old_sz, index_stride(config)));
+  if (table == NULL) {
+    return -1;
+  }
+
+  hash_index_build(&index->hash, table, index->old, index->old_sz,
+                   index_stride(config));
+
+  return 0;
+}
+
+// entries of the suffix array, and of the qsufsort buffer
+static int64_t sa_length(int64_t old_sz, int64_t stride) {
+  return stride == 1 ? old_sz + 1 : old_sz / stride + 2;
+}
+
+static void sort_suffixes(int64_t *sa, int64_t *buffer, const uint8_t *old,
+                          int64_t old_sz, int64_t stride,
+                          const qsufsort_filter_t *filter) {
+  if (stride == 1) {
+    qsufsort(sa, buffer, old, old_sz, filter);
+  } else {
+    qsufsort_sparse(sa, buffer, old, old_sz, stride, filter);
+  }
+}
+
+static int build_suffix_array(int64_t **sa, bsdiff_stream_t *stream,
+                              const uint8_t *old, int64_t old_sz,
+                              int64_t stride,
+                              const qsufsort_filter_t *filter) {
+  int64_t *buffer;
+  int64_t n;
+
+  n = sa_length(old_sz, stride);
+  *sa = stream->malloc(n * sizeof(int64_t));
+  buffer = stream->malloc(n * sizeof(int64_t));
+  if (*sa == NULL || buffer == NULL) {
+    stream->free(*sa);
+    stream->free(buffer);
+    *sa = NULL;
+    return -1;
+  }
+
+  sort_suffixes(*sa, buffer, old, old_sz, stride, filter);
+  stream->free(buffer);
+
+  return 0;
+}
+
+/* The suffix array and the qsufsort buffer are one allocation, which the
+ * sorted suffixes then fill with their keys. The peak is the same as without.
+ */
+static int build_entries(match_index_t *index, bsdiff_stream_t *stream,
+                         const qsufsort_filter_t *filter) {
+  int64_t *sa;
+  int64_t n;
+
+  n = sa_length(index->old_sz, index->stride);
+  sa = stream->malloc(2 * n * sizeof(int64_t));
+  if (sa == NULL) {
+    return -1;
+  }
+
+  sort_suffixes(sa, sa + n, index->old, index->old_sz, index->stride, filter);
+  index->entries = sa_entries(sa, n, index->old, index->old_sz);
+
+  return 0;
+}
+
+static int sort_index(match_index_t *index, bsdiff_stream_t *stream,
+                      const bsdiff_config_t *config,
+                      const qsufsort_filter_t *filter) {
+  if (config->search_keys) {
+    return build_entries(index, stream, filter);
+  }
+
+  return build_suffix_array(&index->sa, stream, index->old, index->old_sz,
+                            index->stride, filter);
+}
+
+static int build_fm_index(match_index_t *index, bsdiff_stream_t *stream) {
+  uint8_t *text;
+  int64_t *sa;
+  int64_t i;
+  int ret;
+
+  text = stream->malloc(index->old_sz + 1);
+  if (text == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < index->old_sz; i++) {
+    text[i] = index->old[index->old_sz - 1 - i];
+  }
+
+  ret = build_suffix_array(&sa, stream, text, index->old_sz, 1, NULL);
+  if (ret == 0) {
+    index->fm_memory = stream->malloc(fm_index_size(index->old_sz));
+    if (index->fm_memory != NULL) {
+      fm_index_build(&index->fm, index->fm_memory, text, index->old_sz, sa);
+    } else {
+      ret = -1;
+    }
+    stream->free(sa);
+  }
+  stream->free(text);
+
+  return ret;
+}
+
+// bitmap of the hashes of every HASH_INDEX_KEY_LEN bytes of new
+static int build_filter(qsufsort_filter_t *filter, bsdiff_stream_t *stream,
+                        const uint8_t *new, int64_t new_sz) {
+  uint8_t *keep;
+  uint64_t bit;
+  int64_t p;
+
+  for (filter->bits = 3; ((int64_t)1 << filter->bits) < new_sz * 8;
+       filter->bits++) {
+  }
+
+  keep = stream->malloc((int64_t)1 << (filter->bits - 3));
+  if (keep == NULL) {
+    return -1;
+  }
+  memset(keep, 0, (int64_t)1 << (filter->bits - 3));
+
+  for (p = 0; p + HASH_INDEX_KEY_LEN <= new_sz; p++) {
+    bit = hash_index_key(new + p, filter->bits);
+    keep[bit >> 3] |= 1 << (bit & 7);
+  }
+  filter->keep = keep;
+
+  return 0;
+}
+
+static int build_sorted(match_index_t *index, bsdiff_stream_t *stream,
+                        const bsdiff_config_t *config, const uint8_t *new,
+                        int64_t new_sz) {
+  qsufsort_filter_t filter;
+  int ret;
+
+  if (!config->lazy_sort || new == NULL) {
+    return sort_index(index, stream, config, NULL);
+  }
+
+  if (build_filter(&filter, stream, new, new_sz) != 0) {
+    return -1;
+  }
+  ret = sort_index(index, stream, config, &filter);
+  stream->free((void *)filter.keep);
+
+  return ret;
+}
+
+int match_index_build(match_index_t *index, bsdiff_stream_t *stream,
+                      const bsdiff_config_t *config, const uint8_t *old,
+                      int64_t old_sz, const uint8_t *new, int64_t new_sz) {
+  index->engine = match_index_engine(config, old_sz);
+  index->old = old;
+  index->old_sz = old_sz;
+  index->sa = NULL;
+  index->entries = NULL;
+  index->hash.table = NULL;
+  index->fm_memory = NULL;
+  index->stride = 1;
+  index->borrowed = 0;
+
+  switch (index->engine) {
+  case BSDIFF_ENGINE_HASH:
+    return build_hash(index, stream, config);
+  case BSDIFF_ENGINE_FM_INDEX:
+    return build_fm_index(index, stream);
+  case BSDIFF_ENGINE_SPARSE_SUFFIX_ARRAY:
+    index->stride = index_stride(config);
+    return build_sorted(index, stream, config, new, new_sz);
+  default:
+    return build_sorted(index, stream, config, new, new_sz);
+  }
+}
+
+static int64_t sa_search(const match_index_t *index, const uint8_t *new,
+                         int64_t new_sz, int64_t end, int64_t *pos) {
+  if (index->entries != NULL) {
+    return bsearch_entries(index->entries, index->old, index->old_sz, new,
+                           new_sz, 0, end, pos);
+  }
+
+  return bsearch(index->sa, index->old, index->old_sz, new, new_sz, 0, end,
+                 pos);
+}
+
+/* A match starting anywhere in old has a sorted suffix within its first
+ * stride bytes, so search from each of the first stride positions of new
+ * and verify the candidate from where it would start.
+ */
+static int64_t sparse_search(const match_index_t *index, const uint8_t *new,
+                             int64_t new_sz, int64_t *pos) {
+  int64_t best, len, p, j, n;
+
+  n = (index->old_sz + index->stride - 1) / index->stride;
+  best = 0;
+  *pos = 0;
+
+  for (j = 0; j < index->stride && j < new_sz; j++) {
+    sa_search(index, new + j, new_sz - j, n, &p);
+    if (p < j) {
+      continue;
+    }
+
+    len = matchlen(index->old + p - j, index->old_sz - (p - j), new, new_sz);
+    if (len > best) {
+      best = len;
+      *pos = p - j;
+    }
+  }
+
+  return best;
+}
+
+int64_t match_index_search(const match_index_t *index, const uint8_t *new,
+                           int64_t new_sz, int64_t *pos) {
+  switch (index->engine) {
+  case BSDIFF_ENGINE_HASH:
+    return hash_index_search(&index->hash, index->old, index->old_sz, new,
+                             new_sz, pos);
+  case BSDIFF_ENGINE_FM_INDEX:
+    return fm_index_search(&index->fm, index->old, index->old_sz, new, new_sz,
+                           pos);
+  case BSDIFF_ENGINE_SPARSE_SUFFIX_ARRAY:
+    return sparse_search(index, new, new_sz, pos);
+  default:
+    return sa_search(index, new, new_sz, index->old_sz, pos);
+  }
+}
+
+void match_index_use_sa(match_index_t *index, const uint8_t *old,
+                        int64_t old_sz, const int64_t *sa) {
+  index->engine = BSDIFF_ENGINE_SUFFIX_ARRAY;
+  index->old = old;
+  index->old_sz = old_sz;
+  index->sa = (int64_t *)sa;
+  index->entries = NULL;
+  index->hash.table = NULL;
+  index->fm_memory = NULL;
+  index->stride = 1;
+  index->borrowed = 1;
+}
+
+void match_index_free(match_index_t *index, bsdiff_stream_t *stream) {
+  if (index->sa != NULL && !index->borrowed) {
+    stream->free(index->sa);
+  }
+  if (index->entries != NULL) {
+    stream->free(index->entries);
+  }
+  if (index->hash.table != NULL) {
+    stream->free(index->hash.table);
+  }
+  if (index->fm_memory != NULL) {
+    stream->free(index->fm_memory);
+  }
+}
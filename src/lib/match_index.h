@@ -0,0 +1,78 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_MATCH_INDEX_H_
+#define _BSDIFF_MATCH_INDEX_H_
+
+#include <stdint.h>
+
+#include <bsdiff/legacy/bsdiff.h>
+
+#include "bsearch.h"
+#include "fm_index.h"
+#include "hash_index.h"
+
+/**
+ * The index of old approximate_match searches for the longest match of new.
+ * config->engine picks the structure behind it, they all answer the same
+ * query: the length of the longest prefix of new found in old, and where.
+ */
+typedef struct match_index {
+  uint8_t engine; // BSDIFF_ENGINE_*
+  const uint8_t *old;
+  int64_t old_sz;
+
+  int64_t *sa;          // BSDIFF_ENGINE_SUFFIX_ARRAY and the sparse one
+  sa_entry_t *entries;  // or the same with keys, config->search_keys
+  int64_t stride;       // positions of old per suffix in sa
+  hash_index_t hash;    // BSDIFF_ENGINE_HASH
+  fm_index_t fm;        // BSDIFF_ENGINE_FM_INDEX
+  void *fm_memory;      // the one allocation fm is carved from
+  uint8_t borrowed;     // sa belongs to the caller
+} match_index_t;
+
+// largest old whose index fits in budget bytes
+int64_t match_index_window(const bsdiff_config_t *config, int64_t budget);
+
+/* new is what will be searched for, if known, so config->lazy_sort can leave
+ * the rest of old unsorted. It may be NULL.
+ */
+int match_index_build(match_index_t *index, bsdiff_stream_t *stream,
+                      const bsdiff_config_t *config, const uint8_t *old,
+                      int64_t old_sz, const uint8_t *new, int64_t new_sz);
+
+int64_t match_index_search(const match_index_t *index, const uint8_t *new,
+                           int64_t new_sz, int64_t *pos);
+
+// searches the suffix array sa of old, which is not freed with the index
+void match_index_use_sa(match_index_t *index, const uint8_t *old,
+                        int64_t old_sz, const int64_t *sa);
+
+void match_index_free(match_index_t *index, bsdiff_stream_t *stream);
+
+#endif // _BSDIFF_MATCH_INDEX_H_
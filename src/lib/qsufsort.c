@@ -26,93 +26,185 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stddef.h>
+
+#include "hash_index.h"
 #include "qsufsort.h"
 
+/* A pivot from a position scrambled out of the group's bounds. The groups
+ * left over from long runs of one byte hold their keys in an order that
+ * defeats a fixed middle pivot and makes the split quadratic.
+ */
+static int64_t pivot(int64_t start, int64_t len) {
+  uint64_t x;
+
+  x = ((uint64_t)start << 32 ^ (uint64_t)len) * 0x9e3779b97f4a7c15ULL;
+  return start + (int64_t)((x >> 11) % (uint64_t)len);
+}
+
 static void split(int64_t *I, int64_t *V, int64_t start, int64_t len,
                   int64_t h) {
   int64_t i, j, k, x, tmp, jj, kk;
 
-  if (len < 16) {
-    for (k = start; k < start + len; k += j) {
-      j = 1;
-      x = V[I[k] + h];
-      for (i = 1; k + i < start + len; i++) {
-        if (V[I[k + i] + h] < x) {
-          x = V[I[k + i] + h];
-          j = 0;
-        };
-        if (V[I[k + i] + h] == x) {
-          tmp = I[k + j];
-          I[k + j] = I[k + i];
-          I[k + i] = tmp;
-          j++;
-        };
+  /* The groups must be finished left to right, so only the upper part can
+   * be split in this loop instead of recursively. That keeps the stack from
+   * growing with every bad pivot.
+   */
+  while (len >= 16) {
+    x = V[I[pivot(start, len)] + h];
+    jj = 0;
+    kk = 0;
+    for (i = start; i < start + len; i++) {
+      if (V[I[i] + h] < x)
+        jj++;
+      if (V[I[i] + h] == x)
+        kk++;
+    };
+    jj += start;
+    kk += jj;
+
+    i = start;
+    j = 0;
+    k = 0;
+    while (i < jj) {
+      if (V[I[i] + h] < x) {
+        i++;
+      } else if (V[I[i] + h] == x) {
+        tmp = I[i];
+        I[i] = I[jj + j];
+        I[jj + j] = tmp;
+        j++;
+      } else {
+        tmp = I[i];
+        I[i] = I[kk + k];
+        I[kk + k] = tmp;
+        k++;
       };
-      for (i = 0; i < j; i++)
-        V[I[k + i]] = k + j - 1;
-      if (j == 1)
-        I[k] = -1;
     };
-    return;
-  };
 
-  x = V[I[start + len / 2] + h];
-  jj = 0;
-  kk = 0;
-  for (i = start; i < start + len; i++) {
-    if (V[I[i] + h] < x)
-      jj++;
-    if (V[I[i] + h] == x)
-      kk++;
-  };
-  jj += start;
-  kk += jj;
-
-  i = start;
-  j = 0;
-  k = 0;
-  while (i < jj) {
-    if (V[I[i] + h] < x) {
-      i++;
-    } else if (V[I[i] + h] == x) {
-      tmp = I[i];
-      I[i] = I[jj + j];
-      I[jj + j] = tmp;
-      j++;
-    } else {
-      tmp = I[i];
-      I[i] = I[kk + k];
-      I[kk + k] = tmp;
-      k++;
+    while (jj + j < kk) {
+      if (V[I[jj + j] + h] == x) {
+        j++;
+      } else {
+        tmp = I[jj + j];
+        I[jj + j] = I[kk + k];
+        I[kk + k] = tmp;
+        k++;
+      };
     };
-  };
 
-  while (jj + j < kk) {
-    if (V[I[jj + j] + h] == x) {
-      j++;
-    } else {
-      tmp = I[jj + j];
-      I[jj + j] = I[kk + k];
-      I[kk + k] = tmp;
-      k++;
+    if (jj > start)
+      split(I, V, start, jj - start, h);
+
+    for (i = 0; i < kk - jj; i++)
+      V[I[jj + i]] = kk - 1;
+    if (jj == kk - 1)
+      I[jj] = -1;
+
+    len = start + len - kk;
+    start = kk;
+  }
+
+  for (k = start; k < start + len; k += j) {
+    j = 1;
+    x = V[I[k] + h];
+    for (i = 1; k + i < start + len; i++) {
+      if (V[I[k + i] + h] < x) {
+        x = V[I[k + i] + h];
+        j = 0;
+      };
+      if (V[I[k + i] + h] == x) {
+        tmp = I[k + j];
+        I[k + j] = I[k + i];
+        I[k + i] = tmp;
+        j++;
+      };
     };
+    for (i = 0; i < j; i++)
+      V[I[k + i]] = k + j - 1;
+    if (j == 1)
+      I[k] = -1;
   };
+}
 
-  if (jj > start)
-    split(I, V, start, jj - start, h);
+static int filter_keep(const qsufsort_filter_t *filter, const uint8_t *old,
+                       int64_t old_sz, int64_t p) {
+  uint64_t bit;
 
-  for (i = 0; i < kk - jj; i++)
-    V[I[jj + i]] = kk - 1;
-  if (jj == kk - 1)
-    I[jj] = -1;
+  if (p + HASH_INDEX_KEY_LEN > old_sz) {
+    return 1;
+  }
+
+  bit = hash_index_key(old + p, filter->bits);
+
+  return (filter->keep[bit >> 3] >> (bit & 7)) & 1;
+}
+
+/* Marks the unsorted groups filter does not keep as sorted, giving their
+ * members the distinct ranks of their current slots.
+ */
+static void filter_groups(int64_t *I, int64_t *V, int64_t n,
+                          const uint8_t *old, int64_t old_sz, int64_t stride,
+                          const qsufsort_filter_t *filter) {
+  int64_t i, j, len;
+
+  for (i = 0; i < n + 1; i += len) {
+    if (I[i] < 0) {
+      len = -I[i];
+      continue;
+    }
+
+    len = V[I[i]] + 1 - i;
+    if (!filter_keep(filter, old, old_sz, I[i] * stride)) {
+      for (j = 0; j < len; j++) {
+        V[I[i + j]] = i + j;
+      }
+      I[i] = -len;
+    }
+  }
+}
+
+/* Sorts the n + 1 suffixes by prefix doubling from their ranks in V by the
+ * first h symbols, each symbol is stride bytes of old.
+ */
+static void double_sort(int64_t *I, int64_t *V, int64_t n, int64_t h,
+                        const uint8_t *old, int64_t old_sz, int64_t stride,
+                        const qsufsort_filter_t *filter) {
+  int64_t i, len;
+
+  for (; I[0] != -(n + 1); h += h) {
+    // the groups are sorted by their first h * stride bytes
+    if (filter != NULL && h * stride >= HASH_INDEX_KEY_LEN) {
+      filter_groups(I, V, n, old, old_sz, stride, filter);
+      filter = NULL;
+    }
+
+    len = 0;
+    for (i = 0; i < n + 1;) {
+      if (I[i] < 0) {
+        len -= I[i];
+        i -= I[i];
+      } else {
+        if (len)
+          I[i - len] = -len;
+        len = V[I[i]] + 1 - i;
+        split(I, V, i, len, h);
+        i += len;
+        len = 0;
+      };
+    };
+    if (len)
+      I[i - len] = -len;
+  };
 
-  if (start + len > kk)
-    split(I, V, kk, start + len - kk, h);
+  for (i = 0; i < n + 1; i++)
+    I[V[i]] = i;
 }
 
-void qsufsort(int64_t *I, int64_t *V, const uint8_t *old, int64_t old_sz) {
+void qsufsort(int64_t *I, int64_t *V, const uint8_t *old, int64_t old_sz,
+              const qsufsort_filter_t *filter) {
   int64_t buckets[256];
-  int64_t i, h, len;
+  int64_t i;
 
   for (i = 0; i < 256; i++)
     buckets[i] = 0;
@@ -135,25 +227,46 @@ void qsufsort(int64_t *I, int64_t *V, const uint8_t *old, int64_t old_sz) {
       I[buckets[i]] = -1;
   I[0] = -1;
 
-  for (h = 1; I[0] != -(old_sz + 1); h += h) {
-    len = 0;
-    for (i = 0; i < old_sz + 1;) {
-      if (I[i] < 0) {
-        len -= I[i];
-        i -= I[i];
-      } else {
-        if (len)
-          I[i - len] = -len;
-        len = V[I[i]] + 1 - i;
-        split(I, V, i, len, h);
-        i += len;
-        len = 0;
-      };
-    };
-    if (len)
-      I[i - len] = -len;
-  };
+  double_sort(I, V, old_sz, 1, old, old_sz, 1, filter);
+}
 
-  for (i = 0; i < old_sz + 1; i++)
-    I[V[i]] = i;
+void qsufsort_sparse(int64_t *I, int64_t *V, const uint8_t *old,
+                     int64_t old_sz, int64_t stride,
+                     const qsufsort_filter_t *filter) {
+  uint64_t key;
+  int64_t i, j, n;
+
+  /* Every stride bytes of old make one symbol, compared as a big-endian
+   * integer, so the suffixes of the symbols sort like the suffixes of old at
+   * those positions. The last symbol is padded with zeros and the sentinel
+   * after it sorts it before the full symbols it ties with.
+   */
+  n = (old_sz + stride - 1) / stride;
+  for (i = 0; i < n; i++) {
+    key = 0;
+    for (j = i * stride; j < (i + 1) * stride; j++) {
+      key = key << 8 | (j < old_sz ? old[j] : 0);
+    }
+    V[i] = key ^ ((uint64_t)1 << 63);
+    I[i + 1] = i;
+  }
+
+  // with h = 0 split compares the keys themselves and leaves their ranks
+  I[0] = n;
+  V[n] = 0;
+  if (n > 0) {
+    split(I, V, 1, n, 0);
+  }
+  I[0] = -1;
+
+  double_sort(I, V, n, 1, old, old_sz, stride, filter);
+
+  for (i = 0; i < n + 1; i++)
+    I[i] = I[i] * stride;
+  I[0] = old_sz;
+}
+
+void qsufsort_refine(int64_t *I, int64_t *V, const uint8_t *old,
+                     int64_t old_sz, int64_t h) {
+  double_sort(I, V, old_sz, h, old, old_sz, 1, NULL);
 }
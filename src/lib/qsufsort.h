@@ -31,6 +31,35 @@
 
 #include <stdint.h>
 
-void qsufsort(int64_t *I, int64_t *V, const uint8_t *old, int64_t old_sz);
+/**
+ * Lazy sorting: a suffix of old whose first HASH_INDEX_KEY_LEN bytes hash to
+ * a clear bit of keep is never a match that long, so once the suffixes are
+ * sorted to that length its group is left in whatever order it is in. A
+ * binary search still finds every match of at least that length.
+ */
+typedef struct qsufsort_filter {
+  const uint8_t *keep; // bitmap indexed by hash_index_key(p, bits)
+  int bits;
+} qsufsort_filter_t;
+
+// filter may be NULL to sort every suffix
+void qsufsort(int64_t *I, int64_t *V, const uint8_t *old, int64_t old_sz,
+              const qsufsort_filter_t *filter);
+
+/* Finishes a suffix array already sorted by the first h bytes of each suffix.
+ * I holds the groups of equal h-byte prefixes in order, a group of one as -1,
+ * and V[i] the index in I of the last member of the group of suffix i, with
+ * V[old_sz] = 0 and I[0] = -1 for the empty suffix, as qsufsort leaves them
+ * after its first pass.
+ */
+void qsufsort_refine(int64_t *I, int64_t *V, const uint8_t *old,
+                     int64_t old_sz, int64_t h);
+
+/* Sorts only the suffixes at multiples of stride, 1 to 8. I and V hold
+ * old_sz / stride + 2 entries, I[0] is the empty suffix.
+ */
+void qsufsort_sparse(int64_t *I, int64_t *V, const uint8_t *old,
+                     int64_t old_sz, int64_t stride,
+                     const qsufsort_filter_t *filter);
 
 #endif // _BSDIFF_QSUFSORT_H_
\ No newline at end of file
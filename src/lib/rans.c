@@ -0,0 +1,230 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "rans.h"
+
+/* Byte-wise rANS as described by Fabian Giesen (ryg_rans). The state is kept
+ * in [RANS_L, RANS_L << 8), so the coder emits and consumes whole bytes.
+ */
+#define RANS_L (1u << 23)
+#define RANS_MASK (RANS_PROB_SCALE - 1)
+
+static void normalize_freq(const uint32_t *cnt, int64_t total,
+                           uint32_t *freq) {
+  int64_t sum;
+  int i, max_sym;
+
+  sum = 0;
+  max_sym = 0;
+  for (i = 0; i < 256; i++) {
+    freq[i] = 0;
+    if (cnt[i] == 0) {
+      continue;
+    }
+
+    // every present symbol needs at least one slot
+    freq[i] = (uint32_t)((int64_t)cnt[i] * RANS_PROB_SCALE / total);
+    if (freq[i] == 0) {
+      freq[i] = 1;
+    }
+    sum += freq[i];
+
+    if (cnt[i] > cnt[max_sym]) {
+      max_sym = i;
+    }
+  }
+
+  if (sum < RANS_PROB_SCALE) {
+    freq[max_sym] += RANS_PROB_SCALE - sum;
+    return;
+  }
+
+  /* The rounding up above may overshoot, take the slots back one by one. It
+   * always terminates because there are at most 256 symbols.
+   */
+  while (sum > RANS_PROB_SCALE) {
+    for (i = 0; i < 256 && sum > RANS_PROB_SCALE; i++) {
+      if (freq[i] > 1) {
+        freq[i]--;
+        sum--;
+      }
+    }
+  }
+}
+
+int64_t rans_compress(const uint8_t *in, int64_t in_sz, uint8_t *out,
+                      int64_t out_sz) {
+  uint32_t cnt[256], freq[256], start[256];
+  uint8_t *ptr, *end;
+  uint32_t x, x_max, f;
+  int64_t i, hdr;
+  int n, s;
+
+  if (in_sz <= 0 || in_sz > UINT16_MAX || out_sz < 3) {
+    return 0;
+  }
+
+  memset(cnt, 0, sizeof(cnt));
+  for (i = 0; i < in_sz; i++) {
+    cnt[in[i]]++;
+  }
+  normalize_freq(cnt, in_sz, freq);
+
+  n = 0;
+  for (s = 0; s < 256; s++) {
+    if (freq[s] != 0) {
+      n++;
+    }
+  }
+
+  // write header: raw size, symbol count and the frequency table
+  out[0] = in_sz & 0xff;
+  out[1] = (in_sz >> 8) & 0xff;
+  out[2] = n - 1;
+  hdr = 3;
+
+  f = 0;
+  for (s = 0; s < 256; s++) {
+    start[s] = f;
+    if (freq[s] == 0) {
+      continue;
+    }
+    f += freq[s];
+
+    if (hdr + 3 > out_sz) {
+      return 0;
+    }
+    out[hdr++] = s;
+    if (freq[s] - 1 < 0x80) {
+      out[hdr++] = freq[s] - 1;
+    } else {
+      out[hdr++] = 0x80 | ((freq[s] - 1) & 0x7f);
+      out[hdr++] = (freq[s] - 1) >> 7;
+    }
+  }
+
+  // rANS works as a stack, so encode backwards from the end of out
+  end = out + out_sz;
+  ptr = end;
+  x = RANS_L;
+  for (i = in_sz - 1; i >= 0; i--) {
+    s = in[i];
+    x_max = ((RANS_L >> RANS_PROB_BITS) << 8) * freq[s];
+    while (x >= x_max) {
+      if (ptr <= out + hdr) {
+        return 0;
+      }
+      *--ptr = x & 0xff;
+      x >>= 8;
+    }
+    x = ((x / freq[s]) << RANS_PROB_BITS) + (x % freq[s]) + start[s];
+  }
+
+  // flush the final state
+  if (ptr - (out + hdr) < 4) {
+    return 0;
+  }
+  ptr -= 4;
+  ptr[0] = x & 0xff;
+  ptr[1] = (x >> 8) & 0xff;
+  ptr[2] = (x >> 16) & 0xff;
+  ptr[3] = (x >> 24) & 0xff;
+
+  memmove(out + hdr, ptr, end - ptr);
+
+  return hdr + (end - ptr);
+}
+
+int64_t rans_decompress(const uint8_t *in, int64_t in_sz, uint8_t *out,
+                        int64_t out_sz, rans_table_t *table) {
+  const uint8_t *ptr, *end;
+  uint32_t x, f, sum;
+  int64_t raw_sz, i;
+  int n, k, s;
+
+  if (in_sz < 3) {
+    return -1;
+  }
+
+  raw_sz = in[0] | (in[1] << 8);
+  n = in[2] + 1;
+  if (raw_sz > out_sz) {
+    return -1;
+  }
+
+  // rebuild the decoding table
+  ptr = in + 3;
+  end = in + in_sz;
+  sum = 0;
+  for (k = 0; k < n; k++) {
+    if (end - ptr < 2) {
+      return -1;
+    }
+    s = *ptr++;
+    f = *ptr++;
+    if (f & 0x80) {
+      if (ptr >= end) {
+        return -1;
+      }
+      f = (f & 0x7f) | (*ptr++ << 7);
+    }
+    f++;
+
+    if (sum + f > RANS_PROB_SCALE) {
+      return -1;
+    }
+    table->freq[s] = f;
+    table->start[s] = sum;
+    memset(table->slot + sum, s, f);
+    sum += f;
+  }
+
+  if (sum != RANS_PROB_SCALE || end - ptr < 4) {
+    return -1;
+  }
+
+  x = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+  ptr += 4;
+
+  for (i = 0; i < raw_sz; i++) {
+    s = table->slot[x & RANS_MASK];
+    out[i] = s;
+    x = table->freq[s] * (x >> RANS_PROB_BITS) + (x & RANS_MASK) -
+        table->start[s];
+    while (x < RANS_L) {
+      if (ptr >= end) {
+        return -1;
+      }
+      x = (x << 8) | *ptr++;
+    }
+  }
+
+  return raw_sz;
+}
@@ -0,0 +1,69 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_RANS_H_
+#define _BSDIFF_RANS_H_
+
+#include <stdint.h>
+
+#define RANS_PROB_BITS 10
+#define RANS_PROB_SCALE (1 << RANS_PROB_BITS)
+
+/**
+ * Decoding table of a static order-0 rANS chunk. It is rebuilt for every
+ * chunk, so one table (about 2KB) is all the patching side needs.
+ */
+typedef struct rans_table {
+  uint16_t freq[256];
+  uint16_t start[256];
+  uint8_t slot[RANS_PROB_SCALE]; // slot -> symbol
+} rans_table_t;
+
+/**
+ * Format of a rANS chunk:
+ * +-----------------------------------------+
+ * | raw size (uint16)                       |
+ * +-----------------------------------------+
+ * | symbol count - 1 (uint8)                |
+ * +-----------------------------------------+
+ * | (symbol, freq - 1) pairs, freq as varint |
+ * +-----------------------------------------+
+ * | rans state (uint32) and rans bytes      |
+ * +-----------------------------------------+
+ *
+ * rans_compress returns the compressed size, or 0 if the result does not fit
+ * in out_sz bytes. rans_decompress returns the decompressed size, or -1 if the
+ * chunk is corrupted.
+ */
+int64_t rans_compress(const uint8_t *in, int64_t in_sz, uint8_t *out,
+                      int64_t out_sz);
+
+int64_t rans_decompress(const uint8_t *in, int64_t in_sz, uint8_t *out,
+                        int64_t out_sz, rans_table_t *table);
+
+#endif // _BSDIFF_RANS_H_
@@ -0,0 +1,297 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <bsdiff/legacy/bsdiff.h>
+
+#include "bsearch.h"
+#include "helper.h"
+#include "qsufsort.h"
+
+// suffixes a and b of new by their first SA_UPDATE_PREFIX bytes
+static int prefix_cmp(const uint8_t *new, int64_t new_sz, int64_t a,
+                      int64_t b) {
+  int64_t la, lb;
+  int c;
+
+  la = MIN(SA_UPDATE_PREFIX, new_sz - a);
+  lb = MIN(SA_UPDATE_PREFIX, new_sz - b);
+  if ((c = memcmp(new + a, new + b, MIN(la, lb))) != 0) {
+    return c;
+  }
+
+  return (la > lb) - (la < lb);
+}
+
+// common prefix of suffixes a and b of new, up to SA_UPDATE_VERIFY bytes
+static int64_t verify_len(const uint8_t *new, int64_t new_sz, int64_t a,
+                          int64_t b) {
+  return matchlen(new + a, MIN(SA_UPDATE_VERIFY, new_sz - a), new + b,
+                  MIN(SA_UPDATE_VERIFY, new_sz - b));
+}
+
+// whether suffix a sorts before b, given their verify_len l
+static int sorted_before(const uint8_t *new, int64_t new_sz, int64_t a,
+                         int64_t b, int64_t l) {
+  if (l == SA_UPDATE_VERIFY || l == new_sz - b) {
+    return 0;
+  }
+
+  return l == new_sz - a || new[a + l] < new[b + l];
+}
+
+static void merge_sort(int64_t *items, int64_t *tmp, int64_t n,
+                       const uint8_t *new, int64_t new_sz) {
+  int64_t i, j, k, half;
+
+  if (n < 2) {
+    return;
+  }
+
+  half = n / 2;
+  merge_sort(items, tmp, half, new, new_sz);
+  merge_sort(items + half, tmp, n - half, new, new_sz);
+
+  for (i = 0, j = half, k = 0; k < n; k++) {
+    if (j == n ||
+        (i < half && prefix_cmp(new, new_sz, items[i], items[j]) <= 0)) {
+      tmp[k] = items[i++];
+    } else {
+      tmp[k] = items[j++];
+    }
+  }
+  memcpy(items, tmp, n * sizeof(int64_t));
+}
+
+/* Walks the blocks of patch, skipping over their chunks, and lines new up
+ * with old: src[i] is the byte of old new[i] was diffed against, or -1 when
+ * it is extra.
+ */
+static int align_blocks(const uint8_t *patch, int64_t patch_sz,
+                        int64_t old_sz, int64_t new_sz, int64_t *src) {
+  bsdiff_header_t header;
+  patch_block_t block;
+  int64_t off, new_pos, old_pos, len, i;
+  uint64_t size;
+  uint8_t flag;
+
+  if (patch_sz < (int64_t)sizeof(header)) {
+    return -1;
+  }
+  memcpy(&header, patch, sizeof(header));
+  if (memcmp(header.signature, BSDIFF_SIGNATURE, BSDIFF_SIGNATURE_LEN) != 0 ||
+      header.new_sz != (uint64_t)new_sz) {
+    return -1;
+  }
+
+  off = sizeof(header);
+  new_pos = 0;
+  old_pos = 0;
+  while (new_pos < new_sz) {
+    if (patch_sz - off < (int64_t)sizeof(block)) {
+      return -1;
+    }
+    memcpy(&block, patch + off, sizeof(block));
+    off += sizeof(block);
+
+    if (block.len_diff > (uint64_t)(new_sz - new_pos) ||
+        block.len_extra > (uint64_t)(new_sz - new_pos) - block.len_diff) {
+      return -1;
+    }
+    len = block.len_diff + block.len_extra;
+
+    for (i = 0; i < (int64_t)block.len_diff; i++) {
+      src[new_pos + i] =
+          old_pos + i >= 0 && old_pos + i < old_sz ? old_pos + i : -1;
+    }
+    for (; i < len; i++) {
+      src[new_pos + i] = -1;
+    }
+    new_pos += len;
+    old_pos += block.len_diff + (int64_t)block.len_skip;
+
+    for (flag = len > 0 ? 0 : PATCH_CHUNK_FLAG_LAST;
+         !(flag & PATCH_CHUNK_FLAG_LAST);) {
+      if (patch_sz - off < (int64_t)(sizeof(size) + sizeof(flag))) {
+        return -1;
+      }
+      memcpy(&size, patch + off, sizeof(size));
+      flag = patch[off + sizeof(size)];
+      off += sizeof(size) + sizeof(flag);
+
+      if (PATCH_CHUNK_CODEC(flag) != BSDIFF_CODEC_ZERO) {
+        if (size > (uint64_t)(patch_sz - off)) {
+          return -1;
+        }
+        off += size;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int bsdiff_sa_build(bsdiff_stream_t *stream, const uint8_t *old,
+                    int64_t old_sz, int64_t *sa) {
+  int64_t *buffer;
+
+  buffer = stream->malloc((old_sz + 1) * sizeof(int64_t));
+  if (buffer == NULL) {
+    return -1;
+  }
+
+  qsufsort(sa, buffer, old, old_sz, NULL);
+  stream->free(buffer);
+
+  return 0;
+}
+
+/* The suffixes starting in a run new copies unchanged from old, at least
+ * SA_UPDATE_PREFIX bytes before the run ends, are sorted by that prefix in
+ * the order old_sa has them. The rest are sorted by the prefix and merged in,
+ * and prefix doubling finishes the groups that still tie, which for a small
+ * change are few.
+ */
+int bsdiff_sa_update(bsdiff_stream_t *stream, const uint8_t *old,
+                     int64_t old_sz, const int64_t *old_sa,
+                     const uint8_t *new, int64_t new_sz, const uint8_t *patch,
+                     int64_t patch_sz, int64_t *new_sa) {
+  int64_t *V, *back, *rest, *tmp;
+  int64_t i, k, run, next, kept, rest_sz, beg, l;
+  int sorted;
+
+  V = stream->malloc((new_sz + 1) * sizeof(int64_t));
+  back = stream->malloc((old_sz + 1) * sizeof(int64_t));
+  if (V == NULL || back == NULL ||
+      align_blocks(patch, patch_sz, old_sz, new_sz, V) != 0) {
+    stream->free(V);
+    stream->free(back);
+    return -1;
+  }
+
+  // V[i] stays the position in old only for the suffixes old_sa orders
+  run = 0;
+  next = -1;
+  for (i = new_sz - 1; i >= 0; i--) {
+    if (V[i] < 0 || new[i] != old[V[i]]) {
+      run = 0;
+    } else {
+      run = next == V[i] + 1 ? run + 1 : 1;
+    }
+    next = V[i];
+    if (run < SA_UPDATE_PREFIX) {
+      V[i] = -1;
+    }
+  }
+
+  // a byte of old copied twice keeps its order for one of them
+  for (i = 0; i < old_sz; i++) {
+    back[i] = -1;
+  }
+  rest_sz = 0;
+  for (i = 0; i < new_sz; i++) {
+    if (V[i] >= 0 && back[V[i]] < 0) {
+      back[V[i]] = i;
+    } else {
+      V[i] = -1;
+      rest_sz++;
+    }
+  }
+
+  kept = 0;
+  for (k = 1; k <= old_sz; k++) {
+    if (back[old_sa[k]] >= 0) {
+      new_sa[kept++] = back[old_sa[k]];
+    }
+  }
+  stream->free(back);
+
+  rest = stream->malloc((rest_sz + 1) * sizeof(int64_t));
+  tmp = stream->malloc((rest_sz + 1) * sizeof(int64_t));
+  if (rest == NULL || tmp == NULL) {
+    stream->free(rest);
+    stream->free(tmp);
+    stream->free(V);
+    return -1;
+  }
+
+  for (i = 0, k = 0; i < new_sz; i++) {
+    if (V[i] < 0) {
+      rest[k++] = i;
+    }
+  }
+  merge_sort(rest, tmp, rest_sz, new, new_sz);
+
+  // merge from the back, new_sa[1..] fills up behind the kept suffixes
+  for (i = kept, k = rest_sz; i + k > 0;) {
+    if (k == 0 || (i > 0 && prefix_cmp(new, new_sz, new_sa[i - 1],
+                                       rest[k - 1]) > 0)) {
+      new_sa[i + k] = new_sa[i - 1];
+      i--;
+    } else {
+      new_sa[i + k] = rest[k - 1];
+      k--;
+    }
+  }
+  stream->free(rest);
+  stream->free(tmp);
+
+  /* Neighbours that differ in the prefix close a group, as qsufsort_refine
+   * takes them. Most of the ties are in order already, old_sa put the copied
+   * suffixes where they belong, so a group found sorted within
+   * SA_UPDATE_VERIFY bytes is split into singletons.
+   */
+  sorted = 1;
+  for (k = 1, beg = 1; k <= new_sz; k++) {
+    l = k < new_sz ? verify_len(new, new_sz, new_sa[k], new_sa[k + 1]) : 0;
+    if (l >= SA_UPDATE_PREFIX) {
+      sorted =
+          sorted && sorted_before(new, new_sz, new_sa[k], new_sa[k + 1], l);
+      continue;
+    }
+
+    for (i = beg; i <= k; i++) {
+      if (sorted || beg == k) {
+        V[new_sa[i]] = i;
+        new_sa[i] = -1;
+      } else {
+        V[new_sa[i]] = k;
+      }
+    }
+    beg = k + 1;
+    sorted = 1;
+  }
+  new_sa[0] = -1;
+  V[new_sz] = 0;
+
+  qsufsort_refine(new_sa, V, new, new_sz, SA_UPDATE_PREFIX);
+  stream->free(V);
+
+  return 0;
+}
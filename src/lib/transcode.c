@@ -0,0 +1,222 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include <bsdiff/legacy/bsdiff.h>
+#include <fastlz.h>
+
+#include "helper.h"
+#include "rans.h"
+#include "writer.h"
+
+/* The data of the patch read from stream->read, as bspatch reads it: one
+ * chunk decoded at a time.
+ */
+typedef struct source {
+  bsdiff_stream_t *stream;
+
+  uint8_t compressed[FASTLZ_BUFFER_SIZE];
+  uint8_t decompressed[FASTLZ_BUFFER_SIZE];
+  uint64_t decompressed_size;
+  uint64_t cursor;
+  uint8_t flag;
+
+  rans_table_t table;
+} source_t;
+
+// reads all size bytes or fails
+static int read_all(bsdiff_stream_t *stream, void *buffer, int64_t size) {
+  int64_t total;
+  int n;
+
+  for (total = 0; total < size; total += n) {
+    n = stream->read(stream, (uint8_t *)buffer + total, size - total);
+    if (n <= 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void source_reset(source_t *src) {
+  src->decompressed_size = 0;
+  src->cursor = 0;
+  src->flag = 0;
+}
+
+static int source_next(source_t *src) {
+  uint64_t size;
+  int64_t n;
+
+  if (src->flag & PATCH_CHUNK_FLAG_LAST) {
+    return -1;
+  }
+
+  if (read_all(src->stream, &size, sizeof(size)) != 0 ||
+      read_all(src->stream, &src->flag, sizeof(src->flag)) != 0) {
+    return -1;
+  }
+
+  // a zero chunk has no payload, its size is the length of the run
+  if (PATCH_CHUNK_CODEC(src->flag) == BSDIFF_CODEC_ZERO) {
+    if (size == 0) {
+      return -1;
+    }
+    src->decompressed_size = size;
+    src->cursor = 0;
+    return 0;
+  }
+
+  if (size > FASTLZ_BUFFER_SIZE ||
+      read_all(src->stream, src->compressed, size) != 0) {
+    return -1;
+  }
+
+  switch (PATCH_CHUNK_CODEC(src->flag)) {
+  case BSDIFF_CODEC_FASTLZ:
+    n = fastlz_decompress(src->compressed, size, src->decompressed,
+                          FASTLZ_BUFFER_SIZE);
+    break;
+  case BSDIFF_CODEC_RANS:
+    n = rans_decompress(src->compressed, size, src->decompressed,
+                        FASTLZ_BUFFER_SIZE, &src->table);
+    break;
+  default:
+    return -1;
+  }
+
+  if (n <= 0) {
+    return -1;
+  }
+
+  src->decompressed_size = n;
+  src->cursor = 0;
+
+  return 0;
+}
+
+// the next len bytes of the data of the block, for writer_data
+static int source_fill(void *opaque, uint8_t *buffer, int64_t len) {
+  source_t *src;
+  int64_t i, n;
+
+  src = (source_t *)opaque;
+  for (i = 0; i < len; i += n) {
+    if (src->cursor >= src->decompressed_size && source_next(src) != 0) {
+      return -1;
+    }
+
+    n = MIN((uint64_t)(len - i), src->decompressed_size - src->cursor);
+    if (PATCH_CHUNK_CODEC(src->flag) == BSDIFF_CODEC_ZERO) {
+      memset(buffer + i, 0, n);
+    } else {
+      memcpy(buffer + i, src->decompressed + src->cursor, n);
+    }
+    src->cursor += n;
+  }
+
+  return 0;
+}
+
+/* The header goes through as it is, filter included, and so does every
+ * block header: only the data of the blocks is decoded and chunked again.
+ */
+int bsdiff_transcode(bsdiff_stream_t *stream, const bsdiff_config_t *config) {
+  bsdiff_header_v2_t header;
+  patch_block_t block;
+  writer_t writer;
+  source_t src;
+  uint64_t new_cursor, len;
+  int64_t header_sz;
+  int level, ret;
+
+  if (config->write_buffer_size < 0) {
+    return -1;
+  }
+  if (read_all(stream, &header, sizeof(bsdiff_header_t)) != 0) {
+    return -1;
+  }
+  header_sz = sizeof(bsdiff_header_t);
+  if (memcmp(header.signature, BSDIFF_SIGNATURE_V2, BSDIFF_SIGNATURE_LEN) ==
+      0) {
+    if (read_all(stream, &header.filter, sizeof(header.filter)) != 0) {
+      return -1;
+    }
+    header_sz = sizeof(header);
+  } else if (memcmp(header.signature, BSDIFF_SIGNATURE,
+                    BSDIFF_SIGNATURE_LEN) != 0) {
+    return -1;
+  }
+
+  if (writer_init(
+          &writer, stream,
+          MIN(MAX(config->write_buffer_size, (int64_t)CHUNK_FRAME_SIZE),
+              INT_MAX),
+          0) != 0) {
+    return -1;
+  }
+  writer_write(&writer, &header, header_sz);
+
+  src.stream = stream;
+  level = config->effort == BSDIFF_EFFORT_FAST ? 1 : 2;
+
+  ret = 0;
+  new_cursor = 0;
+  while (ret == 0 && new_cursor < header.new_sz) {
+    if (read_all(stream, &block, sizeof(block)) != 0 ||
+        block.len_diff > INT_MAX || block.len_extra > INT_MAX ||
+        block.len_diff + block.len_extra > header.new_sz - new_cursor) {
+      ret = -1;
+      break;
+    }
+    len = block.len_diff + block.len_extra;
+    writer_write(&writer, &block, sizeof(block));
+
+    source_reset(&src);
+    ret = writer_data(&writer, config->codec, level, config->zero_chunks, len,
+                      source_fill, &src);
+
+    // the data of the block ends with its last chunk
+    if (ret == 0 && len > 0 &&
+        (src.cursor != src.decompressed_size ||
+         !(src.flag & PATCH_CHUNK_FLAG_LAST))) {
+      ret = -1;
+    }
+    new_cursor += len;
+  }
+
+  if (ret == 0) {
+    ret = writer_flush(&writer);
+  }
+  writer_free(&writer);
+
+  return ret;
+}
@@ -0,0 +1,290 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include <fastlz.h>
+
+#include "helper.h"
+#include "rans.h"
+#include "writer.h"
+
+int writer_init(writer_t *w, bsdiff_stream_t *stream, int64_t cap,
+                uint8_t in_memory) {
+  w->stream = stream;
+  w->size = 0;
+  w->cap = cap;
+  w->in_memory = in_memory;
+  w->err = 0;
+
+  w->buffer = NULL;
+  if (cap > 0) {
+    w->buffer = stream->malloc(cap);
+    if (w->buffer == NULL) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int writer_grow(writer_t *w, int64_t len) {
+  uint8_t *buffer;
+  int64_t cap;
+
+  cap = w->cap > 0 ? w->cap : 4096;
+  while (cap < w->size + len) {
+    cap *= 2;
+  }
+
+  // the stream only offers malloc/free, so move the data by hand
+  buffer = w->stream->malloc(cap);
+  if (buffer == NULL) {
+    return -1;
+  }
+  if (w->buffer != NULL) {
+    memcpy(buffer, w->buffer, w->size);
+    w->stream->free(w->buffer);
+  }
+
+  w->buffer = buffer;
+  w->cap = cap;
+
+  return 0;
+}
+
+int writer_flush(writer_t *w) {
+  if (w->err) {
+    return -1;
+  }
+
+  if (w->in_memory || w->size == 0) {
+    return 0;
+  }
+
+  if (w->stream->write(w->stream, w->buffer, w->size) < 0) {
+    w->err = -1;
+    return -1;
+  }
+  w->size = 0;
+
+  return 0;
+}
+
+uint8_t *writer_reserve(writer_t *w, int64_t len) {
+  if (w->err) {
+    return NULL;
+  }
+
+  if (w->size + len <= w->cap) {
+    return w->buffer + w->size;
+  }
+
+  if (!w->in_memory && writer_flush(w) == 0 && len <= w->cap) {
+    return w->buffer;
+  }
+
+  if (w->err || writer_grow(w, len) != 0) {
+    w->err = -1;
+    return NULL;
+  }
+
+  return w->buffer + w->size;
+}
+
+void writer_commit(writer_t *w, int64_t len) { w->size += len; }
+
+int writer_write(writer_t *w, const void *data, int64_t len) {
+  uint8_t *dst;
+
+  // write through when the data can not be coalesced
+  if (!w->in_memory && len > w->cap) {
+    if (writer_flush(w) != 0) {
+      return -1;
+    }
+    if (w->stream->write(w->stream, data, len) < 0) {
+      w->err = -1;
+      return -1;
+    }
+    return 0;
+  }
+
+  dst = writer_reserve(w, len);
+  if (dst == NULL) {
+    return -1;
+  }
+  memcpy(dst, data, len);
+  writer_commit(w, len);
+
+  return 0;
+}
+
+uint8_t *writer_detach(writer_t *w, int64_t *size) {
+  uint8_t *buffer;
+
+  buffer = w->buffer;
+  *size = w->size;
+
+  w->buffer = NULL;
+  w->size = 0;
+  w->cap = 0;
+
+  return buffer;
+}
+
+void writer_free(writer_t *w) {
+  if (w->buffer != NULL) {
+    w->stream->free(w->buffer);
+    w->buffer = NULL;
+  }
+}
+
+void writer_chunk(writer_t *w, uint8_t codec, int level, const uint8_t *data,
+                  int64_t len, uint8_t last) {
+  uint8_t rans_buffer[FASTLZ_BUFFER_SIZE];
+  uint8_t *frame, *out, *rans_out;
+  uint64_t out_sz;
+  int64_t rans_sz;
+  uint8_t used;
+
+  /* Compress straight into the output buffer, the frame header in front of
+   * the payload is filled once the payload size is known.
+   */
+  frame = writer_reserve(w, CHUNK_FRAME_SIZE);
+  if (frame == NULL) {
+    return;
+  }
+  out = frame + sizeof(out_sz) + sizeof(uint8_t);
+
+  used = BSDIFF_CODEC_FASTLZ;
+  out_sz = 0;
+
+  if (codec != BSDIFF_CODEC_RANS) {
+    out_sz = fastlz_compress_level(level, data, len, out);
+  }
+
+  if (codec != BSDIFF_CODEC_FASTLZ) {
+    rans_out = codec == BSDIFF_CODEC_RANS ? out : rans_buffer;
+    rans_sz = rans_compress(data, len, rans_out, FASTLZ_BUFFER_SIZE);
+    if (rans_sz > 0 && (out_sz == 0 || (uint64_t)rans_sz < out_sz)) {
+      if (rans_out != out) {
+        memcpy(out, rans_out, rans_sz);
+      }
+      out_sz = rans_sz;
+      used = BSDIFF_CODEC_RANS;
+    }
+  }
+
+  /* rANS gives up when its output does not fit in the chunk buffer of the
+   * patching side, fall back to FastLZ then.
+   */
+  if (out_sz == 0) {
+    out_sz = fastlz_compress_level(level, data, len, out);
+  }
+
+  memcpy(frame, &out_sz, sizeof(out_sz));
+  frame[sizeof(out_sz)] = PATCH_CHUNK_FLAG(used, last);
+  writer_commit(w, out - frame + out_sz);
+}
+
+void writer_zero_chunk(writer_t *w, uint64_t len, uint8_t last) {
+  uint8_t frame[sizeof(len) + sizeof(uint8_t)];
+
+  memcpy(frame, &len, sizeof(len));
+  frame[sizeof(len)] = PATCH_CHUNK_FLAG(BSDIFF_CODEC_ZERO, last);
+  writer_write(w, frame, sizeof(frame));
+}
+
+// length of the run of zeros at the start of data
+static int64_t zero_run(const uint8_t *data, int64_t len) {
+  int64_t i;
+
+  for (i = 0; i < len && data[i] == 0; i++) {
+  }
+
+  return i;
+}
+
+// length of data before the first run of at least ZERO_RUN_MIN zeros
+static int64_t nonzero_run(const uint8_t *data, int64_t len) {
+  int64_t i, zeros;
+
+  zeros = 0;
+  for (i = 0; i < len; i++) {
+    zeros = data[i] == 0 ? zeros + 1 : 0;
+    if (zeros == ZERO_RUN_MIN) {
+      return i + 1 - ZERO_RUN_MIN;
+    }
+  }
+
+  return len;
+}
+
+int writer_data(writer_t *w, uint8_t codec, int level, uint8_t zero_chunks,
+                int64_t len, writer_fill_t fill, void *opaque) {
+  uint8_t buffer[FASTLZ_INPUT_SIZE];
+  int64_t have, left, run, n;
+
+  have = 0;
+  left = len;
+  while (have > 0 || left > 0) {
+    n = MIN(FASTLZ_INPUT_SIZE - have, left);
+    if (fill(opaque, buffer + have, n) != 0) {
+      return -1;
+    }
+    have += n;
+    left -= n;
+
+    n = have;
+    if (zero_chunks) {
+      // only a full buffer of zeros is refilled, so run is 0 or long
+      run = 0;
+      while ((n = zero_run(buffer, have)) == have && left > 0) {
+        run += have;
+        have = MIN(FASTLZ_INPUT_SIZE, left);
+        if (fill(opaque, buffer, have) != 0) {
+          return -1;
+        }
+        left -= have;
+      }
+      if (run + n >= ZERO_RUN_MIN) {
+        writer_zero_chunk(w, run + n, n == have && left == 0);
+        memmove(buffer, buffer + n, have - n);
+        have -= n;
+        continue;
+      }
+      n = nonzero_run(buffer, have);
+    }
+
+    writer_chunk(w, codec, level, buffer, n, n == have && left == 0);
+    memmove(buffer, buffer + n, have - n);
+    have -= n;
+  }
+
+  return w->err;
+}
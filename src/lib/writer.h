@@ -0,0 +1,96 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2012 Matthew Endsley
+ * Copyright 2022 Yue Yu
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BSDIFF_WRITER_H_
+#define _BSDIFF_WRITER_H_
+
+#include <stdint.h>
+
+#include <bsdiff/legacy/bsdiff.h>
+
+/**
+ * Output buffer of the diff. Block headers and chunk frames are coalesced in
+ * it and handed to stream->write in large pieces. In memory mode the buffer
+ * grows instead of being flushed, and becomes the patch itself.
+ *
+ * Errors are sticky: once a write fails, err is set and later writes are
+ * dropped, so callers only need to check err at the end.
+ */
+typedef struct writer {
+  bsdiff_stream_t *stream;
+
+  uint8_t *buffer;
+  int64_t size;
+  int64_t cap;
+
+  uint8_t in_memory;
+  int err;
+} writer_t;
+
+int writer_init(writer_t *w, bsdiff_stream_t *stream, int64_t cap,
+                uint8_t in_memory);
+
+/* Returns space for at least len bytes at the tail, NULL on failure. */
+uint8_t *writer_reserve(writer_t *w, int64_t len);
+
+void writer_commit(writer_t *w, int64_t len);
+
+int writer_write(writer_t *w, const void *data, int64_t len);
+
+int writer_flush(writer_t *w);
+
+/**
+ * Compresses len bytes of block data, at most FASTLZ_INPUT_SIZE, into one
+ * chunk with codec, a BSDIFF_CODEC_* or BSDIFF_CODEC_AUTO, and FastLZ at
+ * level. last marks the last chunk of the block.
+ */
+void writer_chunk(writer_t *w, uint8_t codec, int level, const uint8_t *data,
+                  int64_t len, uint8_t last);
+
+/* A BSDIFF_CODEC_ZERO chunk of len zeros. */
+void writer_zero_chunk(writer_t *w, uint64_t len, uint8_t last);
+
+/* Fills buffer with the next len bytes of block data, len is at most
+ * FASTLZ_INPUT_SIZE. Returns 0 on success.
+ */
+typedef int (*writer_fill_t)(void *opaque, uint8_t *buffer, int64_t len);
+
+/**
+ * Writes len bytes of block data as chunks. The data need not be in memory
+ * as a whole: fill generates it a buffer at a time. With zero_chunks, a run
+ * of zeros goes out as one zero chunk, however many buffers it spans.
+ */
+int writer_data(writer_t *w, uint8_t codec, int level, uint8_t zero_chunks,
+                int64_t len, writer_fill_t fill, void *opaque);
+
+/* Hands the buffer of a memory mode writer over to the caller. */
+uint8_t *writer_detach(writer_t *w, int64_t *size);
+
+void writer_free(writer_t *w);
+
+#endif // _BSDIFF_WRITER_H_
@@ -0,0 +1,122 @@
+#include "apply.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define new new_image
+#include <bsdiff/bspatch.h>
+#undef new
+
+const int apply_success = BSPATCH_SUCCESS;
+const int apply_in_place_err = BSPATCH_IN_PLACE_ERR;
+
+namespace {
+
+// an image that grows as it is written past its end
+struct image {
+  std::vector<uint8_t> *data;
+  size_t sz; // what len tells, the size of old
+};
+
+size_t image_read(const bsdiff_array_like_t *arr, size_t offset, void *buffer,
+                  size_t size) {
+  const image *im = static_cast<const image *>(arr->opaque);
+
+  if (offset + size > im->data->size()) {
+    return 0;
+  }
+  memcpy(buffer, im->data->data() + offset, size);
+  return size;
+}
+
+size_t image_write(bsdiff_array_like_t *arr, size_t offset, void *buffer,
+                   size_t size) {
+  image *im = static_cast<image *>(arr->opaque);
+
+  if (offset + size > im->data->size()) {
+    im->data->resize(offset + size);
+  }
+  memcpy(im->data->data() + offset, buffer, size);
+  return size;
+}
+
+size_t image_len(bsdiff_array_like_t *arr) {
+  return static_cast<const image *>(arr->opaque)->sz;
+}
+
+bsdiff_array_like_t make_image(image *im) {
+  bsdiff_array_like_t arr;
+
+  arr.opaque = im;
+  arr.read = image_read;
+  arr.write = image_write;
+  arr.len = image_len;
+  return arr;
+}
+
+struct reader {
+  const std::vector<uint8_t> *patch;
+  size_t pos;
+};
+
+size_t patch_read(const bsdiff_stream_t *fs, void *buffer, size_t size) {
+  reader *r = static_cast<reader *>(fs->opaque);
+  size_t n = std::min(size, r->patch->size() - r->pos);
+
+  memcpy(buffer, r->patch->data() + r->pos, n);
+  r->pos += n;
+  return n;
+}
+
+int patch_rewind(const bsdiff_stream_t *fs) {
+  static_cast<reader *>(fs->opaque)->pos = 0;
+  return 0;
+}
+
+bsdiff_stream_t make_patch(reader *r, bool rewind) {
+  bsdiff_stream_t stream;
+
+  stream.opaque = r;
+  stream.read = patch_read;
+  stream.write = nullptr;
+  stream.rewind = rewind ? patch_rewind : nullptr;
+  return stream;
+}
+
+} // namespace
+
+int apply_in_place(std::vector<uint8_t> &data,
+                   const std::vector<uint8_t> &patch, bool rewind) {
+  image im = {&data, data.size()};
+  bsdiff_array_like_t old = make_image(&im);
+  reader r = {&patch, 0};
+  bsdiff_stream_t stream = make_patch(&r, rewind);
+  size_t new_sz;
+  int ret;
+
+  ret = bspatch(&old, &stream, &new_sz);
+  if (ret == BSPATCH_SUCCESS) {
+    data.resize(new_sz);
+  }
+  return ret;
+}
+
+int apply_to(const std::vector<uint8_t> &data,
+             const std::vector<uint8_t> &patch, std::vector<uint8_t> &out) {
+  image old_im = {const_cast<std::vector<uint8_t> *>(&data), data.size()};
+  image new_im = {&out, 0};
+  bsdiff_array_like_t old = make_image(&old_im);
+  bsdiff_array_like_t new_arr = make_image(&new_im);
+  reader r = {&patch, 0};
+  bsdiff_stream_t stream = make_patch(&r, false);
+  size_t new_sz;
+  int ret;
+
+  old.write = nullptr; // old is only read
+  out.clear();
+  ret = bspatch_to(&old, &new_arr, &stream, &new_sz);
+  if (ret == BSPATCH_SUCCESS) {
+    out.resize(new_sz);
+  }
+  return ret;
+}
@@ -0,0 +1,25 @@
+#ifndef _BSDIFF_TEST_APPLY_H_
+#define _BSDIFF_TEST_APPLY_H_
+
+#include <cstdint>
+#include <vector>
+
+// The patch side has a bsdiff_stream of its own, so it cannot share a
+// translation unit with legacy/bsdiff.h.
+
+// bspatch over image, old before and new after; with rewind, the patch can be
+// checked before old is written. Returns BSPATCH_*.
+int apply_in_place(std::vector<uint8_t> &image,
+                   const std::vector<uint8_t> &patch, bool rewind);
+
+// bspatch_to from old to a separate new. Returns BSPATCH_*.
+int apply_to(const std::vector<uint8_t> &old,
+             const std::vector<uint8_t> &patch,
+             std::vector<uint8_t> &new_image);
+
+// BSPATCH_SUCCESS and BSPATCH_IN_PLACE_ERR, for the tests that cannot include
+// bspatch.h
+extern const int apply_success;
+extern const int apply_in_place_err;
+
+#endif // _BSDIFF_TEST_APPLY_H_
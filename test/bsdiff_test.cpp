@@ -0,0 +1,230 @@
+#include <gtest/gtest.h>
+
+#include "apply.h"
+#include "diff.h"
+
+namespace {
+
+const std::vector<uint8_t> old_image = random_image(96 * 1024, 1);
+const std::vector<uint8_t> new_image = next_release(old_image, 2);
+
+// the patch applies both in place and to a separate new
+void expect_applies(const std::vector<uint8_t> &old,
+                    const std::vector<uint8_t> &expected,
+                    const std::vector<uint8_t> &patch) {
+  std::vector<uint8_t> image = old;
+  std::vector<uint8_t> out;
+
+  ASSERT_FALSE(patch.empty());
+  EXPECT_EQ(apply_to(old, patch, out), apply_success);
+  EXPECT_EQ(out, expected);
+  EXPECT_EQ(apply_in_place(image, patch, true), apply_success);
+  EXPECT_EQ(image, expected);
+}
+
+} // namespace
+
+TEST(bsdiff, engines_and_codecs) {
+  const uint8_t engines[] = {
+      BSDIFF_ENGINE_SUFFIX_ARRAY, BSDIFF_ENGINE_HASH, BSDIFF_ENGINE_FM_INDEX,
+      BSDIFF_ENGINE_SPARSE_SUFFIX_ARRAY};
+  const uint8_t codecs[] = {BSDIFF_CODEC_FASTLZ, BSDIFF_CODEC_RANS,
+                            BSDIFF_CODEC_AUTO};
+  bsdiff_config_t config;
+
+  for (uint8_t engine : engines) {
+    for (uint8_t codec : codecs) {
+      for (uint8_t zero_chunks = 0; zero_chunks < 2; zero_chunks++) {
+        SCOPED_TRACE(testing::Message() << "engine " << int(engine)
+                                        << " codec " << int(codec)
+                                        << " zero_chunks " << int(zero_chunks));
+        bsdiff_config_init(&config);
+        config.engine = engine;
+        config.codec = codec;
+        config.zero_chunks = zero_chunks;
+
+        std::vector<uint8_t> patch = diff_mem(old_image, new_image, config);
+        expect_applies(old_image, new_image, patch);
+        EXPECT_EQ(diff_ex(old_image, new_image, config), patch);
+      }
+    }
+  }
+}
+
+TEST(bsdiff, efforts) {
+  bsdiff_config_t config;
+
+  for (uint8_t effort = BSDIFF_EFFORT_FAST; effort <= BSDIFF_EFFORT_MAX;
+       effort++) {
+    SCOPED_TRACE(testing::Message() << "effort " << int(effort));
+    bsdiff_config_init(&config);
+    config.effort = effort;
+    expect_applies(old_image, new_image,
+                   diff_mem(old_image, new_image, config));
+    config.lookahead = 1;
+    expect_applies(old_image, new_image,
+                   diff_mem(old_image, new_image, config));
+  }
+}
+
+TEST(bsdiff, sorting) {
+  bsdiff_config_t config;
+
+  bsdiff_config_init(&config);
+  config.lazy_sort = 1;
+  expect_applies(old_image, new_image, diff_mem(old_image, new_image, config));
+  config.search_keys = 1;
+  expect_applies(old_image, new_image, diff_mem(old_image, new_image, config));
+
+  byte_pipe p = {nullptr, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+  std::vector<int64_t> sa(old_image.size() + 1);
+  ASSERT_EQ(bsdiff_sa_build(&stream, old_image.data(), old_image.size(),
+                            sa.data()),
+            0);
+  bsdiff_config_init(&config);
+  config.old_sa = sa.data();
+  expect_applies(old_image, new_image, diff_mem(old_image, new_image, config));
+}
+
+TEST(bsdiff, budgets) {
+  bsdiff_config_t config;
+
+  // an index of a window of old at a time, placed by the coarse index or not
+  for (uint8_t in_place = 0; in_place < 2; in_place++) {
+    SCOPED_TRACE(testing::Message() << "in_place " << int(in_place));
+    bsdiff_config_init(&config);
+    config.memory_budget = 64 * 1024;
+    config.in_place = in_place;
+
+    std::vector<uint8_t> patch = diff_mem(old_image, new_image, config);
+    std::vector<uint8_t> out;
+    ASSERT_FALSE(patch.empty());
+    EXPECT_EQ(apply_to(old_image, patch, out), apply_success);
+    EXPECT_EQ(out, new_image);
+  }
+
+  bsdiff_config_init(&config);
+  config.time_budget = 1;
+  expect_applies(old_image, new_image, diff_mem(old_image, new_image, config));
+
+  bsdiff_config_init(&config);
+  config.memory_budget = -1;
+  EXPECT_TRUE(diff_mem(old_image, new_image, config).empty());
+}
+
+TEST(bsdiff, filter) {
+  bsdiff_config_t config;
+
+  bsdiff_config_init(&config);
+  config.filter = BSDIFF_FILTER_X86;
+  std::vector<uint8_t> patch = diff_mem(old_image, new_image, config);
+  expect_applies(old_image, new_image, patch);
+  EXPECT_EQ(diff_ex(old_image, new_image, config), patch);
+}
+
+TEST(bsdiff, edge_images) {
+  const std::vector<uint8_t> empty;
+  bsdiff_config_t config;
+
+  bsdiff_config_init(&config);
+  expect_applies(old_image, old_image, diff_mem(old_image, old_image, config));
+  expect_applies(old_image, empty, diff_mem(old_image, empty, config));
+  expect_applies(empty, new_image, diff_mem(empty, new_image, config));
+}
+
+TEST(bsdiff, streaming) {
+  byte_pipe p = {&new_image, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+  bsdiff_config_t config;
+  std::vector<uint8_t> patch, out;
+  int64_t new_sz;
+
+  bsdiff_config_init(&config);
+  ASSERT_EQ(bsdiff_streaming(old_image.data(), old_image.size(), &stream,
+                             &config, &new_sz),
+            0);
+  ASSERT_EQ(new_sz, static_cast<int64_t>(new_image.size()));
+
+  // the header goes first, once the size of new is known
+  append_header(patch, new_sz, BSDIFF_FILTER_NONE);
+  patch.insert(patch.end(), p.out.begin(), p.out.end());
+  EXPECT_EQ(apply_to(old_image, patch, out), apply_success);
+  EXPECT_EQ(out, new_image);
+}
+
+TEST(bsdiff, bundle) {
+  const std::vector<uint8_t> old_a = random_image(64 * 1024, 3);
+  const std::vector<uint8_t> old_b = random_image(32 * 1024, 4);
+  const std::vector<uint8_t> new_files[] = {next_release(old_a, 5),
+                                            next_release(old_b, 6)};
+  const uint8_t *news[] = {new_files[0].data(), new_files[1].data()};
+  const int64_t new_szs[] = {static_cast<int64_t>(new_files[0].size()),
+                             static_cast<int64_t>(new_files[1].size())};
+  uint8_t *patches[2];
+  int64_t patch_szs[2];
+  byte_pipe p = {nullptr, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+  bsdiff_config_t config;
+
+  // the old files laid end to end
+  std::vector<uint8_t> old = old_a;
+  old.insert(old.end(), old_b.begin(), old_b.end());
+
+  bsdiff_config_init(&config);
+  config.threads = 2;
+  ASSERT_EQ(bsdiff_bundle(old.data(), old.size(), news, new_szs, 2, &stream,
+                          &config, patches, patch_szs),
+            0);
+  for (int i = 0; i < 2; i++) {
+    std::vector<uint8_t> patch(patches[i], patches[i] + patch_szs[i]);
+    std::vector<uint8_t> out;
+
+    free(patches[i]);
+    EXPECT_EQ(apply_to(old, patch, out), apply_success);
+    EXPECT_EQ(out, new_files[i]);
+  }
+}
+
+TEST(bsdiff, estimate) {
+  byte_pipe p = {nullptr, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+  bsdiff_config_t config;
+  bsdiff_estimate_t estimate;
+
+  bsdiff_config_init(&config);
+  ASSERT_EQ(bsdiff_estimate(old_image.data(), old_image.size(),
+                            new_image.data(), new_image.size(), &stream,
+                            &config, &estimate),
+            0);
+  EXPECT_GT(estimate.patch_sz, static_cast<int64_t>(sizeof(bsdiff_header_t)));
+  EXPECT_GE(estimate.diff_ms, 0);
+  EXPECT_TRUE(p.out.empty());
+}
+
+TEST(bspatch, refuses_what_cannot_apply_in_place) {
+  const std::vector<uint8_t> new_rotated = rotated(old_image);
+  bsdiff_apply_cost_t cost;
+  bsdiff_config_t config;
+  std::vector<uint8_t> image = old_image;
+  std::vector<uint8_t> out;
+
+  bsdiff_config_init(&config);
+  config.in_place = 0;
+  config.apply_cost = &cost;
+  std::vector<uint8_t> patch = diff_mem(old_image, new_rotated, config);
+  ASSERT_FALSE(patch.empty());
+  ASSERT_GT(cost.unreadable, 0);
+
+  // checked as a whole before old is written, and refused
+  EXPECT_EQ(apply_in_place(image, patch, true), apply_in_place_err);
+  EXPECT_EQ(image, old_image);
+  EXPECT_EQ(apply_to(old_image, patch, out), apply_success);
+  EXPECT_EQ(out, new_rotated);
+
+  // kept applicable in place
+  config.in_place = 1;
+  patch = diff_mem(old_image, new_rotated, config);
+  EXPECT_EQ(cost.unreadable, 0);
+  expect_applies(old_image, new_rotated, patch);
+}
@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+
+#include "apply.h"
+#include "diff.h"
+
+namespace {
+
+std::vector<uint8_t> compose(const std::vector<uint8_t> &first,
+                             const std::vector<uint8_t> &second,
+                             const bsdiff_config_t &config) {
+  byte_pipe p = {nullptr, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+
+  if (bsdiff_compose(first.data(), first.size(), second.data(), second.size(),
+                     &stream, &config) != 0) {
+    return {};
+  }
+  return p.out;
+}
+
+} // namespace
+
+TEST(compose, applies_to_the_last_release) {
+  const std::vector<uint8_t> v1 = random_image(96 * 1024, 7);
+  const std::vector<uint8_t> v2 = next_release(v1, 8);
+  const std::vector<uint8_t> v3 = next_release(v2, 9);
+  const uint8_t filters[] = {BSDIFF_FILTER_NONE, BSDIFF_FILTER_X86};
+  bsdiff_config_t config;
+
+  for (uint8_t filter : filters) {
+    SCOPED_TRACE(testing::Message() << "filter " << int(filter));
+    bsdiff_config_init(&config);
+    config.filter = filter;
+    std::vector<uint8_t> p12 = diff_mem(v1, v2, config);
+    std::vector<uint8_t> p23 = diff_mem(v2, v3, config);
+    std::vector<uint8_t> out;
+    ASSERT_FALSE(p12.empty());
+    ASSERT_FALSE(p23.empty());
+
+    config.codec = BSDIFF_CODEC_RANS;
+    std::vector<uint8_t> p13 = compose(p12, p23, config);
+    ASSERT_FALSE(p13.empty());
+    EXPECT_EQ(apply_to(v1, p13, out), apply_success);
+    EXPECT_EQ(out, v3);
+  }
+}
+
+TEST(compose, refuses_mixed_filters) {
+  const std::vector<uint8_t> v1 = random_image(32 * 1024, 10);
+  const std::vector<uint8_t> v2 = next_release(v1, 11);
+  bsdiff_config_t config;
+
+  bsdiff_config_init(&config);
+  std::vector<uint8_t> plain = diff_mem(v1, v2, config);
+  config.filter = BSDIFF_FILTER_X86;
+  std::vector<uint8_t> filtered = diff_mem(v2, v1, config);
+  EXPECT_TRUE(compose(plain, filtered, config).empty());
+}
@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <zlib.h>
+
+extern "C" {
+#include "deflate.h"
+}
+
+namespace {
+
+// data as a gzip member, compressed at the given zlib level
+std::vector<uint8_t> gzip(const std::vector<uint8_t> &data, int level) {
+  std::vector<uint8_t> out(compressBound(data.size()) + 32);
+  z_stream z = {};
+
+  deflateInit2(&z, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+  z.next_in = const_cast<uint8_t *>(data.data());
+  z.avail_in = data.size();
+  z.next_out = out.data();
+  z.avail_out = out.size();
+  deflate(&z, Z_FINISH);
+  out.resize(z.total_out);
+  deflateEnd(&z);
+  return out;
+}
+
+} // namespace
+
+TEST(deflate, expands_and_compresses_back) {
+  std::vector<uint8_t> raw(64 * 1024);
+  std::vector<uint8_t> image(1000, 0xaa);
+  bsdiff_deflate_stream_t *streams;
+  uint32_t count;
+  size_t expanded_sz;
+
+  for (size_t i = 0; i < raw.size(); i++) {
+    raw[i] = static_cast<uint8_t>((i * 7) ^ (i >> 5));
+  }
+  for (int level : {6, 9}) {
+    std::vector<uint8_t> member = gzip(raw, level);
+    image.insert(image.end(), member.begin(), member.end());
+  }
+  image.insert(image.end(), 1000, 0x55);
+
+  ASSERT_EQ(deflate_find(image.data(), image.size(), 1, &streams, &count), 0);
+  ASSERT_EQ(count, 2u);
+  EXPECT_EQ(streams[0].raw_len, raw.size());
+
+  uint8_t *expanded = deflate_expand(image.data(), image.size(), streams,
+                                     count, &expanded_sz);
+  ASSERT_NE(expanded, nullptr);
+  EXPECT_EQ(expanded_sz,
+            image.size() - streams[0].len - streams[1].len + 2 * raw.size());
+  // nothing is expanded before the first stream
+  EXPECT_EQ(memcmp(expanded + streams[0].offset, raw.data(), raw.size()), 0);
+
+  uint8_t *compressed = deflate_compress(expanded, expanded_sz, streams, count,
+                                         image.size());
+  ASSERT_NE(compressed, nullptr);
+  EXPECT_EQ(memcmp(compressed, image.data(), image.size()), 0);
+
+  free(compressed);
+  free(expanded);
+  free(streams);
+}
@@ -0,0 +1,137 @@
+#ifndef _BSDIFF_TEST_DIFF_H_
+#define _BSDIFF_TEST_DIFF_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// the headers name parameters new, which is a keyword in C++
+#define new new_image
+#include <bsdiff/legacy/bsdiff.h>
+#undef new
+
+// what a stream reads from and writes to
+struct byte_pipe {
+  const std::vector<uint8_t> *in;
+  size_t in_pos;
+  std::vector<uint8_t> out;
+};
+
+inline int pipe_write(bsdiff_stream_t *stream, const void *buffer, int size) {
+  byte_pipe *p = static_cast<byte_pipe *>(stream->opaque);
+  const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+
+  p->out.insert(p->out.end(), bytes, bytes + size);
+  return 0;
+}
+
+inline int pipe_read(bsdiff_stream_t *stream, void *buffer, int size) {
+  byte_pipe *p = static_cast<byte_pipe *>(stream->opaque);
+  size_t n = std::min(static_cast<size_t>(size), p->in->size() - p->in_pos);
+
+  memcpy(buffer, p->in->data() + p->in_pos, n);
+  p->in_pos += n;
+  return static_cast<int>(n);
+}
+
+inline bsdiff_stream_t make_stream(byte_pipe *p) {
+  bsdiff_stream_t stream;
+
+  stream.opaque = p;
+  stream.malloc = malloc;
+  stream.free = free;
+  stream.write = pipe_write;
+  stream.read = pipe_read;
+  return stream;
+}
+
+// bytes of a small alphabet, so that they match and compress a little, as
+// code does
+inline std::vector<uint8_t> random_image(size_t sz, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<uint8_t> image(sz);
+
+  for (auto &b : image) {
+    b = static_cast<uint8_t>(rng() % 48);
+  }
+  return image;
+}
+
+// old as the next release of an image differs from it: a byte changed every
+// so often, code inserted and cut out, and a page of padding
+inline std::vector<uint8_t> next_release(const std::vector<uint8_t> &old,
+                                         uint32_t seed) {
+  std::vector<uint8_t> image = old;
+  std::vector<uint8_t> inserted = random_image(3000, seed);
+
+  for (size_t i = seed % 997; i < image.size(); i += 997) {
+    image[i] += 1;
+  }
+  image.erase(image.begin() + image.size() * 2 / 3,
+              image.begin() + image.size() * 2 / 3 + 2000);
+  image.insert(image.begin() + image.size() / 2, 8192, 0);
+  image.insert(image.begin() + image.size() / 3, inserted.begin(),
+               inserted.end());
+  return image;
+}
+
+// the two halves of old swapped, which reads old behind where new is written
+inline std::vector<uint8_t> rotated(const std::vector<uint8_t> &old) {
+  std::vector<uint8_t> image(old.begin() + old.size() / 2, old.end());
+
+  image.insert(image.end(), old.begin(), old.begin() + old.size() / 2);
+  return image;
+}
+
+inline void append_header(std::vector<uint8_t> &patch, uint64_t new_sz,
+                          uint8_t filter) {
+  bsdiff_header_v2_t header;
+
+  memcpy(header.signature,
+         filter == BSDIFF_FILTER_NONE ? BSDIFF_SIGNATURE : BSDIFF_SIGNATURE_V2,
+         BSDIFF_SIGNATURE_LEN);
+  header.new_sz = new_sz;
+  header.filter = filter;
+  patch.insert(patch.end(), reinterpret_cast<uint8_t *>(&header),
+               reinterpret_cast<uint8_t *>(&header) +
+                   (filter == BSDIFF_FILTER_NONE ? sizeof(bsdiff_header_t)
+                                                 : sizeof(header)));
+}
+
+// the whole patch from bsdiff_mem, empty when it fails
+inline std::vector<uint8_t> diff_mem(const std::vector<uint8_t> &old,
+                                     const std::vector<uint8_t> &new_image,
+                                     const bsdiff_config_t &config) {
+  byte_pipe p = {nullptr, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+  uint8_t *patch;
+  int64_t patch_sz;
+
+  if (bsdiff_mem(old.data(), old.size(), new_image.data(), new_image.size(),
+                 &stream, &config, &patch, &patch_sz) != 0) {
+    return {};
+  }
+  std::vector<uint8_t> out(patch, patch + patch_sz);
+  free(patch);
+  return out;
+}
+
+// the whole patch from bsdiff_ex, after the header it leaves to the caller
+inline std::vector<uint8_t> diff_ex(const std::vector<uint8_t> &old,
+                                    const std::vector<uint8_t> &new_image,
+                                    const bsdiff_config_t &config) {
+  byte_pipe p = {nullptr, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+
+  append_header(p.out, new_image.size(), config.filter);
+  if (bsdiff_ex(old.data(), old.size(), new_image.data(), new_image.size(),
+                &stream, &config) != 0) {
+    return {};
+  }
+  return p.out;
+}
+
+#endif // _BSDIFF_TEST_DIFF_H_
@@ -1,6 +0,0 @@
-#include <gtest/gtest.h>
-
-TEST(dummy, dummy_test) {
-  // a dummy test
-  EXPECT_EQ(1, 1);
-}
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include <gtest/gtest.h>
+
+#include "apply.h"
+#include "diff.h"
+
+namespace {
+
+std::vector<int64_t> sa_build(const std::vector<uint8_t> &image) {
+  byte_pipe p = {nullptr, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+  std::vector<int64_t> sa(image.size() + 1);
+
+  if (bsdiff_sa_build(&stream, image.data(), image.size(), sa.data()) != 0) {
+    return {};
+  }
+  return sa;
+}
+
+} // namespace
+
+TEST(sa_update, matches_a_fresh_sort) {
+  std::vector<uint8_t> old = random_image(96 * 1024, 14);
+  std::vector<int64_t> old_sa = sa_build(old);
+  byte_pipe p = {nullptr, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+  bsdiff_config_t config;
+
+  // along a chain of releases, each diff takes the suffix array of the last
+  for (uint32_t seed = 15; seed < 18; seed++) {
+    SCOPED_TRACE(testing::Message() << "release " << seed);
+    std::vector<uint8_t> new_image = next_release(old, seed);
+    std::vector<int64_t> new_sa(new_image.size() + 1);
+    std::vector<uint8_t> out;
+
+    bsdiff_config_init(&config);
+    config.old_sa = old_sa.data();
+    std::vector<uint8_t> patch = diff_mem(old, new_image, config);
+    ASSERT_FALSE(patch.empty());
+    EXPECT_EQ(apply_to(old, patch, out), apply_success);
+    EXPECT_EQ(out, new_image);
+
+    ASSERT_EQ(bsdiff_sa_update(&stream, old.data(), old.size(), old_sa.data(),
+                               new_image.data(), new_image.size(),
+                               patch.data(), patch.size(), new_sa.data()),
+              0);
+    EXPECT_EQ(new_sa, sa_build(new_image));
+
+    old = new_image;
+    old_sa = new_sa;
+  }
+}
@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+
+#include "apply.h"
+#include "diff.h"
+
+namespace {
+
+std::vector<uint8_t> transcode(const std::vector<uint8_t> &patch,
+                               const bsdiff_config_t &config) {
+  byte_pipe p = {&patch, 0, {}};
+  bsdiff_stream_t stream = make_stream(&p);
+
+  if (bsdiff_transcode(&stream, &config) != 0) {
+    return {};
+  }
+  return p.out;
+}
+
+} // namespace
+
+TEST(transcode, writes_the_patch_bsdiff_would) {
+  const std::vector<uint8_t> old = random_image(96 * 1024, 12);
+  const std::vector<uint8_t> new_image = next_release(old, 13);
+  const uint8_t codecs[] = {BSDIFF_CODEC_FASTLZ, BSDIFF_CODEC_RANS,
+                            BSDIFF_CODEC_AUTO};
+  bsdiff_config_t config;
+
+  bsdiff_config_init(&config);
+  config.zero_chunks = 1;
+  std::vector<uint8_t> patch = diff_mem(old, new_image, config);
+  ASSERT_FALSE(patch.empty());
+
+  for (uint8_t codec : codecs) {
+    for (uint8_t zero_chunks = 0; zero_chunks < 2; zero_chunks++) {
+      SCOPED_TRACE(testing::Message() << "codec " << int(codec)
+                                      << " zero_chunks " << int(zero_chunks));
+      config.codec = codec;
+      config.zero_chunks = zero_chunks;
+      std::vector<uint8_t> out = transcode(patch, config);
+      std::vector<uint8_t> image = old;
+
+      // the blocks stay as they are, only the data is chunked again
+      EXPECT_EQ(out, diff_mem(old, new_image, config));
+      EXPECT_EQ(apply_in_place(image, out, true), apply_success);
+      EXPECT_EQ(image, new_image);
+    }
+  }
+}